@@ -0,0 +1,252 @@
+"""Benchmarks for the core MATree operations on seeded synthetic trees.
+
+Trees are generated with MATree.from_simulation and cached as .pb.gz files (with a matching reference FASTA and GTF) in the work
+directory, so repeated runs and runs on different builds measure exactly the same input. Each operation runs in a fresh child
+process, which loads the tree, resets its peak memory counter, and then times the operation. Results are written as JSON lines,
+one record per tree size and operation, and two result files can be compared with --compare.
+
+Examples:
+    python3 benchmark.py --sizes 10000,100000 --output results.jsonl
+    python3 benchmark.py --sizes 1000000 --operations from_pb,count_haplotypes --repeats 1 --output results.jsonl
+    python3 benchmark.py --compare baseline.jsonl results.jsonl --fail-above 1.2
+"""
+import argparse
+import json
+import multiprocessing
+import os
+import platform
+import random
+import resource
+import statistics
+import subprocess
+import sys
+import time
+import bte
+
+CHROM = "NC_045512v2"
+GENOME_LENGTH = 29903
+
+def make_inputs(workdir: str, num_leaves: int, seed: int) -> dict:
+    """Generate (or reuse) the synthetic tree, reference and annotation for one size and seed."""
+    prefix = os.path.join(workdir, "synthetic_{}_seed{}".format(num_leaves, seed))
+    paths = {"pb": prefix + ".pb.gz", "fasta": prefix + ".fa", "gtf": prefix + ".gtf"}
+    rng = random.Random(seed)
+    reference = "".join(rng.choice("ACGT") for i in range(GENOME_LENGTH))
+    if not os.path.exists(paths["fasta"]):
+        with open(paths["fasta"], "w") as f:
+            f.write(">" + CHROM + "\n")
+            for i in range(0, len(reference), 60):
+                f.write(reference[i:i+60] + "\n")
+    if not os.path.exists(paths["gtf"]):
+        #ten genes of about 2.7kb on the forward strand; the first is split over two CDS features, as for ORF1ab.
+        with open(paths["gtf"], "w") as f:
+            for g in range(10):
+                start = 1 + g * 2700
+                end = start + 2700 - 1
+                attributes = 'gene_id "gene{0}"; gene_name "gene{0}";'.format(g + 1)
+                if g == 0:
+                    f.write("\t".join([CHROM, "synthetic", "CDS", str(start), str(start + 1499), ".", "+", "0", attributes]) + "\n")
+                    f.write("\t".join([CHROM, "synthetic", "CDS", str(start + 1499), str(end - 1), ".", "+", "0", attributes]) + "\n")
+                else:
+                    f.write("\t".join([CHROM, "synthetic", "CDS", str(start), str(end), ".", "+", "0", attributes]) + "\n")
+    if not os.path.exists(paths["pb"]):
+        tree = bte.MATree()
+        tree.from_simulation(num_leaves, seed = seed, reference = reference, chrom = CHROM)
+        tree.save_pb(paths["pb"], condense = False)
+        tree.clear()
+    return paths
+
+class Context:
+    """Inputs for the operations, drawn once per child from the benchmark seed."""
+    def __init__(self, tree: bte.MATree, paths: dict, workdir: str, seed: int):
+        rng = random.Random(seed)
+        self.paths = paths
+        self.workdir = workdir
+        self.leaves = tree.get_leaves_ids()
+        self.samples = rng.sample(self.leaves, min(1000, len(self.leaves)))
+        self.pairs = [rng.sample(self.leaves, 2) for i in range(10000)]
+        self.traits = {l:rng.choice(["A","B","C"]) for l in self.leaves}
+        #a large clade: the grandchild of the root above a random sample.
+        ancestors = tree.rsearch(self.samples[0], False)
+        self.clade = ancestors[-3].id if len(ancestors) >= 3 else ancestors[-1].id
+        tree.apply_node_annotations({self.clade:["benchmark_clade"]})
+
+    def output(self, name: str) -> str:
+        return os.path.join(self.workdir, "benchmark_output_{}_{}".format(os.getpid(), name))
+
+#each operation receives the loaded tree (None for operations which load their own) and the context.
+OPERATIONS = {
+    "from_pb": lambda tree, ctx: bte.MATree(ctx.paths["pb"]).clear(),
+    "save_pb": lambda tree, ctx: tree.save_pb(ctx.output("tree.pb.gz")),
+    "save_snapshot": lambda tree, ctx: tree.save_snapshot(ctx.output("tree.snap")),
+    "from_snapshot": lambda tree, ctx: bte.MATree(snapshot_file = ctx.paths["snapshot"]).clear(),
+    "depth_first_expansion": lambda tree, ctx: tree.depth_first_expansion(),
+    "breadth_first_expansion": lambda tree, ctx: tree.breadth_first_expansion(),
+    "get_arrays": lambda tree, ctx: tree.get_arrays(),
+    "freeze": lambda tree, ctx: tree.freeze(),
+    "get_clade": lambda tree, ctx: tree.get_clade("benchmark_clade"),
+    "subtree": lambda tree, ctx: tree.subtree(ctx.samples),
+    "get_haplotype": lambda tree, ctx: [tree.get_haplotype(s) for s in ctx.samples[:100]],
+    "get_haplotypes": lambda tree, ctx: tree.get_haplotypes(ctx.samples),
+    "count_haplotypes": lambda tree, ctx: tree.count_haplotypes(),
+    "compute_nucleotide_diversity": lambda tree, ctx: tree.compute_nucleotide_diversity(),
+    "translate": lambda tree, ctx: tree.translate(ctx.paths["gtf"], ctx.paths["fasta"]),
+    "tree_entropy": lambda tree, ctx: tree.tree_entropy(ctx.traits),
+    "LCA": lambda tree, ctx: [tree.LCA(p) for p in ctx.pairs[:100]],
+    "lca_batch": lambda tree, ctx: tree.lca_batch(ctx.pairs),
+    "distance_matrix": lambda tree, ctx: tree.distance_matrix(ctx.samples),
+    "nearest_neighbors": lambda tree, ctx: tree.nearest_neighbors(ctx.samples, k = 10),
+    "write_vcf": lambda tree, ctx: tree.write_vcf(ctx.output("tree.vcf")),
+    "write_json": lambda tree, ctx: tree.write_json(ctx.output("tree.json")),
+}
+LOADS_OWN_TREE = {"from_pb", "from_snapshot"}
+
+def reset_peak_memory() -> bool:
+    """Reset the peak resident set size of this process (Linux only). Returns False if unsupported."""
+    try:
+        with open("/proc/self/clear_refs", "w") as f:
+            f.write("5")
+        return True
+    except OSError:
+        return False
+
+def peak_memory_mb() -> float:
+    try:
+        with open("/proc/self/status") as f:
+            for line in f:
+                if line.startswith("VmHWM:"):
+                    return int(line.split()[1]) / 1024
+    except OSError:
+        pass
+    #ru_maxrss is in kilobytes on Linux and bytes on macOS; it cannot be reset, so it includes loading the tree.
+    scale = 1024 * 1024 if sys.platform == "darwin" else 1024
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss / scale
+
+def run_operation(name: str, paths: dict, workdir: str, seed: int, repeats: int, verbose: bool, connection) -> None:
+    """Body of the child process for one operation. Sends back the timing record or an error message."""
+    if not verbose:
+        devnull = os.open(os.devnull, os.O_WRONLY)
+        os.dup2(devnull, 1)
+        os.dup2(devnull, 2)
+    try:
+        tree = bte.MATree(paths["pb"])
+        ctx = Context(tree, paths, workdir, seed)
+        if name == "from_snapshot":
+            ctx.paths["snapshot"] = ctx.output("load.snap")
+            tree.save_snapshot(ctx.paths["snapshot"])
+        nodes = len(tree.depth_first_expansion())
+        if name in LOADS_OWN_TREE:
+            tree.clear()
+            tree = None
+        exact_peak = reset_peak_memory()
+        times = []
+        for r in range(repeats):
+            start = time.perf_counter()
+            OPERATIONS[name](tree, ctx)
+            times.append(time.perf_counter() - start)
+        peak = peak_memory_mb()
+        for f in os.listdir(workdir):
+            if f.startswith("benchmark_output_{}_".format(os.getpid())):
+                os.remove(os.path.join(workdir, f))
+        connection.send({"nodes": nodes, "seconds": times, "peak_rss_mb": round(peak, 1), "peak_rss_exact": exact_peak})
+    except Exception as e:
+        connection.send({"error": "{}: {}".format(type(e).__name__, e)})
+
+def wait_for_result(child: multiprocessing.Process, receiver, timeout: float) -> dict:
+    """Wait for the child to send its result, noticing if it dies (e.g. from a segmentation fault) or runs out of time."""
+    deadline = time.monotonic() + timeout
+    result = None
+    while result is None:
+        if receiver.poll(1):
+            result = receiver.recv()
+        elif not child.is_alive():
+            result = {"error": "process exited with code {}".format(child.exitcode)}
+        elif time.monotonic() > deadline:
+            child.kill()
+            result = {"error": "timed out after {} seconds".format(timeout)}
+    child.join()
+    return result
+
+def environment() -> dict:
+    try:
+        commit = subprocess.run(["git", "rev-parse", "--short", "HEAD"], cwd = os.path.dirname(os.path.abspath(__file__)), capture_output = True, text = True).stdout.strip()
+    except OSError:
+        commit = ""
+    return {"commit": commit, "python": platform.python_version(), "platform": platform.platform(), "host": platform.node(), "cpus": os.cpu_count()}
+
+def run(args: argparse.Namespace) -> None:
+    operations = list(OPERATIONS) if args.operations == "all" else args.operations.split(",")
+    for name in operations:
+        if name not in OPERATIONS:
+            raise SystemExit("Unknown operation {}. Choose from: {}".format(name, ", ".join(OPERATIONS)))
+    os.makedirs(args.workdir, exist_ok = True)
+    env = environment()
+    out = open(args.output, "a") if args.output else sys.stdout
+    context = multiprocessing.get_context("fork")
+    for size in [int(s) for s in args.sizes.split(",")]:
+        print("Preparing synthetic tree with {} leaves".format(size), file = sys.stderr)
+        paths = make_inputs(args.workdir, size, args.seed)
+        for name in operations:
+            receiver, sender = context.Pipe(duplex = False)
+            child = context.Process(target = run_operation, args = (name, paths, args.workdir, args.seed, args.repeats, args.verbose, sender))
+            child.start()
+            result = wait_for_result(child, receiver, args.timeout)
+            record = {"operation": name, "leaves": size, "seed": args.seed, "repeats": args.repeats, "timestamp": time.strftime("%Y-%m-%dT%H:%M:%S")}
+            record.update(result)
+            if "seconds" in result:
+                record["min_seconds"] = min(result["seconds"])
+                record["median_seconds"] = statistics.median(result["seconds"])
+                print("{:>30} {:>10} leaves: {:.4f}s, peak {} MB".format(name, size, record["min_seconds"], record["peak_rss_mb"]), file = sys.stderr)
+            else:
+                print("{:>30} {:>10} leaves: {}".format(name, size, result["error"]), file = sys.stderr)
+            record.update(env)
+            out.write(json.dumps(record) + "\n")
+            out.flush()
+    if args.output:
+        out.close()
+
+def load_results(path: str) -> dict:
+    results = {}
+    with open(path) as f:
+        for line in f:
+            record = json.loads(line)
+            if "min_seconds" in record:
+                #later records for the same operation and size replace earlier ones.
+                results[(record["operation"], record["leaves"])] = record
+    return results
+
+def compare(baseline: str, current: str, fail_above: float) -> int:
+    """Print the ratio of current to baseline times and peak memory. Returns 1 if any time ratio exceeds fail_above."""
+    base = load_results(baseline)
+    new = load_results(current)
+    status = 0
+    print("{:>30} {:>10} {:>12} {:>12} {:>8} {:>10}".format("operation", "leaves", "baseline_s", "current_s", "ratio", "mem_ratio"))
+    for key in sorted(set(base) & set(new), key = lambda k: (k[1], k[0])):
+        ratio = new[key]["min_seconds"] / max(base[key]["min_seconds"], 1e-9)
+        mem_ratio = new[key]["peak_rss_mb"] / max(base[key]["peak_rss_mb"], 1e-9)
+        flag = ""
+        if fail_above and ratio > fail_above:
+            flag = " REGRESSION"
+            status = 1
+        print("{:>30} {:>10} {:>12.4f} {:>12.4f} {:>8.2f} {:>10.2f}{}".format(key[0], key[1], base[key]["min_seconds"], new[key]["min_seconds"], ratio, mem_ratio, flag))
+    return status
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description = __doc__, formatter_class = argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--sizes", default = "10000,100000", help = "Comma-separated numbers of leaves to benchmark (e.g. 10000,100000,1000000,10000000).")
+    parser.add_argument("--operations", default = "all", help = "Comma-separated operations to run. Choices: " + ", ".join(OPERATIONS))
+    parser.add_argument("--seed", type = int, default = 1, help = "Seed for tree generation and query selection.")
+    parser.add_argument("--repeats", type = int, default = 3, help = "Times to run each operation; the minimum and median are reported.")
+    parser.add_argument("--workdir", default = "benchmark_data", help = "Directory for cached synthetic trees and temporary outputs.")
+    parser.add_argument("--output", default = None, help = "Append JSON line results to this file. Defaults to standard output.")
+    parser.add_argument("--timeout", type = float, default = 3600, help = "Seconds to wait for each operation.")
+    parser.add_argument("--verbose", action = "store_true", help = "Show output printed by BTE during the benchmarks.")
+    parser.add_argument("--compare", nargs = 2, metavar = ("BASELINE", "CURRENT"), help = "Compare two result files instead of running benchmarks.")
+    parser.add_argument("--fail-above", type = float, default = 0, help = "With --compare, exit with status 1 if any operation is slower than this ratio.")
+    args = parser.parse_args()
+    if args.compare:
+        sys.exit(compare(args.compare[0], args.compare[1], args.fail_above))
+    run(args)
+
+if __name__ == "__main__":
+    main()
@@ -1,7 +1,9 @@
 import bte
 import unittest
 import os
+import gzip
 import sys
+from concurrent.futures import ThreadPoolExecutor
 #load our test case as a universal object, outside of the test class.
 t = bte.MATree()
 
@@ -52,6 +54,117 @@ class TestMat(unittest.TestCase):
             #we fail if we have both- one or the other is fine.
             self.assertTrue(not (('A1234G' in h) and ('G1234A' in h)))
 
+    def test_haplotype_batch(self):
+        nids = ['node_1','node_2','node_4'] + t.get_leaves_ids()[:10]
+        haplotypes = t.get_haplotypes(nids)
+        for nid in nids:
+            self.assertEqual(haplotypes[nid], t.get_haplotype(nid))
+        total = sum(t.count_haplotypes().values())
+        self.assertEqual(total, t.count_leaves())
+
+    def test_nucleotide_diversity(self):
+        pi = t.compute_nucleotide_diversity()
+        self.assertTrue(pi > 0)
+        self.assertTrue(t.compute_nucleotide_diversity(method = "haplotype") > 0)
+        clade_pi = t.subtree_nucleotide_diversity()
+        self.assertAlmostEqual(clade_pi[t.root.id], pi)
+        #without homoplasy both methods count every pairwise difference once: 39 differences over 15 pairs here.
+        small = bte.MATree(nwk_string = "((s1,s2),(s3,s4,s5),s6);")
+        small.apply_mutations({"s1":["A10G"], "s2":["C20T", "G30A"], small.get_node("s3").parent.id:["T40C"], "s4":["A50T"], "s6":["G60C", "C70A"]})
+        self.assertAlmostEqual(small.compute_nucleotide_diversity(), 2.6)
+        self.assertAlmostEqual(small.compute_nucleotide_diversity(method = "haplotype"), 2.6)
+
+    def test_arrays(self):
+        arrays = t.get_arrays(identifiers = True)
+        nodes = t.depth_first_expansion()
+        self.assertEqual(len(arrays['parent']), len(nodes))
+        self.assertEqual(arrays['identifiers'], [n.id for n in nodes])
+        self.assertEqual(arrays['parent'][0], -1)
+        for i in range(1, len(nodes)):
+            self.assertEqual(arrays['identifiers'][arrays['parent'][i]], nodes[i].parent.id)
+        offsets = arrays['mutation_offsets']
+        self.assertEqual(offsets[-1], len(arrays['position']))
+        for i in range(len(nodes)):
+            self.assertEqual(offsets[i+1] - offsets[i], len(nodes[i].mutations))
+
+    def test_parsimony(self):
+        leaves = t.get_leaves_ids()
+        leaf_states = {l:[i % 2, i % 3, 0] for i,l in enumerate(leaves)}
+        result = t.parsimony(leaf_states)
+        self.assertEqual(result['identifiers'], [n.id for n in t.depth_first_expansion()])
+        self.assertEqual(result['states'].shape, (len(result['identifiers']), 3))
+        self.assertEqual(result['scores'][2], 0)
+        self.assertTrue(0 < result['scores'][0] <= len(leaves))
+        row = {nid:i for i,nid in enumerate(result['identifiers'])}
+        for l,states in leaf_states.items():
+            self.assertEqual(result['states'].tolist()[row[l]], states)
+        simple = t.simple_parsimony({l:str(s[0]) for l,s in leaf_states.items()})
+        for nid,i in row.items():
+            self.assertEqual(simple[nid], str(result['states'][i,0]))
+        mixed = t.simple_parsimony({l:(s[0] if s[0] else "none") for l,s in leaf_states.items()})
+        self.assertEqual(set(mixed[l] for l in leaves), {1, "none"})
+
+    def test_entropy(self):
+        leaves = t.get_leaves_ids()
+        traits = {l:[i % 3, "host" if i % 5 else "other"] for i,l in enumerate(leaves)}
+        result = t.trait_entropy(traits)
+        self.assertEqual(result['absolute'].shape, (len(result['identifiers']), 2))
+        self.assertEqual(result['counts'][0,0], len(leaves))
+        self.assertAlmostEqual(result['absolute'][0,0], 1.0986, places = 1)
+        row = {nid:i for i,nid in enumerate(result['identifiers'])}
+        for nid, (ev, rel) in t.tree_entropy({l:str(v[0]) for l,v in traits.items()}).items():
+            self.assertAlmostEqual(ev, result['absolute'][row[nid],0])
+            self.assertAlmostEqual(rel, result['relative'][row[nid],0])
+
+    def test_mutation_index(self):
+        spectrum = t.count_mutation_types()
+        self.assertEqual(sum(spectrum.values()), sum(len(n.mutations) for n in t.depth_first_expansion()))
+        #mutations on a leaf's own branch are always part of its genotype.
+        leaf = [l for l in t.get_leaves() if len(l.mutations) > 0][0]
+        mutation = leaf.mutations[0]
+        leaf = leaf.id
+        self.assertIn(leaf, [s.decode("UTF-8") for s in t.get_mutation_samples(mutation)])
+        position = int(mutation.split(":")[-1][1:-1])
+        in_range = t.mutations_in_range(position, position)
+        self.assertTrue(any(m == mutation.split(":")[-1] for n,m,c in in_range))
+        frequencies = t.allele_frequencies(position)
+        self.assertAlmostEqual(sum(frequencies.values()), 1.0)
+        self.assertGreaterEqual(frequencies[mutation[-1]], 1/t.count_leaves())
+        with self.assertRaises(ValueError):
+            bte.MATree(nwk_string = t.get_newick()).get_mutation_samples(mutation)
+
+    def test_freeze(self):
+        frozen = t.freeze()
+        self.assertEqual(len(frozen), len(t.depth_first_expansion()))
+        self.assertEqual(frozen.depth_first_expansion(), [n.id for n in t.depth_first_expansion()])
+        self.assertEqual(frozen.get_leaves_ids('node_2'), t.get_leaves_ids('node_2'))
+        self.assertEqual(frozen.count_leaves(), t.count_leaves())
+        self.assertEqual(frozen.get_parent('node_4'), t.get_node('node_4').parent.id)
+        nids = ['node_1','node_4'] + t.get_leaves_ids()[:10]
+        self.assertEqual(frozen.get_haplotypes(nids), t.get_haplotypes(nids))
+        self.assertEqual(frozen.count_haplotypes(), t.count_haplotypes())
+        self.assertEqual(frozen.count_mutation_types(), t.count_mutation_types())
+        self.assertEqual(frozen.get_annotations(), t.get_annotations())
+        traits = {l:str(i % 3) for i,l in enumerate(t.get_leaves_ids())}
+        self.assertEqual(frozen.tree_entropy(traits), t.tree_entropy(traits))
+        with self.assertRaises(ValueError):
+            frozen.get_haplotype('not_a_node')
+        empty = {l:[] for l in t.get_leaves_ids()}
+        with self.assertRaises(ValueError):
+            frozen.trait_entropy(empty)
+        with self.assertRaises(ValueError):
+            t.trait_entropy(empty)
+
+    def test_simulation(self):
+        sim = bte.MATree()
+        sim.from_simulation(500, seed = 3)
+        self.assertEqual(sim.count_leaves(), 500)
+        self.assertTrue(sim.get_parsimony_score() > 0)
+        again = bte.MATree()
+        again.from_simulation(500, seed = 3)
+        self.assertTrue(check_tree_struct(sim, again))
+        self.assertEqual(sim.count_haplotypes(), again.count_haplotypes())
+
     def test_newick_load_write(self):
         basic_newick = t.get_newick()
         nomut_t = bte.MATree(nwk_string = basic_newick)
@@ -66,6 +179,24 @@ class TestMat(unittest.TestCase):
         t2 = bte.MATree(json_file = "test.json")
         os.remove("test.json")
 
+    def test_pb_load_write(self):
+        t.save_pb("test_out.pb.gz")
+        t2 = bte.MATree("test_out.pb.gz")
+        self.assertTrue(check_tree_struct(t,t2))
+        self.assertEqual(t.count_haplotypes(), t2.count_haplotypes())
+        os.remove("test_out.pb.gz")
+
+    def test_snapshot_load_write(self):
+        t.save_snapshot("test.snap")
+        t2 = bte.MATree(snapshot_file = "test.snap")
+        self.assertTrue(check_tree_struct(t,t2))
+        self.assertEqual(t.count_haplotypes(), t2.count_haplotypes())
+        arrays = bte.MATree.read_snapshot("test.snap")
+        self.assertEqual(len(arrays["parent"]), len(t.depth_first_expansion()))
+        self.assertEqual(arrays["mutation_offsets"][-1], sum(len(n.mutations) for n in t.depth_first_expansion()))
+        del arrays
+        os.remove("test.snap")
+
     def test_newick_vcf_load_write(self):
         nwk = t.get_newick()
         with open("test.nwk",'w+') as f:
@@ -76,6 +207,26 @@ class TestMat(unittest.TestCase):
         os.remove("test.nwk")
         os.remove("test.vcf")
 
+    def test_vcf_json_export(self):
+        def read(filename):
+            opener = gzip.open if filename.endswith(".gz") else open
+            with opener(filename, "rb") as f:
+                data = f.read()
+            os.remove(filename)
+            return data
+        some = t.get_leaves_ids()[::3]
+        for kwargs in [{}, {"no_genotypes": True}, {"samples": some}]:
+            t.write_vcf("test_matutils.vcf", **kwargs)
+            t.write_vcf("test.vcf", use_matutils = False, **kwargs)
+            t.write_vcf("test.vcf.gz", use_matutils = False, **kwargs)
+            expected = read("test_matutils.vcf")
+            self.assertEqual(read("test.vcf"), expected)
+            self.assertEqual(read("test.vcf.gz"), expected)
+        for kwargs in [{}, {"samples": some, "title": "Subtree"}]:
+            t.write_json("test_matutils.json", **kwargs)
+            t.write_json("test.json", use_matutils = False, **kwargs)
+            self.assertEqual(read("test.json"), read("test_matutils.json"))
+
     def test_node_manipulation(self):
         t.create_node("node_X",t.root.id)
         self.assertTrue(t.get_node("node_X").parent.id == t.root.id)
@@ -83,9 +234,32 @@ class TestMat(unittest.TestCase):
         t.create_node("node_Y",t.root.id)
         t.move_node("node_Y","node_X")
         self.assertTrue(t.get_node("node_Y").parent.id == "node_X")
+        with self.assertRaises(ValueError):
+            t.move_node("node_Y","not_a_node")
+        self.assertTrue(t.get_node("node_Y").parent.id == "node_X")
         t.remove_node("node_X")
         self.assertTrue("node_X" not in [c.id for c in t.root.children])
 
+    def test_bulk_update(self):
+        errors = t.create_nodes(["bulk_B", "bulk_A", "bulk_A", "bulk_C"], ["bulk_A", t.root.id, t.root.id, "not_a_node"], mutations = [["A12G"], ["C5T", "T7A"], [], []])
+        self.assertEqual(sorted(nid for nid, message in errors), ["bulk_A", "bulk_C"])
+        self.assertEqual(t.get_node("bulk_B").parent.id, "bulk_A")
+        self.assertEqual(t.get_node("bulk_A").branch_length, 2)
+        arrays = t.get_arrays(subroot = "bulk_A", identifiers = True)
+        t.apply_mutations({"bulk_A":[], "bulk_B":[]})
+        self.assertEqual(t.apply_mutation_arrays(arrays["identifiers"], arrays["mutation_offsets"], arrays["position"], arrays["par_nuc"], arrays["mut_nuc"], arrays["chrom"], arrays["chromosomes"]), [])
+        self.assertEqual(t.get_node("bulk_A").mutations, ["C5T", "T7A"])
+        with open("test_mutations.tsv", "w") as f:
+            f.write("bulk_B\tA12G,C13T\nnot_a_node\tA1G\nbulk_A\tA1\n")
+        errors = t.apply_mutations_file("test_mutations.tsv")
+        self.assertEqual([nid for nid, message in errors], ["not_a_node", "bulk_A"])
+        self.assertEqual(t.get_node("bulk_B").mutations, ["A12G", "C13T"])
+        with self.assertRaises(ValueError):
+            t.apply_mutations({"not_a_node":["A1G"]})
+        #removes bulk_B with it.
+        t.remove_node("bulk_A")
+        os.remove("test_mutations.tsv")
+
     def test_branch_length(self):
         t.create_node("node_Z",t.root.id, branch_length = 0.5)
         self.assertTrue(t.get_node("node_Z").branch_length == 0.5)
@@ -103,5 +277,118 @@ class TestMat(unittest.TestCase):
         dump = t.dump_node_annotations()
         self.assertTrue(to_apply[t.root.children[0].id] == dump[t.root.children[0].id])
 
+    def test_clade_index(self):
+        #annotated on a separate copy, so the annotations of the shared tree are left as loaded.
+        tree = bte.MATree("test.pb")
+        tree.apply_node_annotations({'node_1':['cladeA'], 'node_2':['cladeB']})
+        samples = tree.get_clade_samples('cladeA')
+        self.assertEqual(sorted(s.decode("UTF-8") for s in samples), sorted(tree.get_leaves_ids('node_1')))
+        counts = tree.count_clades_inclusive()
+        self.assertEqual(counts['cladeA'], len(tree.get_leaves_ids('node_1')))
+        self.assertEqual(counts['cladeB'], len(tree.get_leaves_ids('node_2')))
+        self.assertEqual(tree.count_clades_inclusive('node_2')['cladeA'], len(tree.get_leaves_ids('node_2')))
+        self.assertIn('cladeB', tree.list_clades())
+        tree.apply_node_annotations({'node_1':[], 'node_2':[]})
+        self.assertEqual(len(tree.get_clade_samples('cladeA')), 0)
+
     def test_lca(self):
-        self.assertTrue(t.LCA(['node_4','node_2']) == 'node_1')
\ No newline at end of file
+        self.assertTrue(t.LCA(['node_4','node_2']) == 'node_1')
+
+    def test_lca_index(self):
+        leaves = t.get_leaves_ids()
+        pairs = [(leaves[i], leaves[-i-1]) for i in range(min(10, len(leaves)))]
+        lcas = t.lca_batch([list(p) for p in pairs] + [['node_4','node_2']])
+        self.assertEqual(lcas[-1], 'node_1')
+        for (a,b),lca in zip(pairs, lcas):
+            self.assertEqual(t.LCA([a,b]), lca)
+        self.assertEqual(t.LCA(['node_4','node_2']), 'node_1')
+        distances = t.node_distances(pairs)
+        self.assertEqual(distances['lca'], lcas[:-1])
+        reverse = t.node_distances([(b,a) for a,b in pairs])
+        self.assertEqual(list(distances['mutations']), list(reverse['mutations']))
+        self.assertTrue(all(d >= 0 for d in distances['branch_length']))
+        t.create_node("node_W", 'node_4')
+        self.assertEqual(t.lca_batch([['node_W','node_2']]), ['node_1'])
+        t.remove_node("node_W")
+
+    def test_distance_matrix(self):
+        samples = t.get_leaves_ids()[:20]
+        matrix = t.distance_matrix(samples)
+        self.assertEqual(matrix.shape, (len(samples), len(samples)))
+        pairs = [(a,b) for a in samples for b in samples]
+        self.assertEqual([d for row in matrix.tolist() for d in row], list(t.node_distances(pairs)['mutations']))
+        close = t.distance_matrix(samples, threshold = 2)
+        self.assertEqual([(i,j) for i,j in zip(close['row'], close['col'])], [(i,j) for i in range(len(samples)) for j in range(i+1, len(samples)) if matrix[i,j] <= 2])
+        self.assertEqual(list(close['mutations']), [matrix[i,j] for i,j in zip(close['row'], close['col'])])
+        neighbors = t.nearest_neighbors(samples[:5], k = 3)
+        for sample in samples[:5]:
+            self.assertEqual(len(neighbors[sample]), 3)
+            distances = [d for nid, d in neighbors[sample]]
+            self.assertEqual(distances, sorted(distances))
+            self.assertNotIn(sample, [nid for nid, d in neighbors[sample]])
+            #the nearest leaf on the whole tree is at least as close as the nearest one among the samples.
+            i = samples.index(sample)
+            self.assertLessEqual(distances[0], min(matrix[i,j] for j in range(len(samples)) if j != i))
+        limited = t.nearest_neighbors(samples[:5], k = 3, max_mutations = 1)
+        for sample in samples[:5]:
+            self.assertEqual(limited[sample], [(nid, d) for nid, d in neighbors[sample] if d <= 1])
+
+    def test_incremental_translation(self):
+        with open("test_reference.fa", "w") as f:
+            f.write(">reference\n" + "ACGGTTCA" * 3738 + "\n")
+        with open("test_annotation.gtf", "w") as f:
+            f.write('reference\tbte\tCDS\t100\t21554\t.\t+\t0\tgene_id "A"; transcript_id "A";\n')
+            f.write('reference\tbte\tCDS\t21563\t29000\t.\t-\t0\tgene_id "B"; transcript_id "B";\n')
+        def translations(tree):
+            return {nid:[repr(c) for c in changes] for nid, changes in tree.translate("test_annotation.gtf", "test_reference.fa").items()}
+        edits = [
+            lambda tree: tree.apply_mutations({'node_2':['A1234G', 'C25001T']}),
+            lambda tree: tree.create_node("node_T", 'node_4', mutations = ['G25000T', 'T120C']),
+            lambda tree: tree.move_node(tree.get_leaves_ids('node_2')[0], 'node_4'),
+            lambda tree: tree.remove_node(tree.get_leaves_ids()[-1]),
+            lambda tree: tree.remove_node("node_T"),
+        ]
+        edited = bte.MATree("test.pb")
+        translations(edited)
+        for i in range(len(edits)):
+            edits[i](edited)
+            fresh = bte.MATree("test.pb")
+            for edit in edits[:i+1]:
+                edit(fresh)
+            self.assertEqual(translations(edited), translations(fresh))
+        os.remove("test_reference.fa")
+        os.remove("test_annotation.gtf")
+
+    def test_concurrent_reads(self):
+        #edited from several threads on a separate copy, so the shared tree is left as loaded.
+        tree = bte.MATree("test.pb")
+        leaves = tree.get_leaves_ids()
+        pairs = [[leaves[i], leaves[-i-1]] for i in range(min(10, len(leaves)))]
+        expected = (tree.get_haplotypes(leaves), tree.lca_batch(pairs))
+        def read(i):
+            if i % 4 == 0:
+                #edits wait for running reads and leave the queried nodes unchanged.
+                tree.create_node("node_V" + str(i), tree.root.id, mutations = ["A1G"])
+                tree.remove_node("node_V" + str(i))
+            return (tree.get_haplotypes(leaves), tree.lca_batch(pairs))
+        with ThreadPoolExecutor(4) as pool:
+            for result in pool.map(read, range(16)):
+                self.assertEqual(result, expected)
+        #a read writing more than a pipe holds can only finish once another thread drains the pipe, which needs the GIL while the read runs.
+        big = bte.MATree()
+        big.from_simulation(2000, seed = 1)
+        big.write_vcf("test_expected.vcf", use_matutils = False)
+        with open("test_expected.vcf", "rb") as f:
+            expected = f.read()
+        self.assertGreater(len(expected), 1 << 20)
+        os.mkfifo("test_pipe.vcf")
+        def drain():
+            with open("test_pipe.vcf", "rb") as f:
+                return f.read()
+        with ThreadPoolExecutor(2) as pool:
+            written = pool.submit(big.write_vcf, "test_pipe.vcf", use_matutils = False)
+            drained = pool.submit(drain)
+            written.result()
+            self.assertEqual(drained.result(), expected)
+        os.remove("test_pipe.vcf")
+        os.remove("test_expected.vcf")
@@ -14,7 +14,7 @@ subprocess.run("protoc --cpp_out=../ parsimony.proto",shell=True,check=True,cwd=
 extensions = [Extension("bte",["src/bte.pyx"],
     include_dirs=[CONDA_PREFIX+"/include/google/protobuf", CONDA_PREFIX+"/include/"],
     library_dirs=[CONDA_PREFIX+'/lib/'],
-    libraries=['tbb', 'protobuf','boost_system','boost_iostreams'],
+    libraries=['tbb', 'protobuf','boost_system','boost_iostreams','z'],
     language='c++',
     extra_compile_args=["-std=c++17"]
     )]
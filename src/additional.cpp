@@ -1,5 +1,10 @@
 /*this file exists to allow cython to correctly use the timer object extern and provide other C++ objects and functions as needed*/
+#pragma once
 #include "usher/src/usher_graph.hpp"
+#include <array>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/task_arena.h>
 Timer timer;
 
 /*translation functions copied from translate.cpp follow.
@@ -41,51 +46,6 @@ static std::unordered_map<char, char> complement_map = {
     {'D', 'H'}, {'B', 'V'}, {'N', 'N'}
 };
 
-struct Codon {
-    std::string orf_name;
-    std::string nucleotides;
-    int codon_number;
-    int start_position;
-    char protein;
-
-    // Translate codon to amino acid, allowing for ambiguous codons
-    inline char translate_codon(std::string nt) {
-        auto it = translation_map.find(nt);
-        if (it == translation_map.end()) {
-            return 'X'; // ambiguous, couldn't resolve aa
-        } else {
-            return it->second;
-        }
-    }
-
-    inline void mutate(int nuc_pos, char mutated_nuc) {
-        // The nt to mutate is the difference between the
-        // genomic coordinate of the mutated nt and the
-        // starting coordinate of the codon
-        nucleotides[abs(nuc_pos-start_position)] = mutated_nuc;
-        protein = translate_codon(nucleotides);
-    }
-
-    Codon (std::string _orf_name, int _codon_number, int _start_position, char nt[3]) {
-        orf_name = _orf_name;
-        start_position = _start_position;
-        codon_number = _codon_number;
-        nucleotides = "";
-        nucleotides += nt[0];
-        nucleotides += nt[1];
-        nucleotides += nt[2];
-        protein = translate_codon(nt);
-    }
-
-    inline std::string get_string() const {
-        return std::to_string(start_position) + ':'
-               + nucleotides[0]
-               + nucleotides[1]
-               + nucleotides[2]
-               + '=' + protein;
-    }
-};
-
 std::vector<std::string> split(const std::string &s, char delim) {
     std::vector<std::string> result;
     std::stringstream ss(s);
@@ -125,355 +85,399 @@ char complement(char nt) {
 }
 
 
-std::string do_mutations(std::vector<MAT::Mutation> &mutations, std::unordered_map<int, std::vector<std::shared_ptr<Codon>>> &codon_map, bool taxodium_format) {
-    std::string prot_string = "";
-    std::string nuc_string = "";
-    std::string cchange_string = "";
-    std::sort(mutations.begin(), mutations.end());
-    std::unordered_map<std::string, std::set<MAT::Mutation>> codon_to_nt_map;
-    std::unordered_map<std::string, std::string> codon_to_changestring_map;
-    std::unordered_map<std::string, char> orig_proteins;
-    std::vector<std::shared_ptr<Codon>> affected_codons;
-
-    for (auto &m : mutations) {
-        char mutated_nuc = MAT::get_nuc(m.mut_nuc);
-        char par_nuc = MAT::get_nuc(m.par_nuc);
-        int pos = m.position - 1;
-        auto codon_map_it = codon_map.find(pos);
-        if (codon_map_it == codon_map.end()) {
-            continue; // Not a coding mutation
-        } else {
-            // Mutate each codon associated with this position
-            for (auto codon_ptr : codon_map_it->second) {
-                std::string codon_id = codon_ptr->orf_name + ':' + std::to_string(codon_ptr->codon_number+1);
-                //first, update the codon to match the parent state instead of the reference state as part of the codon output
-                codon_ptr->mutate(pos, par_nuc);
-                auto orig_it = orig_proteins.find(codon_id);
-                if (orig_it == orig_proteins.end()) {
-                    orig_proteins.insert({codon_id, codon_ptr->protein});
-                }
-                if (std::find(affected_codons.begin(), affected_codons.end(), codon_ptr) == affected_codons.end()) {
-                    affected_codons.push_back(codon_ptr);
-                }
-                std::string original_codon = codon_ptr->nucleotides;
-                //then update it again to match the mutated state
-                codon_ptr->mutate(pos, mutated_nuc);
-                // store a string representing the original and new codons in nucleotides
-                // this may incorporate multiple nucleotide mutations, just accounting for the original and end states.
-                std::string changestring = original_codon + ">" + codon_ptr->nucleotides;
-                codon_to_changestring_map.insert({codon_id, changestring});
-                // Build a map of codons and their associated nt mutations
-                auto to_nt_it = codon_to_nt_map.find(codon_id);
-                if (to_nt_it == codon_to_nt_map.end()) {
-                    codon_to_nt_map.insert({codon_id, {m}});
-                } else {
-                    to_nt_it->second.insert(m);
-                }
-            }
+// Translate a codon to an amino acid, allowing for ambiguous codons.
+// The translation map is expanded once into a flat table indexed by the three nucleotide letters, so no strings are built or hashed per lookup.
+inline char translate_codon(const char* nt) {
+    static const std::vector<char> codon_table = []() {
+        std::vector<char> table(26 * 26 * 26, 'X');
+        for (auto &kv: translation_map) {
+            table[(kv.first[0] - 'A') * 676 + (kv.first[1] - 'A') * 26 + (kv.first[2] - 'A')] = kv.second;
         }
+        return table;
+    }();
+    if (nt[0] < 'A' || nt[0] > 'Z' || nt[1] < 'A' || nt[1] > 'Z' || nt[2] < 'A' || nt[2] > 'Z') {
+        return 'X'; // ambiguous, couldn't resolve aa
     }
+    return codon_table[(nt[0] - 'A') * 676 + (nt[1] - 'A') * 26 + (nt[2] - 'A')];
+}
 
-    for (auto codon_ptr : affected_codons) {
-        std::string codon_id = codon_ptr->orf_name + ':' + std::to_string(codon_ptr->codon_number+1);
-        char orig_protein = orig_proteins.find(codon_id)->second;
-        if (taxodium_format) {
-            if (orig_protein == codon_ptr->protein) { // exclude synonymous mutations
-                continue;
-            }
-            prot_string += split(codon_id, ':')[0] + ':' + orig_protein + '_' + split(codon_id, ':')[1] + '_' + codon_ptr->protein + ';';
-        } else {
-            prot_string += split(codon_id, ':')[0] + ':' + orig_protein + split(codon_id, ':')[1] + codon_ptr->protein + ';';
-        }
-        auto codon_it = codon_to_nt_map.find(codon_id);
-        for (auto &m : codon_it->second) {
-            nuc_string += m.get_string() + ",";
-        }
+// A single codon of a coding sequence. Codons are stored contiguously in a TranslationContext
+// and refer to their ORF by index, so updating one touches a few bytes rather than a heap-allocated object.
+struct FlatCodon {
+    uint32_t orf;
+    int32_t codon_number;
+    int32_t start_position;
+    char nucleotides[3];
+    char protein;
+    bool reverse_strand;
 
-        if (!nuc_string.empty() && nuc_string.back() == ',') {
-            nuc_string.resize(nuc_string.length() - 1); // remove trailing ','
-            nuc_string += ';';
+    inline void mutate(int nuc_pos, char mutated_nuc) {
+        // The nt to mutate is the difference between the
+        // genomic coordinate of the mutated nt and the
+        // starting coordinate of the codon.
+        // Codons on the minus strand hold the complement of the genomic nucleotides.
+        nucleotides[abs(nuc_pos - start_position)] = reverse_strand ? complement(mutated_nuc) : mutated_nuc;
+        protein = translate_codon(nucleotides);
+    }
+};
+
+// One nucleotide mutation contributing to a codon change on a node. A codon changed by several mutations
+// on the same branch yields one record per mutation, each carrying the codon before and after the branch.
+struct CodonChange {
+    MAT::Node* node;
+    uint32_t orf;
+    int32_t codon_number;
+    char original_protein;
+    char alternative_protein;
+    char original_codon[3];
+    char alternative_codon[3];
+    int position;
+    int8_t par_nuc;
+    int8_t mut_nuc;
+};
+
+// The codons of a reference genome and annotation, indexed by genomic position.
+// This is built once from the GTF and FASTA and is never modified afterwards, so it can be reused across translations of any tree;
+// each traversal works on its own copy of the codon states.
+class TranslationContext {
+  public:
+    std::vector<std::string> orf_names;
+    // reference state of every codon, in the order they were built
+    std::vector<FlatCodon> codons;
+    // codons overlapping 0-based position p are position_codons[position_offsets[p]] up to position_codons[position_offsets[p+1]]
+    std::vector<uint32_t> position_offsets;
+    std::vector<uint32_t> position_codons;
+
+    TranslationContext(std::string gtf_filename, std::string fasta_filename) {
+        std::ifstream fasta_file(fasta_filename);
+        if (!fasta_file) {
+            throw std::runtime_error("Could not open the fasta file: " + fasta_filename);
         }
-        std::string changestring = codon_to_changestring_map.find(codon_id)->second;
-        cchange_string += changestring + ";";
+        std::ifstream gtf_file(gtf_filename);
+        if (!gtf_file) {
+            throw std::runtime_error("Could not open the gtf file: " + gtf_filename);
+        }
+        reference = build_reference(fasta_file);
+        build_codons(gtf_file);
+        index_positions();
     }
 
-    if (!nuc_string.empty() && nuc_string.back() == ';') {
-        nuc_string.resize(nuc_string.length() - 1); // remove trailing ';'
+    inline const uint32_t* codons_begin(int pos) const {
+        return position_codons.data() + position_offsets[pos];
     }
-    if (!prot_string.empty() && prot_string.back() == ';') {
-        prot_string.resize(prot_string.length() - 1); //remove trailing ';'
+
+    inline const uint32_t* codons_end(int pos) const {
+        return position_codons.data() + position_offsets[pos + 1];
     }
-    if (!cchange_string.empty() && cchange_string.back() == ';') {
-        cchange_string.resize(cchange_string.length() - 1); //remove trailing ';'
+
+    inline bool is_coding(int pos) const {
+        return pos >= 0 && (size_t)pos + 1 < position_offsets.size() && position_offsets[pos] != position_offsets[pos + 1];
     }
-    if (nuc_string.empty() || prot_string.empty() || cchange_string.empty()) {
-        return "";
-    } else if(taxodium_format) { // format string for taxodium pb
-        return prot_string;
-    } else { // format string for TSV output
-        return prot_string + '\t' + nuc_string + '\t' + cchange_string;
+
+  private:
+    struct CDSFeature {
+        int start;
+        int stop;
+        char strand;
+    };
+    std::string reference;
+    // the genomic positions covered by each codon, parallel to codons
+    std::vector<std::array<int,3>> codon_positions;
+
+    inline char reference_at(int pos) const {
+        if (pos < 0 || (size_t)pos >= reference.size()) {
+            return 'N';
+        }
+        return reference[pos];
     }
-}
 
-void undo_mutations(std::vector<MAT::Mutation> &mutations, std::unordered_map<int, std::vector<std::shared_ptr<Codon>>> &codon_map) {
-    for (auto &m: mutations) {
-        char parent_nuc = MAT::get_nuc(m.par_nuc);
-        int pos = m.position - 1;
-        auto it = codon_map.find(pos);
-        if (it == codon_map.end()) {
-            continue;
-            // Not a coding mutation
+    void add_codons(uint32_t orf, const CDSFeature &cds, int &codon_counter) {
+        if (cds.strand == '+') {
+            for (int pos = cds.start - 1; pos < cds.stop; pos += 3) {
+                FlatCodon c = {orf, codon_counter, pos, {reference_at(pos), reference_at(pos+1), reference_at(pos+2)}, 'X', false};
+                c.protein = translate_codon(c.nucleotides);
+                codons.push_back(c);
+                codon_positions.push_back({pos, pos+1, pos+2});
+                codon_counter += 1;
+            }
         } else {
-            // Revert the mutation by mutating to the parent nucleotide
-            for (auto codon_ptr : it->second) {
-                codon_ptr->mutate(pos, parent_nuc);
+            for (int pos = cds.stop - 1; pos > cds.start; pos -= 3) {
+                FlatCodon c = {orf, codon_counter, pos, {complement(reference_at(pos)), complement(reference_at(pos-1)), complement(reference_at(pos-2))}, 'X', true};
+                c.protein = translate_codon(c.nucleotides);
+                codons.push_back(c);
+                codon_positions.push_back({pos, pos-1, pos-2});
+                codon_counter += 1;
             }
         }
     }
-}
-
-// Maps a genomic coordinate to a list of codons it is part of
-std::unordered_map<int, std::vector<std::shared_ptr<Codon>>> build_codon_map(std::ifstream &gtf_file, std::string reference) {
-    std::unordered_map<int, std::vector<std::shared_ptr<Codon>>> codon_map;
-    std::string gtf_line;
-    std::vector<std::string> gtf_lines;
-    std::vector<std::string> done;
-
-    while (std::getline(gtf_file, gtf_line)) {
-        gtf_lines.push_back(gtf_line);
-    }
-    int curr_line = -1;
-    for (std::string line_outer : gtf_lines) {
-        curr_line += 1;
-
-        if (line_outer[0] == '#' || line_outer[0] == '\n') {
-            continue;
-        }
-        std::vector<std::string> split_line_outer = split(line_outer, '\t');
-        if(split_line_outer.size() <= 1) {
-            continue;
-        }
-        if (split_line_outer[8].substr(0, 7) != "gene_id") {
-            fprintf(stderr, "ERROR: GTF file formatted incorrectly. Please see the UShER wiki for details.\n");
-            exit(1);
-        }
-        std::string feature_outer = split_line_outer[2];
-        std::string gene_outer = split(split(split_line_outer[8], '\"')[1], '\"')[0];
-        char strand_outer = split_line_outer[6][0];
 
-        if (feature_outer == "CDS") {
-            bool found = (std::find(done.begin(), done.end(), gene_outer) != done.end());
-            if (found) {
+    // Collect the CDS features of each gene in a single pass over the GTF, then lay out codons gene by gene.
+    // There may be multiple CDS features per gene; codons are built for the first, then for each further CDS
+    // which does not share its start and strand, in file order (expect the GTF is ordered by start position).
+    void build_codons(std::ifstream &gtf_file) {
+        std::vector<std::vector<CDSFeature>> gene_cds;
+        std::unordered_map<std::string, uint32_t> gene_index;
+        std::string gtf_line;
+        while (std::getline(gtf_file, gtf_line)) {
+            if (gtf_line[0] == '#' || gtf_line[0] == '\n') {
                 continue;
-            } else {
-                done.push_back(gene_outer);
             }
-            // There may be multiple CDS features per gene. First build codons for the first CDS
-            int first_cds_start = std::stoi(split_line_outer[3]); // expect the GTF is ordered by start position
-            int first_cds_stop = std::stoi(split_line_outer[4]);
-            int codon_counter = 0; // the number of codons we have added so far
-            if (strand_outer == '+') {
-                for (int pos = first_cds_start - 1; pos < first_cds_stop; pos += 3) {
-
-                    char nt[3] = {
-                        reference[pos],
-                        reference[pos+1],
-                        reference[pos+2]
-                    };
-
-                    // Coordinates are 0-based at this point
-                    std::shared_ptr<Codon> c(new Codon(gene_outer, codon_counter, pos, nt));
-                    codon_counter += 1;
-
-                    // The current pos and the next positions
-                    // are associated with this codon
-                    auto it = codon_map.find(pos);
-                    if (it == codon_map.end()) {
-                        codon_map.insert({pos, {c}});
-                    } else {
-                        (it->second).push_back(c);
-                    }
-
-                    it = codon_map.find(pos+1);
-                    if (it == codon_map.end()) {
-                        codon_map.insert({pos+1, {c}});
-                    } else {
-                        (it->second).push_back(c);
-                    }
-
-                    it = codon_map.find(pos+2);
-                    if (it == codon_map.end()) {
-                        codon_map.insert({pos+2, {c}});
-                    } else {
-                        (it->second).push_back(c);
-                    }
+            std::vector<std::string> split_line = split(gtf_line, '\t');
+            if (split_line.size() <= 1) {
+                continue;
+            }
+            if (split_line.size() < 9 || split_line[8].substr(0, 7) != "gene_id") {
+                throw std::runtime_error("GTF file formatted incorrectly. Please see the UShER wiki for details.");
+            }
+            if (split_line[2] != "CDS") {
+                continue;
+            }
+            std::string gene = split(split(split_line[8], '\"')[1], '\"')[0];
+            auto it = gene_index.find(gene);
+            if (it == gene_index.end()) {
+                it = gene_index.emplace(gene, (uint32_t)orf_names.size()).first;
+                orf_names.push_back(gene);
+                gene_cds.emplace_back();
+            }
+            gene_cds[it->second].push_back({std::stoi(split_line[3]), std::stoi(split_line[4]), split_line[6][0]});
+        }
+        for (uint32_t orf = 0; orf < gene_cds.size(); orf++) {
+            const CDSFeature &first = gene_cds[orf][0];
+            int codon_counter = 0;
+            add_codons(orf, first, codon_counter);
+            for (auto &cds: gene_cds[orf]) {
+                if (cds.start != first.start || cds.strand != first.strand) {
+                    add_codons(orf, cds, codon_counter);
                 }
-            } else {
-                for (int pos = first_cds_stop - 1; pos > first_cds_start; pos -= 3) {
-
-                    char nt[3] = {
-                        complement(reference[pos]),
-                        complement(reference[pos-1]),
-                        complement(reference[pos-2])
-                    };
-
-                    // Coordinates are 0-based at this point
-                    std::shared_ptr<Codon> c(new Codon(gene_outer, codon_counter, pos, nt));
-                    codon_counter += 1;
-
-                    // The current pos and the next positions
-                    // are associated with this codon
-                    auto it = codon_map.find(pos);
-                    if (it == codon_map.end()) {
-                        codon_map.insert({pos, {c}});
-                    } else {
-                        (it->second).push_back(c);
-                    }
-
-                    it = codon_map.find(pos-1);
-                    if (it == codon_map.end()) {
-                        codon_map.insert({pos-1, {c}});
-                    } else {
-                        (it->second).push_back(c);
-                    }
+            }
+        }
+    }
 
-                    it = codon_map.find(pos-2);
-                    if (it == codon_map.end()) {
-                        codon_map.insert({pos-2, {c}});
-                    } else {
-                        (it->second).push_back(c);
-                    }
+    // Lay out the codons overlapping each position contiguously, keeping the order in which the codons were built.
+    void index_positions() {
+        int max_position = -1;
+        for (auto &positions: codon_positions) {
+            for (auto pos: positions) {
+                max_position = std::max(max_position, pos);
+            }
+        }
+        position_offsets.assign(max_position + 2, 0);
+        for (auto &positions: codon_positions) {
+            for (auto pos: positions) {
+                if (pos >= 0) {
+                    position_offsets[pos + 1]++;
                 }
             }
-            for (std::string line_inner : gtf_lines) { // find the rest of the CDS features, assuming they are in position order
-
-                if (line_inner[0] == '#' || line_inner[0] == '\n') {
-                    continue;
+        }
+        for (size_t p = 1; p < position_offsets.size(); p++) {
+            position_offsets[p] += position_offsets[p - 1];
+        }
+        position_codons.resize(position_offsets.back());
+        std::vector<uint32_t> fill(position_offsets.begin(), position_offsets.end() - 1);
+        for (uint32_t c = 0; c < codon_positions.size(); c++) {
+            for (auto pos: codon_positions[c]) {
+                if (pos >= 0) {
+                    position_codons[fill[pos]++] = c;
                 }
-                std::vector<std::string> split_line_inner = split(line_inner, '\t');
-                std::string feature_inner = split_line_inner[2];
-                std::string gene_inner = split(split(split_line_inner[8], '\"')[1], '\"')[0];
-                if (feature_inner == "CDS" && gene_outer == gene_inner) {
-                    int inner_cds_start = std::stoi(split_line_inner[3]);
-                    int inner_cds_stop = std::stoi(split_line_inner[4]);
-                    char strand_inner = split_line_inner[6][0];
-                    if (strand_inner == '+') {
-                        if (inner_cds_start != first_cds_start || strand_outer != strand_inner) {
-                            for (int pos = inner_cds_start - 1; pos < inner_cds_stop; pos += 3) {
-                                char nt[3] = {
-                                    reference[pos],
-                                    reference[pos+1],
-                                    reference[pos+2]
-                                };
-                                std::shared_ptr<Codon> c(new Codon(gene_outer, codon_counter, pos, nt));
-                                codon_counter += 1;
-
-                                auto it = codon_map.find(pos);
-                                if (it == codon_map.end()) {
-                                    codon_map.insert({pos, {c}});
-                                } else {
-                                    (it->second).push_back(c);
-                                }
-
-                                it = codon_map.find(pos+1);
-                                if (it == codon_map.end()) {
-                                    codon_map.insert({pos+1, {c}});
-                                } else {
-                                    (it->second).push_back(c);
-                                }
-
-                                it = codon_map.find(pos+2);
-                                if (it == codon_map.end()) {
-                                    codon_map.insert({pos+2, {c}});
-                                } else {
-                                    (it->second).push_back(c);
-                                }
-                            }
-                        }
-                    } else {
-                        if (inner_cds_start != first_cds_start || strand_outer != strand_inner) {
-                            for (int pos = inner_cds_stop - 1; pos > inner_cds_start; pos -= 3) {
-                                char nt[3] = {
-                                    complement(reference[pos]),
-                                    complement(reference[pos-1]),
-                                    complement(reference[pos-2])
-                                };
-                                std::shared_ptr<Codon> c(new Codon(gene_outer, codon_counter, pos, nt));
-                                codon_counter += 1;
-
-                                auto it = codon_map.find(pos);
-                                if (it == codon_map.end()) {
-                                    codon_map.insert({pos, {c}});
-                                } else {
-                                    (it->second).push_back(c);
-                                }
-
-                                it = codon_map.find(pos-1);
-                                if (it == codon_map.end()) {
-                                    codon_map.insert({pos-1, {c}});
-                                } else {
-                                    (it->second).push_back(c);
-                                }
+            }
+        }
+        codon_positions.clear();
+        codon_positions.shrink_to_fit();
+        reference.clear();
+        reference.shrink_to_fit();
+    }
+};
 
-                                it = codon_map.find(pos-2);
-                                if (it == codon_map.end()) {
-                                    codon_map.insert({pos-2, {c}});
-                                } else {
-                                    (it->second).push_back(c);
-                                }
-                            }
-                        }
-                    }
-                }
+// Apply the mutations of a node to the codon states and record every codon they change.
+// The codons are first set to the parent state, so the records describe the change along this branch only.
+void do_mutations(const TranslationContext &ctx, std::vector<FlatCodon> &codons, MAT::Node* node, std::vector<CodonChange> &changes) {
+    struct Affected {
+        uint32_t codon;
+        char original_protein;
+        char original_codon[3];
+        std::vector<const MAT::Mutation*> mutations;
+    };
+    std::vector<const MAT::Mutation*> mutations;
+    mutations.reserve(node->mutations.size());
+    for (auto &m: node->mutations) {
+        mutations.push_back(&m);
+    }
+    std::sort(mutations.begin(), mutations.end(), [](const MAT::Mutation* a, const MAT::Mutation* b) {
+        return *a < *b;
+    });
+    std::vector<Affected> affected;
+    for (auto m: mutations) {
+        int pos = m->position - 1;
+        if (!ctx.is_coding(pos)) {
+            continue; // Not a coding mutation
+        }
+        char mutated_nuc = MAT::get_nuc(m->mut_nuc);
+        char par_nuc = MAT::get_nuc(m->par_nuc);
+        // Mutate each codon associated with this position
+        for (auto ci = ctx.codons_begin(pos); ci != ctx.codons_end(pos); ci++) {
+            FlatCodon &codon = codons[*ci];
+            codon.mutate(pos, par_nuc);
+            auto a = std::find_if(affected.begin(), affected.end(), [&](const Affected &x) {
+                return x.codon == *ci;
+            });
+            if (a == affected.end()) {
+                affected.push_back({*ci, codon.protein, {codon.nucleotides[0], codon.nucleotides[1], codon.nucleotides[2]}, {}});
+                a = affected.end() - 1;
             }
+            codon.mutate(pos, mutated_nuc);
+            if (a->mutations.empty() || a->mutations.back()->position != m->position) {
+                a->mutations.push_back(m);
+            }
+        }
+    }
+    for (auto &a: affected) {
+        const FlatCodon &codon = codons[a.codon];
+        for (auto m: a.mutations) {
+            CodonChange change;
+            change.node = node;
+            change.orf = codon.orf;
+            change.codon_number = codon.codon_number + 1;
+            change.original_protein = a.original_protein;
+            change.alternative_protein = codon.protein;
+            std::copy(a.original_codon, a.original_codon + 3, change.original_codon);
+            std::copy(codon.nucleotides, codon.nucleotides + 3, change.alternative_codon);
+            change.position = m->position;
+            change.par_nuc = m->par_nuc;
+            change.mut_nuc = m->mut_nuc;
+            changes.push_back(change);
         }
     }
-    return codon_map;
 }
 
-//additionally, define a version of the translation function which yields a vector of pairs instead of writing directly to a file
-//this code is used in the cython translation.
-std::vector<std::pair<std::string,std::string>> do_translation(MAT::Tree *T, std::string gtf_filename, std::string fasta_filename) {
-    std::ifstream fasta_file(fasta_filename);
-    if (!fasta_file) {
-        fprintf(stderr, "ERROR: Could not open the fasta file: %s!\n", fasta_filename.c_str());
-        exit(1);
+// Apply the mutations of a node to the codon states without recording anything. Used to bring a fresh copy of the codons to the state of a node.
+void apply_mutations(const TranslationContext &ctx, std::vector<FlatCodon> &codons, MAT::Node* node) {
+    for (auto &m: node->mutations) {
+        int pos = m.position - 1;
+        if (!ctx.is_coding(pos)) {
+            continue; // Not a coding mutation
+        }
+        char mutated_nuc = MAT::get_nuc(m.mut_nuc);
+        for (auto ci = ctx.codons_begin(pos); ci != ctx.codons_end(pos); ci++) {
+            codons[*ci].mutate(pos, mutated_nuc);
+        }
     }
-    std::ifstream gtf_file(gtf_filename);
-    if (!gtf_file) {
-        fprintf(stderr, "ERROR: Could not open the gtf file: %s!\n", gtf_filename.c_str());
-        exit(1);
+}
+
+void undo_mutations(const TranslationContext &ctx, std::vector<FlatCodon> &codons, MAT::Node* node) {
+    for (auto &m: node->mutations) {
+        int pos = m.position - 1;
+        if (!ctx.is_coding(pos)) {
+            continue; // Not a coding mutation
+        }
+        // Revert the mutation by mutating to the parent nucleotide
+        char parent_nuc = MAT::get_nuc(m.par_nuc);
+        for (auto ci = ctx.codons_begin(pos); ci != ctx.codons_end(pos); ci++) {
+            codons[*ci].mutate(pos, parent_nuc);
+        }
     }
-    std::string reference = build_reference(fasta_file);
+}
 
-    // This maps each position in the reference to a vector of codons.
-    // Some positions may be associated with multiple codons (frame shifts).
-    // The Codons in the map are updated as the tree is traversed
-    std::vector<std::pair<std::string,std::string>> results;
-    std::unordered_map<int, std::vector<std::shared_ptr<Codon>>> codon_map = build_codon_map(gtf_file, reference);
+// Translate the nodes dfs[begin] up to dfs[end], which must be a complete subtree or a run of nodes whose parents precede them,
+// starting from codon states which already reflect every mutation above the first node.
+void translate_nodes(const TranslationContext &ctx, std::vector<FlatCodon> &codons, const std::vector<MAT::Node*> &dfs, size_t begin, size_t end, std::vector<CodonChange> &changes) {
+    std::vector<MAT::Node*> path;
+    for (size_t i = begin; i < end; i++) {
+        MAT::Node* node = dfs[i];
+        while (!path.empty() && path.back() != node->parent) {
+            undo_mutations(ctx, codons, path.back());
+            path.pop_back();
+        }
+        do_mutations(ctx, codons, node, changes);
+        path.push_back(node);
+    }
+}
+
+// Translate every branch of the tree, returning codon changes grouped by node in depth-first order.
+// As we descend the tree, mutations at each node are applied to a private copy of the codon states;
+// when the traversal jumps to another branch, the mutations of every node left behind are undone.
+std::vector<CodonChange> translate_tree(MAT::Tree* T, const TranslationContext &ctx) {
+    std::vector<CodonChange> changes;
+    std::vector<FlatCodon> codons = ctx.codons;
+    std::vector<MAT::Node*> dfs = T->depth_first_expansion(T->root);
+    translate_nodes(ctx, codons, dfs, 0, dfs.size(), changes);
+    return changes;
+}
 
-    // Traverse the tree in depth-first order. As we descend the tree, mutations at
-    // each node are applied to the respective codon(s) in codon_map.
-    auto dfs = T->depth_first_expansion();
-    MAT::Node *last_visited = nullptr;
-    for (auto &node: dfs) {
-        std::string mutation_result = "";
-        if (last_visited != node->parent) {
-            // Jumping across a branch, so we need to revert codon mutations up to
-            // the LCA of this node and the last visited node
-            MAT::Node *last_common_ancestor = MAT::LCA(*T, node->identifier, last_visited->identifier);
-            MAT::Node *trace_to_lca = last_visited;
-            while (trace_to_lca != last_common_ancestor) {
-                undo_mutations(trace_to_lca->mutations, codon_map);
-                trace_to_lca = trace_to_lca->parent;
+// Parallel version of translate_tree with identical output.
+// The preorder traversal is cut into subtrees of at most grain_size nodes, each of which is translated by a TBB worker
+// on its own copy of the codon states, seeded with the mutations on the path from the root to the subtree.
+// The few large nodes above these subtrees are translated serially, and the results are concatenated back in preorder.
+std::vector<CodonChange> translate_tree_parallel(MAT::Tree* T, const TranslationContext &ctx, size_t grain_size) {
+    std::vector<MAT::Node*> dfs = T->depth_first_expansion(T->root);
+    if (grain_size == 0) {
+        grain_size = std::max((size_t)256, dfs.size() / (16 * (size_t)tbb::this_task_arena::max_concurrency()));
+    }
+    // in a preorder traversal, the subtree below dfs[i] is the contiguous range from i to i + subtree_size[i].
+    std::unordered_map<const MAT::Node*, size_t> index;
+    index.reserve(dfs.size());
+    for (size_t i = 0; i < dfs.size(); i++) {
+        index.emplace(dfs[i], i);
+    }
+    std::vector<size_t> subtree_size(dfs.size(), 1);
+    for (size_t i = dfs.size(); i-- > 1;) {
+        subtree_size[index[dfs[i]->parent]] += subtree_size[i];
+    }
+    struct Segment {
+        size_t begin;
+        size_t end;
+        bool subtree;
+    };
+    std::vector<Segment> segments;
+    std::vector<size_t> subtree_segments;
+    size_t i = 0;
+    while (i < dfs.size()) {
+        if (subtree_size[i] <= grain_size) {
+            subtree_segments.push_back(segments.size());
+            segments.push_back({i, i + subtree_size[i], true});
+            i += subtree_size[i];
+        } else {
+            segments.push_back({i, i + 1, false});
+            i++;
+        }
+    }
+    std::vector<std::vector<CodonChange>> segment_changes(segments.size());
+    // nodes above the subtrees; the parent of each of them is also above the subtrees, so they form a valid traversal on their own.
+    std::vector<FlatCodon> codons = ctx.codons;
+    std::vector<MAT::Node*> path;
+    for (size_t s = 0; s < segments.size(); s++) {
+        if (segments[s].subtree) {
+            continue;
+        }
+        MAT::Node* node = dfs[segments[s].begin];
+        while (!path.empty() && path.back() != node->parent) {
+            undo_mutations(ctx, codons, path.back());
+            path.pop_back();
+        }
+        do_mutations(ctx, codons, node, segment_changes[s]);
+        path.push_back(node);
+    }
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, subtree_segments.size(), 1), [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t k = r.begin(); k < r.end(); k++) {
+            const Segment &segment = segments[subtree_segments[k]];
+            std::vector<FlatCodon> local_codons = ctx.codons;
+            std::vector<MAT::Node*> ancestry;
+            for (MAT::Node* anc = dfs[segment.begin]->parent; anc != NULL; anc = anc->parent) {
+                ancestry.push_back(anc);
             }
-        } // If we are visiting a child, we can continue mutating
-        mutation_result = do_mutations(node->mutations, codon_map, false);
-        if (mutation_result != "") {
-            std::pair<std::string,std::string> result = std::make_pair(node->identifier, mutation_result);
-            results.push_back(result);
+            for (auto it = ancestry.rbegin(); it != ancestry.rend(); it++) {
+                apply_mutations(ctx, local_codons, *it);
+            }
+            translate_nodes(ctx, local_codons, dfs, segment.begin, segment.end, segment_changes[subtree_segments[k]]);
         }
-        last_visited = node;
+    });
+    std::vector<CodonChange> changes;
+    size_t total = 0;
+    for (auto &sc: segment_changes) {
+        total += sc.size();
+    }
+    changes.reserve(total);
+    for (auto &sc: segment_changes) {
+        changes.insert(changes.end(), sc.begin(), sc.end());
     }
-    return results;
+    return changes;
 }
@@ -0,0 +1,119 @@
+/*bulk export of tree topology and mutations as flat arrays.
+Nodes are numbered in preorder (the order of depth_first_expansion) starting from the subtree root, so any
+node's parent has a smaller index and the subtree of node i occupies a contiguous range of indices.
+Mutations are stored in compressed sparse row (CSR) form: the mutations of node i are entries
+mutation_offsets[i] up to mutation_offsets[i+1] of the mutation arrays.*/
+#pragma once
+#include "usher/src/usher_graph.hpp"
+
+struct TreeArrays {
+    std::vector<MAT::Node*> nodes;
+    std::vector<int64_t> parent;
+    std::vector<float> branch_length;
+    std::vector<uint8_t> is_leaf;
+    std::vector<int64_t> mutation_offsets;
+    std::vector<int32_t> position;
+    std::vector<uint8_t> par_nuc;
+    std::vector<uint8_t> mut_nuc;
+    std::vector<int16_t> chrom;
+    std::vector<std::string> chromosomes;
+};
+
+// Fill the parent index of each node of a preorder traversal, using a stack of the current path instead of a lookup table.
+std::vector<int64_t> preorder_parents(const std::vector<MAT::Node*> &nodes) {
+    std::vector<int64_t> parent(nodes.size(), -1);
+    std::vector<size_t> path;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        while (!path.empty() && nodes[path.back()] != nodes[i]->parent) {
+            path.pop_back();
+        }
+        if (!path.empty()) {
+            parent[i] = path.back();
+        }
+        path.push_back(i);
+    }
+    return parent;
+}
+
+/*Ranges of a preorder traversal, given the parent index of each node. The subtree of node i is nodes i up to i + subtree_size[i], and the
+leaves below it are leaves leaf_begin[i] up to leaf_begin[i] + leaf_count[i].*/
+struct PreorderRanges {
+    // every leaf, in preorder
+    std::vector<MAT::Node*> leaves;
+    std::vector<size_t> subtree_size;
+    std::vector<size_t> leaf_begin;
+    std::vector<size_t> leaf_count;
+};
+
+PreorderRanges preorder_ranges(const std::vector<MAT::Node*> &nodes, const std::vector<int64_t> &parent) {
+    PreorderRanges ranges;
+    size_t n = nodes.size();
+    ranges.subtree_size.assign(n, 1);
+    ranges.leaf_begin.resize(n);
+    ranges.leaf_count.assign(n, 0);
+    for (size_t i = 0; i < n; i++) {
+        ranges.leaf_begin[i] = ranges.leaves.size();
+        if (nodes[i]->is_leaf()) {
+            ranges.leaves.push_back(nodes[i]);
+            ranges.leaf_count[i] = 1;
+        }
+    }
+    for (size_t i = n; i-- > 1;) {
+        ranges.leaf_count[parent[i]] += ranges.leaf_count[i];
+        ranges.subtree_size[parent[i]] += ranges.subtree_size[i];
+    }
+    return ranges;
+}
+
+// The position of each node in a preorder traversal.
+std::unordered_map<const MAT::Node*, size_t> preorder_positions(const std::vector<MAT::Node*> &nodes) {
+    std::unordered_map<const MAT::Node*, size_t> positions;
+    positions.reserve(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        positions.emplace(nodes[i], i);
+    }
+    return positions;
+}
+
+TreeArrays get_tree_arrays(MAT::Tree* T, MAT::Node* subroot, bool include_mutations) {
+    TreeArrays arrays;
+    arrays.nodes = T->depth_first_expansion(subroot);
+    size_t n = arrays.nodes.size();
+    arrays.parent = preorder_parents(arrays.nodes);
+    arrays.branch_length.resize(n);
+    arrays.is_leaf.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        arrays.branch_length[i] = arrays.nodes[i]->branch_length;
+        arrays.is_leaf[i] = arrays.nodes[i]->is_leaf();
+    }
+    if (!include_mutations) {
+        return arrays;
+    }
+    arrays.mutation_offsets.resize(n + 1);
+    arrays.mutation_offsets[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        arrays.mutation_offsets[i + 1] = arrays.mutation_offsets[i] + arrays.nodes[i]->mutations.size();
+    }
+    size_t total = arrays.mutation_offsets[n];
+    arrays.position.resize(total);
+    arrays.par_nuc.resize(total);
+    arrays.mut_nuc.resize(total);
+    arrays.chrom.resize(total);
+    std::unordered_map<std::string, int16_t> chrom_ids;
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (auto &m: arrays.nodes[i]->mutations) {
+            auto it = chrom_ids.find(m.chrom);
+            if (it == chrom_ids.end()) {
+                it = chrom_ids.emplace(m.chrom, (int16_t)arrays.chromosomes.size()).first;
+                arrays.chromosomes.push_back(m.chrom);
+            }
+            arrays.position[k] = m.position;
+            arrays.par_nuc[k] = MAT::get_nuc(m.par_nuc);
+            arrays.mut_nuc[k] = MAT::get_nuc(m.mut_nuc);
+            arrays.chrom[k] = it->second;
+            k++;
+        }
+    }
+    return arrays;
+}
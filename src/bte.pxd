@@ -6,6 +6,7 @@ from libcpp cimport bool
 from stringstream cimport stringstream
 from libc.stdint cimport *
 from libcpp.unordered_map cimport unordered_map
+from libcpp.memory cimport shared_ptr
 
 cdef extern from "usher/src/mutation_annotated_tree.hpp" namespace "Mutation_Annotated_Tree" nogil:
     int8_t get_nuc_id(char nuc)
@@ -105,7 +106,196 @@ cdef extern from "parsimony.pb.cc" nogil:
 cdef extern from "usher/src/matUtils/common.hpp" nogil:
     pass
 cdef extern from "additional.cpp" nogil:
-    vector[pair[string,string]] do_translation(Tree* T, string gtf_file, string fasta_file) except +
+    cppclass TranslationContext:
+        TranslationContext(string gtf_file, string fasta_file) except +
+        vector[string] orf_names
+    struct CodonChange:
+        Node* node
+        uint32_t orf
+        int32_t codon_number
+        char original_protein
+        char alternative_protein
+        char original_codon[3]
+        char alternative_codon[3]
+        int position
+        int8_t par_nuc
+        int8_t mut_nuc
+    vector[CodonChange] translate_tree(Tree* T, const TranslationContext& ctx) except +
+    vector[CodonChange] translate_tree_parallel(Tree* T, const TranslationContext& ctx, size_t grain_size) except +
+cdef extern from "haplotype.cpp" nogil:
+    vector[Mutation] get_node_haplotype(Node* node) except +
+    vector[vector[Mutation]] get_node_haplotypes(Tree* T, vector[Node*] nodes) except +
+    vector[pair[vector[Mutation],size_t]] count_haplotypes_dfs(Tree* T, Node* subroot) except +
+    size_t count_haplotype_differences(const vector[Mutation]& h1, const vector[Mutation]& h2)
+    struct NodeDiversity:
+        Node* node
+        double diversity
+    vector[NodeDiversity] branch_nucleotide_diversity(Tree* T, Node* subroot) except +
+cdef extern from "arrays.cpp" nogil:
+    struct TreeArrays:
+        vector[Node*] nodes
+        vector[int64_t] parent
+        vector[float] branch_length
+        vector[uint8_t] is_leaf
+        vector[int64_t] mutation_offsets
+        vector[int32_t] position
+        vector[uint8_t] par_nuc
+        vector[uint8_t] mut_nuc
+        vector[int16_t] chrom
+        vector[string] chromosomes
+    TreeArrays get_tree_arrays(Tree* T, Node* subroot, bool include_mutations) except +
+cdef extern from "parsimony.cpp" nogil:
+    struct ParsimonyResult:
+        vector[Node*] nodes
+        vector[int32_t] states
+        vector[int64_t] scores
+    ParsimonyResult fitch_hartigan(Tree* T, Node* subroot, const vector[Node*]& leaves, const vector[int32_t]& leaf_states, size_t num_characters, size_t num_states) except +
+cdef extern from "entropy.cpp" nogil:
+    struct TraitEntropy:
+        vector[Node*] nodes
+        vector[double] absolute
+        vector[double] relative
+        vector[int64_t] counts
+    TraitEntropy trait_entropy(Tree* T, Node* subroot, const vector[Node*]& leaves, const vector[int32_t]& categories, const vector[size_t]& num_categories) except +
+cdef extern from "lca.cpp" nogil:
+    struct NodeDistance:
+        Node* lca
+        double branch_length
+        int64_t mutations
+    struct DistancePairs:
+        vector[uint32_t] row
+        vector[uint32_t] col
+        vector[int32_t] mutations
+        vector[double] branch_length
+    struct Neighbors:
+        vector[uint64_t] offsets
+        vector[Node*] nodes
+        vector[int64_t] mutations
+    cppclass LCAIndex:
+        LCAIndex(Tree* T) except +
+        int64_t position(const Node* node)
+        Node* lca(const Node* a, const Node* b) except +
+        Node* group_lca(const vector[Node*]& group) except +
+        NodeDistance distance(const Node* a, const Node* b) except +
+        vector[NodeDistance] distances(const vector[Node*]& a, const vector[Node*]& b) except +
+        vector[Node*] group_lcas(const vector[vector[Node*]]& groups) except +
+        vector[int32_t] mutation_matrix(const vector[Node*]& samples) except +
+        vector[double] branch_length_matrix(const vector[Node*]& samples) except +
+        DistancePairs pairs_within(const vector[Node*]& samples, double max_distance, bool by_branch_length) except +
+        Neighbors nearest_leaves(const vector[Node*]& queries, size_t k, int64_t max_mutations) except +
+cdef extern from "clades.cpp" nogil:
+    struct CladeRecord:
+        size_t clade
+        Node* node
+        size_t leaf_begin
+        size_t leaf_end
+    cppclass CladeIndex:
+        CladeIndex(Tree* T) except +
+        vector[Node*] leaves
+        vector[string] names
+        vector[CladeRecord] records
+        const CladeRecord* find(const string& clade)
+        vector[string] clade_samples(const string& clade) except +
+        vector[size_t] count_inclusive(const Node* subroot) except +
+cdef extern from "mutations.cpp" nogil:
+    struct MutationRecord:
+        int16_t chrom
+        int8_t par_nuc
+        int8_t mut_nuc
+        int8_t ref_nuc
+        int32_t position
+        Node* node
+        size_t node_begin
+        size_t node_end
+        size_t leaf_begin
+        size_t leaf_end
+        size_t carriers
+    cppclass MutationIndex:
+        MutationIndex(Tree* T) except +
+        vector[Node*] leaves
+        vector[string] chromosomes
+        vector[MutationRecord] records
+        int16_t chrom_id(const string& chrom)
+        pair[size_t,size_t] range(int16_t chrom, int32_t start, int32_t end)
+        vector[Node*] mutation_samples(int16_t chrom, int32_t position, int8_t par_nuc, int8_t mut_nuc) except +
+        vector[int64_t] allele_counts(int16_t chrom, int32_t position) except +
+        vector[int64_t] mutation_spectrum(const Node* subroot) except +
+cdef extern from "pbio.cpp" nogil:
+    Tree load_mutation_annotated_tree_parallel(const string& filename) except +
+    void save_mutation_annotated_tree_parallel(Tree* T, const string& filename) except +
+cdef extern from "snapshot.cpp" nogil:
+    void save_tree_snapshot(Tree* T, const string& filename) except +
+    Tree load_tree_snapshot(const string& filename) except +
+cdef extern from "simulate.cpp" nogil:
+    Tree simulate_tree(size_t num_leaves, uint64_t seed, string reference, const string& chrom, double polytomy, double mutation_rate, double recency) except +
+cdef extern from "frozen.cpp" nogil:
+    struct PackedMutation:
+        int32_t position
+        uint16_t chrom
+    struct FrozenAnnotation:
+        uint32_t node
+        uint32_t level
+        uint32_t clade
+    cppclass FrozenTree:
+        FrozenTree(Tree* T) except +
+        vector[int32_t] parent
+        vector[uint32_t] subtree_end
+        vector[string] chromosomes
+        vector[string] clades
+        vector[FrozenAnnotation] annotations
+        size_t size()
+        bool is_leaf(size_t i)
+        string identifier(size_t i)
+        int64_t find(const string& identifier)
+        size_t count_leaves(size_t subroot)
+        vector[uint32_t] leaves(size_t subroot) except +
+        vector[uint32_t] breadth_first(size_t subroot) except +
+        vector[PackedMutation] haplotype(size_t node) except +
+        vector[vector[PackedMutation]] haplotypes(const vector[uint32_t]& nodes) except +
+        vector[pair[vector[PackedMutation],size_t]] count_haplotypes(size_t subroot) except +
+        vector[int64_t] mutation_spectrum(size_t subroot) except +
+        TraitEntropy trait_entropy(size_t subroot, const vector[uint32_t]& leaf_nodes, const vector[int32_t]& categories, const vector[size_t]& num_categories) except +
+        Mutation unpack(const PackedMutation& packed)
+        size_t memory_usage()
+cdef extern from "bulk.cpp" nogil:
+    struct BulkError:
+        string identifier
+        string message
+    struct NodeBatch:
+        vector[string] identifiers
+        vector[string] parents
+        vector[float] branch_length
+    NodeBatch node_batch_from_strings(const vector[string]& identifiers, const vector[uint64_t]& offsets, const vector[string]& strings) except +
+    NodeBatch node_batch_from_arrays(const vector[string]& identifiers, const vector[uint64_t]& offsets, const vector[int32_t]& position, const vector[uint8_t]& par_nuc, const vector[uint8_t]& mut_nuc, const vector[int16_t]& chrom, const vector[string]& chromosomes) except +
+    NodeBatch read_node_batch(const string& filename, bool with_parents) except +
+    vector[BulkError] apply_node_batch(Tree* T, NodeBatch& batch, bool update_branch_length) except +
+    vector[BulkError] create_node_batch(Tree* T, NodeBatch& batch) except +
+cdef extern from "locking.cpp" nogil:
+    cppclass TreeLock:
+        TreeLock()
+        void lock_shared() except +
+        void unlock_shared()
+        void lock() except +
+        void unlock()
+        Index* lazy_index[Index](shared_ptr[Index]& index, Tree* T) except +
+        Index* current_index[Index](shared_ptr[Index]& index)
+cdef extern from "translation.cpp" nogil:
+    struct TranslationUpdate:
+        bool full
+        vector[CodonChange] changes
+        vector[Node*] retranslated
+        vector[string] removed
+    cppclass TranslationCache:
+        TranslationCache()
+        void reset()
+        void mark_subtrees(const vector[string]& identifiers)
+        void mark_nodes(const vector[string]& identifiers)
+        void before_detach(Tree* T, Node* node, bool removing) except +
+        void after_detach(Tree* T) except +
+        TranslationUpdate update(Tree* T, const TranslationContext& ctx, bool parallel) except +
+cdef extern from "export.cpp" nogil:
+    void write_vcf_parallel(Tree* T, const string& filename, bool no_genotypes, const vector[string]& samples) except +
+    void write_json_parallel(Tree* T, const string& filename, const vector[string]& samples, const vector[unordered_map[string,unordered_map[string,string]]]* catmeta, const string& title) except +
 cdef extern from "usher/src/matUtils/select.cpp" nogil:
     vector[string] get_clade_samples(Tree* T, string clade_name) except + 
     vector[string] get_mutation_samples(Tree* T, string mutation_id) except + 
@@ -7,13 +7,18 @@ from libcpp.vector cimport vector
 from libcpp.string cimport string
 from libcpp.set cimport set as cset
 from libcpp.map cimport map
+from libcpp.memory cimport shared_ptr
 from libc.stdint cimport *
 from libcpp cimport bool as cbool
+from libc.string cimport memcpy
+from cpython cimport array
+import array
 import functools
 import time
-from typing import Optional, Union
+from typing import Hashable, Optional, Union
 import sys
 import math
+import threading
 from os.path import exists
 
 def _timer(func, *args, **kwargs):
@@ -51,19 +56,52 @@ cdef bte.Mutation instantiate_mutation(str mstr):
     newmut.position = loc
     return newmut
 
-cdef float entropy(vector[float] frequencies):
+cdef array.array _copy_to_array(str typecode, const void* data, size_t length):
     """
-    Calculate the entropy of a vector of frequencies. Frequencies must be between 0 and 1.
+    Copy a contiguous block of C values into a new array.array of the indicated type code.
+    The result supports the buffer protocol, so it can be viewed without copying (e.g. with numpy.asarray or memoryview).
     """
-    cdef float ent = 0.0
-    cdef int i = 0
-    while i < frequencies.size():
-        if frequencies[i] > 0.0:
-            if frequencies[i] > 1.0:
-                raise ValueError("Frequencies must be between 0 and 1.")
-            ent += frequencies[i] * math.log(frequencies[i])
-        i = i + 1
-    return -ent
+    cdef array.array arr = array.array(typecode)
+    array.resize(arr, length)
+    if length > 0:
+        memcpy(arr.data.as_voidptr, data, length * arr.ob_descr.itemsize)
+    return arr
+
+cdef list _encode_traits(dict traits, list labels, vector[int32_t]& categories, vector[size_t]& num_categories):
+    """
+    Encode a dictionary of leaf trait values as category indices, one row per leaf in the order of the dictionary.
+    The distinct values of each trait, in the order of their indices, are appended to labels. Returns the leaf IDs in row order.
+    """
+    cdef size_t num_traits = len(next(iter(traits.values())))
+    encodings = [{} for t in range(num_traits)]
+    categories.reserve(len(traits) * num_traits)
+    for lid, values in traits.items():
+        if len(values) != num_traits:
+            raise ValueError("Leaf " + lid + " has " + str(len(values)) + " trait values, expected " + str(num_traits) + ".")
+        for t, v in enumerate(values):
+            if v is None:
+                categories.push_back(-1)
+            else:
+                categories.push_back(encodings[t].setdefault(v, len(encodings[t])))
+    for encoding in encodings:
+        num_categories.push_back(len(encoding))
+        labels.append(list(encoding.keys()))
+    return list(traits.keys())
+
+cdef list _bulk_errors(vector[bte.BulkError]& errors):
+    """
+    Convert the rejected rows of a bulk update to a list of (node ID, problem) tuples.
+    """
+    return [(errors[i].identifier.decode("UTF-8"), errors[i].message.decode("UTF-8")) for i in range(errors.size())]
+
+def _raise_bulk_errors(errors: list, action: str):
+    """
+    Raise a single ValueError describing every rejected row of a bulk update, if there are any.
+    """
+    if len(errors) > 0:
+        shown = "; ".join(message for nid, message in errors[:10])
+        more = " (and {} more)".format(len(errors) - 10) if len(errors) > 10 else ""
+        raise ValueError("{} nodes could not be {}: {}{}".format(len(errors), action, shown, more))
 
 class AAChange:
     """
@@ -109,24 +147,24 @@ class AAChange:
         fstr += "codon: " + self.original_codon + ">" + self.alternative_codon + "\n"
         return fstr
 
-def _generate_translations(transtr):
+cdef _aachange_from_record(bte.CodonChange change, str gene):
     """
-    Convert an amino acid translation string to a list containing AAChange objects.
+    Create an AAChange object directly from a translated codon change record, without formatting and reparsing strings.
     """
-    #do nothing if an empty string is passed.    
-    aachanges = []
-    if transtr != "":
-        #process the transtr in relevant pieces
-        aagenes, nucs, codons = [v.split(";") for v in transtr.split('\t')]
-        assert len(aagenes) == len(nucs)
-        for i in range(len(aagenes)):
-            gene, aa = aagenes[i].split(":")
-            #sometimes two adjacent nucleotide mutations contribute to the same amino acid change, making them annoying to store correctly
-            #make a copy of the change in another class object even though there's only one actual amino acid change here. Edge case to keep an eye on.
-            mnucs = nucs[i].split(",")
-            for mn in mnucs:
-                aachanges.append(AAChange(gene, aa, mn, codons[i]))
-    return aachanges
+    aac = AAChange.__new__(AAChange)
+    aac.gene = gene
+    aac.original_aa = chr(change.original_protein)
+    aac.aa_index = change.codon_number
+    aac.alternative_aa = chr(change.alternative_protein)
+    aac.aa = aac.original_aa + str(aac.aa_index) + aac.alternative_aa
+    aac.original_nt = chr(bte.get_nuc(change.par_nuc))
+    aac.nt_index = change.position
+    aac.alternative_nt = chr(bte.get_nuc(change.mut_nuc))
+    aac.nuc = aac.original_nt + str(aac.nt_index) + aac.alternative_nt
+    aac.mutation_type = aac.original_nt + ">" + aac.alternative_nt
+    aac.original_codon = change.original_codon[:3].decode("UTF-8")
+    aac.alternative_codon = change.alternative_codon[:3].decode("UTF-8")
+    return aac
 
 cdef class MATNode:
     """
@@ -302,19 +340,82 @@ cdef complement(int8_t input):
     else:
         return input
 
+def _reads(func):
+    """
+    Decorator for MATree methods which only read the tree. The tree's lock is held in shared mode for the whole call, so any
+    number of threads can read the tree at once while methods which change it wait.
+    """
+    @functools.wraps(func)
+    def wrap(self, *args, **kwargs):
+        (<MATree>self).lock_read()
+        try:
+            return func(self, *args, **kwargs)
+        finally:
+            (<MATree>self).unlock_read()
+    return wrap
+
+def _writes(func):
+    """
+    Decorator for MATree methods which change the tree. The tree's lock is held exclusively for the whole call, so it waits 
+    for running reads to finish and keeps new reads out until it is done.
+    """
+    @functools.wraps(func)
+    def wrap(self, *args, **kwargs):
+        (<MATree>self).lock_write()
+        try:
+            return func(self, *args, **kwargs)
+        finally:
+            (<MATree>self).unlock_write()
+    return wrap
+
 cdef class MATree:
     """
     A wrapper around the MAT Tree class. Includes functions to save and load from parsimony .pb files or a newick. Includes 
     numerous functions for tree traversal including breadth-first, depth-first, and traversal from leaf to roots. Also includes
     numerous functions for subtree selection by choosing leaves that match regex patterns, contain specific mutations, or 
     are from a specific clade or lineage.
+
+    A MATree can be shared between Python threads. Methods which only read the tree release the GIL for their C++ work and run 
+    concurrently with each other, while methods which change the tree (loading, saving a condensed protobuf, editing nodes, 
+    mutations or annotations, ladderize, reverse_strand and the build_*_index functions) wait for running reads and hold off new 
+    ones through a reader/writer lock. A thread cannot change a tree from inside one of its read methods. MATNode wrappers are 
+    not covered by the lock; when other threads may change the tree, query it through node IDs rather than through MATNode 
+    objects, and do not edit nodes through MATNode methods.
     """
     cdef bte.Tree t
     cdef public cbool _tree_only
     cdef public cbool _empty
+    cdef shared_ptr[bte.TranslationContext] translation_context
+    cdef tuple translation_files
+    cdef shared_ptr[bte.LCAIndex] lca_index
+    cdef shared_ptr[bte.CladeIndex] clade_index
+    cdef shared_ptr[bte.MutationIndex] mutation_index
+    cdef bte.TreeLock lock
+    cdef object translation_lock
+    cdef bte.TranslationCache translation_cache
+    cdef dict translation_table
+
+    def __cinit__(self):
+        self.translation_lock = threading.Lock()
+
+    cdef int lock_read(self) except -1:
+        with nogil:
+            self.lock.lock_shared()
+        return 0
+
+    cdef void unlock_read(self):
+        self.lock.unlock_shared()
+
+    cdef int lock_write(self) except -1:
+        with nogil:
+            self.lock.lock()
+        return 0
+
+    cdef void unlock_write(self):
+        self.lock.unlock()
 
     @_timer
-    def __init__(self, pb_file: Optional[str] = None, uncondense: bool = True, nwk_file: Optional[str] = None, nwk_string: Optional[str] = None, vcf_file: Optional[str] = None, json_file: Optional[str] = None) -> None:
+    def __init__(self, pb_file: Optional[str] = None, uncondense: bool = True, nwk_file: Optional[str] = None, nwk_string: Optional[str] = None, vcf_file: Optional[str] = None, json_file: Optional[str] = None, snapshot_file: Optional[str] = None) -> None:
         """Instantiate a MATree object.
 
         Args:
@@ -330,6 +431,8 @@ cdef class MATree:
             
             json_file (Optional[str], optional): Load a complete tree from an Auspice-format JSON. Defaults to None.
 
+            snapshot_file (Optional[str], optional): Load a complete tree from a snapshot written by save_snapshot. Defaults to None.
+
         Raises:
             Exception: Invalid file type.
 
@@ -346,6 +449,10 @@ cdef class MATree:
                 self.from_pb(pb_file,uncondense)
             else:
                 raise Exception("Invalid file extension for pb_file argument. Must be .pb or .pb.gz")
+        elif snapshot_file != None:
+            if not exists(snapshot_file):
+                raise Exception("Input snapshot file not found!")
+            self.from_snapshot(snapshot_file)
         elif json_file != None:
             if not exists(json_file):
                 raise Exception("Input json file not found!")
@@ -376,9 +483,11 @@ cdef class MATree:
                 #pass a minimal newick. This is loaded as a root and a single child.
                 self.t = bte.create_tree_from_newick_string("();".encode("UTF-8"))
     
+    @_reads
     def __repr__(self):
         return "MATree object with " + str(self.t.get_num_leaves(self.t.root)) + " leaves."
 
+    @_writes
     def clear(self) -> None:
         """
         Call this function to explicitly deallocate all tree memory. Use when the tree object is no longer necessary 
@@ -389,6 +498,7 @@ cdef class MATree:
             nodes = self.t.depth_first_expansion(self.t.root)
             for i in range(nodes.size()):
                 nodes[i].mutations.clear()
+            self.invalidate_indexes()
             bte.clear_tree(self.t)
             self._empty = True
 
@@ -410,34 +520,161 @@ cdef class MATree:
                 return func(self, *args,**kwargs)
         return wrap
 
+    @_writes
     def apply_mutations(self, mmap: dict[str,list[str]], update_branch_length: bool = True) -> None:
         """Pass a set of node:mutation mappings to place into the tree. Current mutations will be replaced.
+        Mutations are parsed and attached in bulk. Nodes which are not found or have malformed mutations are left unchanged
+        and reported together in a single ValueError after all other nodes have been updated.
 
         Args:
             mmap (dict[str,list[str]]): A dictionary of node:mutation list mappings (e.g. {"node_id":["chro:reflocalt","chro:reflocalt"]}, {"node_1":["chro1:A123G","chro3:T315G"]}
             update_branch_length (bool): Update the branch length to match the new count of mutations on each node. Defaults to True.
         """
+        cdef vector[string] identifiers
+        cdef vector[uint64_t] offsets
+        cdef vector[string] strings
+        identifiers.reserve(len(mmap))
+        offsets.push_back(0)
         for nid, nms in mmap.items():
-            node = self.get_node(nid)
-            node.update_mutations(nms, update_branch_length)
+            identifiers.push_back(nid.encode("UTF-8"))
+            for m in nms:
+                strings.push_back(m.encode("UTF-8"))
+            offsets.push_back(strings.size())
+        cdef bte.NodeBatch batch
+        with nogil:
+            batch = bte.node_batch_from_strings(identifiers, offsets, strings)
+        _raise_bulk_errors(self.apply_node_batch(batch, update_branch_length), "updated")
+
+    cdef list apply_node_batch(self, bte.NodeBatch& batch, cbool update_branch_length):
+        cdef vector[bte.BulkError] errors
+        self.invalidate_indexes(True)
+        with nogil:
+            errors = bte.apply_node_batch(&self.t, batch, update_branch_length)
+            self.translation_cache.mark_subtrees(batch.identifiers)
         #the tree is now annotated with mutations and mutation-based functions can be attempted.
         self._tree_only = False
+        return _bulk_errors(errors)
+
+    @_writes
+    def apply_mutation_arrays(self, node_ids: list[str], mutation_offsets, position, par_nuc, mut_nuc, chrom = None, chromosomes: Optional[list[str]] = None, update_branch_length: bool = True) -> list[tuple[str,str]]:
+        """Replace the mutations of many nodes at once from flat arrays, in the layout returned by get_arrays. The mutations of node_ids[i] 
+        are entries mutation_offsets[i] up to mutation_offsets[i+1] of the mutation arrays. Arrays can be any object supporting the buffer 
+        protocol with the indicated types, such as array.array or numpy arrays. Mutations are attached in parallel without holding the GIL.
+
+        Nodes which are not found, are listed more than once or have invalid mutations are left unchanged, and returned with a description of the problem.
+
+        Args:
+            node_ids (list[str]): The nodes to update.
+
+            mutation_offsets (int64): Offsets into the mutation arrays, one more than the number of nodes.
+
+            position (int32): The position of each mutation.
+
+            par_nuc (uint8), mut_nuc (uint8): The parent and alternative nucleotide of each mutation as ASCII codes (e.g. 65 for A).
+
+            chrom (int16, optional): The index of each mutation's chromosome in chromosomes. Defaults to the SARS-CoV-2 chromosome for all mutations.
+
+            chromosomes (Optional[list[str]], optional): Chromosome names indexed by chrom.
+
+            update_branch_length (bool): Update the branch length to match the new count of mutations on each node. Defaults to True.
+
+        Returns:
+            list[tuple[str,str]]: The node ID and problem of each node which could not be updated.
+        """
+        cdef const int64_t[:] offset_values = mutation_offsets
+        cdef const int32_t[:] position_values = position
+        cdef const uint8_t[:] par_values = par_nuc
+        cdef const uint8_t[:] mut_values = mut_nuc
+        cdef const int16_t[:] chrom_values
+        cdef vector[string] identifiers
+        cdef vector[uint64_t] offsets
+        cdef vector[int32_t] positions
+        cdef vector[uint8_t] pars
+        cdef vector[uint8_t] muts
+        cdef vector[int16_t] chroms
+        cdef vector[string] names
+        cdef Py_ssize_t i
+        for nid in node_ids:
+            identifiers.push_back(nid.encode("UTF-8"))
+        for i in range(offset_values.shape[0]):
+            if offset_values[i] < 0:
+                raise ValueError("Mutation offsets cannot be negative.")
+            offsets.push_back(offset_values[i])
+        for i in range(position_values.shape[0]):
+            positions.push_back(position_values[i])
+        for i in range(par_values.shape[0]):
+            pars.push_back(par_values[i])
+        for i in range(mut_values.shape[0]):
+            muts.push_back(mut_values[i])
+        if chrom is not None:
+            if chromosomes is None:
+                raise ValueError("Chromosome indices require a list of chromosome names.")
+            chrom_values = chrom
+            for i in range(chrom_values.shape[0]):
+                chroms.push_back(chrom_values[i])
+            for c in chromosomes:
+                names.push_back(c.encode("UTF-8"))
+        cdef bte.NodeBatch batch
+        with nogil:
+            batch = bte.node_batch_from_arrays(identifiers, offsets, positions, pars, muts, chroms, names)
+        return self.apply_node_batch(batch, update_branch_length)
+
+    @_writes
+    def apply_mutations_file(self, file: str, update_branch_length: bool = True) -> list[tuple[str,str]]:
+        """Replace the mutations of many nodes at once from a tab-separated text file, which may be gzipped. Each line holds a node ID
+        and a comma-separated list of mutations formatted as chro:reflocalt (e.g. "node_1<tab>chr1:A123G,chr1:T315G"). Empty lines and 
+        lines starting with # are skipped. The file is read and parsed in parallel without holding the GIL.
+
+        Nodes which are not found, are listed more than once or have invalid lines are left unchanged, and returned with a description of the problem.
+
+        Args:
+            file (str): The path of the file.
+
+            update_branch_length (bool): Update the branch length to match the new count of mutations on each node. Defaults to True.
+
+        Returns:
+            list[tuple[str,str]]: The node ID and problem of each node which could not be updated.
+        """
+        cdef string fn = file.encode("UTF-8")
+        cdef bte.NodeBatch batch
+        with nogil:
+            batch = bte.read_node_batch(fn, False)
+        return self.apply_node_batch(batch, update_branch_length)
 
     cdef uncondense(self):
+        self.invalidate_indexes()
         self.t.uncondense_leaves()
 
     cdef condense(self):
+        self.invalidate_indexes()
         self.t.condense_leaves([])
 
     cdef assign_tree(self, bte.Tree t):
+        self.invalidate_indexes()
         self.t = t
 
     cdef resolve_all_polytomies(self):
+        self.invalidate_indexes()
         self.t = resolve_all_polytomies(self.t)
 
+    cdef void invalidate_indexes(self, cbool keep_translations = False):
+        """
+        Discard any index built over the current tree. Called by every method which adds, removes or moves nodes or replaces the tree.
+        Methods which record the nodes they change in the translation cache keep the previous translation, so that translate only
+        retranslates those nodes.
+        """
+        self.lca_index.reset()
+        self.clade_index.reset()
+        self.mutation_index.reset()
+        if not keep_translations:
+            self.translation_cache.reset()
+
     @_timer
+    @_writes
     def from_pb(self, file: str, uncondense: bool = True) -> None:
         """Load from a protobuf into the initalized wrapper. Includes both tree and mutation information.
+        Block-compressed .pb.gz files written by save_pb are decompressed in parallel, and the mutations of each node are parsed
+        in parallel for any protobuf.
 
         Args:
             file (str): Path to a .pb or .pb.gz file.
@@ -447,13 +684,79 @@ cdef class MATree:
         cdef string fn = file.encode("UTF-8")
         cdef bte.Tree lt
         with nogil:
-            lt = bte.load_mutation_annotated_tree(fn)
+            lt = bte.load_mutation_annotated_tree_parallel(fn)
+        self.invalidate_indexes()
         self.t = lt
         if uncondense:
             self.uncondense()
         self._tree_only = False
 
+    @_timer
+    @_writes
+    def from_snapshot(self, file: str) -> None:
+        """Load a tree saved with save_snapshot. The snapshot is memory-mapped and the tree is rebuilt in a single pass over its
+        arrays, without decompression, protobuf parsing or uncondensing, which makes this much faster than from_pb for large trees.
+        The snapshot holds the tree exactly as it was saved, including condensed nodes and annotations.
+
+        Args:
+            file (str): Path to a snapshot file.
+        """
+        cdef string fn = file.encode("UTF-8")
+        cdef bte.Tree lt
+        with nogil:
+            lt = bte.load_tree_snapshot(fn)
+        self.invalidate_indexes()
+        self.t = lt
+        self._tree_only = False
+
+    @staticmethod
+    def read_snapshot(file: str) -> dict:
+        """Map a snapshot file read-only and return its columns without building a tree. Each array is a memoryview directly over 
+        the mapping, so nothing is copied or parsed and the pages are shared between every process reading the same file. 
+        The mapping stays open as long as any of the returned views are referenced.
+
+        Nodes are in preorder as in get_arrays, with parent (int64), branch_length (float32) and mutation_offsets (int64). 
+        Mutations are stored as position (int32), chrom (int16, an index into "chromosomes"), is_missing (uint8) and ref_nuc,
+        par_nuc and mut_nuc (int8), which hold nucleotide ids (1, 2, 4, 8 for A, C, G, T) rather than ASCII codes.
+        String tables are returned as a pair of <name>_offsets (int64) and <name>_data (uint8) arrays, where string i is bytes 
+        offsets[i] up to offsets[i+1] of the data; these are identifiers (one per node), annotations (one per node and annotation 
+        level) and condensed. "chromosomes" is returned as a list of strings.
+
+        Args:
+            file (str): Path to a snapshot file.
+
+        Returns:
+            dict: Dictionary of memoryviews keyed by name.
+        """
+        import mmap
+        import struct
+        with open(file, "rb") as f:
+            mapping = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        view = memoryview(mapping)
+        if len(view) < 16 or view[:8].tobytes() != b"BTESNAP\0":
+            raise ValueError(file + " is not a BTE snapshot file.")
+        num_sections = struct.unpack_from("=Q", view, 8)[0]
+        if 16 + 48 * num_sections > len(view):
+            raise ValueError(file + " is not a BTE snapshot file.")
+        arrays = {}
+        for i in range(num_sections):
+            name, typecode, offset, length = struct.unpack_from("=24s8sQQ", view, 16 + 48 * i)
+            name = name.rstrip(b"\0").decode("UTF-8")
+            typecode = typecode.rstrip(b"\0").decode("UTF-8")
+            end = offset + length * struct.calcsize(typecode)
+            if end > len(view):
+                raise ValueError("Snapshot section " + name + " is truncated.")
+            arrays[name] = view[offset:end].cast(typecode)
+        if arrays["meta"][0] != 1:
+            raise ValueError("Unsupported snapshot version.")
+        offsets = arrays["chromosomes_offsets"]
+        data = arrays["chromosomes_data"]
+        arrays["chromosomes"] = [data[offsets[c]:offsets[c+1]].tobytes().decode("UTF-8") for c in range(len(offsets) - 1)]
+        del arrays["chromosomes_offsets"], arrays["chromosomes_data"]
+        return arrays
+
     @_timer    
+    @_writes
     def from_newick_and_vcf(self, nwk: str, vcf: str) -> None:
         """Load from a newick and a vcf. The vcf must contain sample entries (genotype columns) for every leaf in the newick.
 
@@ -462,36 +765,59 @@ cdef class MATree:
 
             vcf (str): Path to a text file containing leaf/sample genotype information in VCF format.
         """
+        self.invalidate_indexes()
         self.t = bte.create_tree_from_newick(nwk.encode("UTF-8"))
         cdef vector[Missing_Sample] missing
         bte.read_vcf(&self.t,vcf.encode("UTF-8"),missing,True)
         self._tree_only = False
 
+    @_writes
     def save_pb(self, file: str, condense: bool = True) -> None:
         """Save the tree to a protobuf file. If the filename ends in '.pb.gz', it will be gzipped automatically.
+        Compressed files are written as a series of independently compressed blocks, which is valid gzip for any reader 
+        but lets from_pb decompress the blocks in parallel.
 
         Args:
             file (str): Name for the .pb/.pb.gz file.
 
             condense (bool, optional): Condense the tree before saving. Defaults to True.
         """        
+        cdef string fn = file.encode("UTF-8")
         if condense:
             self.condense()
-        bte.save_mutation_annotated_tree(self.t,file.encode("UTF-8"))
+        with nogil:
+            bte.save_mutation_annotated_tree_parallel(&self.t, fn)
         #uncondense again afterwards if it was condensed for saving.
         if condense:
             self.uncondense()
 
+    @_reads
+    def save_snapshot(self, file: str) -> None:
+        """Save the tree to an uncompressed, columnar snapshot file which can be memory-mapped. Loading a snapshot with from_snapshot 
+        is much faster than loading a protobuf, and its arrays can be read in place with read_snapshot. The tree is saved as is; it is 
+        not condensed first. Snapshots are written in the native byte order and are intended as a cache next to the protobuf, not as 
+        a replacement for it.
+
+        Args:
+            file (str): Name for the snapshot file.
+        """
+        cdef string fn = file.encode("UTF-8")
+        with nogil:
+            bte.save_tree_snapshot(&self.t, fn)
+
     @_timer
+    @_writes
     def from_newick(self, nwk_file: str) -> None:
         """Load from a newick file only. The resulting tree will lack mutation information, preventing some functions from being applied.
 
         Args:
             nwk_file (str): Path to a text file containing a newick representation of the tree.
         """        
+        self.invalidate_indexes()
         self.t = bte.create_tree_from_newick(nwk_file.encode("UTF-8"))
         self._tree_only = True
 
+    @_writes
     def from_newick_string(self, nwk: str) -> None:
         """Load from a Python string newick. The resulting tree will lack mutation information, preventing some functions from being applied.
 
@@ -499,9 +825,11 @@ cdef class MATree:
             nwk (str): A Python string containing a newick representation of the tree.
 
         """        
+        self.invalidate_indexes()
         self.t = bte.create_tree_from_newick_string(nwk.encode("UTF-8"))
         self._tree_only = True
 
+    @_reads
     def get_newick(self, subroot: Optional[str] = None, print_internal: bool = True, print_branch_len: bool = True, retain_original_branch_len: bool = True, uncondense_leaves: bool = True) -> str:
         """Extract a newick string from the tree.
 
@@ -520,14 +848,13 @@ cdef class MATree:
             str: A newick string representation of the tree.
         """        
         cdef stringstream ss
-        cdef Node* sr
-        if subroot == None:
-            sr = self.t.root
-        else:
-            se = self.t.get_node(subroot.encode("UTF-8"))
-        bte.write_newick_string(ss,self.t,sr,print_internal,print_branch_len,retain_original_branch_len,uncondense_leaves)
+        cdef Node* sr = self.fetch_node(subroot, self.t.root)
+        cdef cbool pi = print_internal, pbl = print_branch_len, robl = retain_original_branch_len, ul = uncondense_leaves
+        with nogil:
+            bte.write_newick_string(ss,self.t,sr,pi,pbl,robl,ul)
         return ss.to_string().decode("UTF-8")
 
+    @_reads
     def write_newick(self, file: str, subroot: Optional[str] = None, print_internal: bool = True, print_branch_len: bool = True, retain_original_branch_len: bool = True, uncondense_leaves: bool = True):
         """Print a newick string representing the tree/subtree to the target file.
 
@@ -552,8 +879,14 @@ cdef class MATree:
         Returns all leaf names if samples is empty.
         """
         cdef vector[string] sample_names
+        cdef string all_leaves = b""
         if len(samples) == 0:
-            sample_names = self.t.get_leaves_ids(b"")
+            self.lock_read()
+            try:
+                with nogil:
+                    sample_names = self.t.get_leaves_ids(all_leaves)
+            finally:
+                self.unlock_read()
         else:
             for s in samples:
                 if type(s) == str:
@@ -564,8 +897,10 @@ cdef class MATree:
                     raise Exception("Sample names must be strings or bytes.")
         return sample_names
 
-    def write_vcf(self, vcf_file: str , no_genotypes: bool = False, samples: list[str] = []) -> None:        
+    @_reads
+    def write_vcf(self, vcf_file: str , no_genotypes: bool = False, samples: list[str] = [], use_matutils: bool = True) -> None:        
         """Write a vcf representing the chosen samples to the indicated file. By default, writes a vcf including all samples.
+        Without matUtils, rows are produced in parallel directly from the tree and written as block gzip if the file name ends in .gz.
 
         Args:
             vcf_file (str): Name the output vcf file.
@@ -573,21 +908,70 @@ cdef class MATree:
             no_genotypes (bool, optional): Do not include individual genotype information in the output vcf. Defaults to False.
 
             samples (list[str], optional): Samples to include. Defaults to all samples.
+
+            use_matutils (bool, optional): Write with matUtils' make_vcf, which copies the tree first. Pass False to use the parallel exporter. Defaults to True.
         """        
-        sample_names = self._read_samples(samples)
-        bte.make_vcf(self.t,vcf_file.encode("UTF-8"),no_genotypes,sample_names)
+        cdef vector[string] sample_names
+        if use_matutils or len(samples) > 0:
+            sample_names = self._read_samples(samples)
+        cdef string filename = vcf_file.encode("UTF-8")
+        cdef cbool skip_genotypes = no_genotypes
+        if use_matutils:
+            with nogil:
+                bte.make_vcf(self.t,filename,skip_genotypes,sample_names)
+        else:
+            with nogil:
+                bte.write_vcf_parallel(&self.t,filename,skip_genotypes,sample_names)
 
+    @_writes
     def from_json(self, jsonf: str) -> None:
         """Load a mat from a json compatible with the Auspice.us visualization web tool.
 
         Args:
             jsonf (str): Path to a json file.
         """        
+        self.invalidate_indexes()
         self.t = bte.load_mat_from_json(jsonf.encode("UTF-8"))
 
-    def write_json(self, jsonf: str, samples: list[str] = [], title: str = "Tree", metafiles: list[str] = []) -> None:
+    @_writes
+    def from_simulation(self, num_leaves: int, seed: int = 0, reference: str = "", chrom: str = "NC_045512v2", polytomy: float = 0.7, mutation_rate: float = 1.0, recency: float = 4.0) -> None:
+        """Load a synthetic tree generated from a seed, for testing and benchmarking. Samples are named sample_1 to sample_N and internal 
+        nodes node_1 (the root) onwards. Each sample joins the parent of an earlier sample, favouring recent ones, either directly or through 
+        a new internal node with at least one mutation. Mutations are consistent with the reference and fall mostly on a small set of sites.
+        The same arguments always produce the same tree.
+
+        Args:
+            num_leaves (int): Number of samples in the tree.
+
+            seed (int, optional): Seed for the random number generator. Defaults to 0.
+
+            reference (str, optional): Reference sequence at the root. Defaults to a random 29903 base sequence drawn from the seed.
+
+            chrom (str, optional): Chromosome name for all mutations. Defaults to "NC_045512v2".
+
+            polytomy (float, optional): Probability that a new sample joins an existing polytomy rather than a new internal node. Defaults to 0.7.
+
+            mutation_rate (float, optional): Mean number of mutations on each sample's branch. Defaults to 1.0.
+
+            recency (float, optional): Bias towards attaching new samples near recent ones; higher values give deeper trees with smaller polytomies, and 1 is uniform. Defaults to 4.0.
+        """
+        cdef bte.Tree lt
+        cdef size_t n = num_leaves
+        cdef uint64_t s = seed
+        cdef string ref = reference.encode("UTF-8")
+        cdef string ch = chrom.encode("UTF-8")
+        cdef double p = polytomy, m = mutation_rate, r = recency
+        with nogil:
+            lt = bte.simulate_tree(n, s, ref, ch, p, m, r)
+        self.invalidate_indexes()
+        self.t = lt
+        self._tree_only = False
+
+    @_reads
+    def write_json(self, jsonf: str, samples: list[str] = [], title: str = "Tree", metafiles: list[str] = [], use_matutils: bool = True) -> None:
         """Write a json compatible with the Auspice.us visualization web tool containing the indicated samples. Default behavior includes the whole tree.
         You can optionally pass a tsv or csv file or a list of tsv and csv files containing categorical metadata to decorate the json with (one sample per row).
+        Without matUtils, the json is produced in parallel directly from the tree and written as block gzip if the file name ends in .gz.
 
         Args:
             jsonf (str): Name for the JSON output.
@@ -597,25 +981,42 @@ cdef class MATree:
             title (str, optional): Title of the JSON. Defaults to "Tree".
 
             metafiles (list, optional): Metadata tsv and csv files to use. Defaults to no metadata.
+
+            use_matutils (bool, optional): Write with matUtils' write_json_from_mat, which copies the tree first. Pass False to use the parallel exporter. Defaults to True.
+
+        Raises:
+            ValueError: If none of the samples are in the tree, when not using matUtils.
         """
-        cdef vector[string] sample_names = self._read_samples(samples)
+        if type(metafiles) == str:
+            metafiles = [metafiles]
+        #the parallel exporter takes an empty list as the whole tree, so the leaves are only listed for matUtils or to filter metadata.
+        cdef vector[string] sample_names
+        if use_matutils or len(samples) > 0 or len(metafiles) > 0:
+            sample_names = self._read_samples(samples)
         cdef cset[string] sample_set
         for i in range(sample_names.size()):
             sample_set.insert(sample_names[i])
         cdef vector[unordered_map[string,unordered_map[string,string]]] catmeta
-        if type(metafiles) == str:
-            catmeta.push_back(bte.read_metafile(metafiles.encode("UTF-8"),sample_set))
-        elif type(metafiles) == list and len(metafiles) > 0:
-            for mf in metafiles:
-                catmeta.push_back(bte.read_metafile(mf.encode("UTF-8"),sample_set))
+        for mf in metafiles:
+            catmeta.push_back(bte.read_metafile(mf.encode("UTF-8"),sample_set))
+        cdef string filename = jsonf.encode("UTF-8")
+        cdef string json_title = title.encode("UTF-8")
+        if not use_matutils:
+            if len(samples) == 0:
+                sample_names.clear()
+            with nogil:
+                bte.write_json_parallel(&self.t,filename,sample_names,&catmeta,json_title)
+            return
         cdef bte.Tree subtree
         with nogil:
             subtree = bte.filter_master(self.t, sample_names, False, True)
         if subtree.get_num_leaves(subtree.root) == 0:
             print("ERROR: Unable to find samples to extract json! Check sample input")
             sys.exit(1)
-        bte.write_json_from_mat(&subtree,jsonf.encode("UTF-8"),&catmeta,title.encode("UTF-8"))
+        with nogil:
+            bte.write_json_from_mat(&subtree,filename,&catmeta,json_title)
 
+    @_reads
     def get_parsimony_score(self) -> int:
         """
         Compute the parsimony score of the complete tree.
@@ -623,8 +1024,12 @@ cdef class MATree:
         Returns:
             int: The parsimony score of the tree.
         """
-        return self.t.get_parsimony_score()
+        cdef size_t score
+        with nogil:
+            score = self.t.get_parsimony_score()
+        return score
 
+    @_reads
     def get_node(self, name: str) -> MATNode:
         """Create a MATNode class object representing the indicated node.
 
@@ -638,6 +1043,19 @@ cdef class MATree:
         nc.from_node(self.t.get_node(name.encode("UTF-8")))
         return nc
 
+    cdef bte.Node* fetch_node(self, nid, bte.Node* default=NULL) except NULL:
+        """Return a pointer to the node with the indicated identifier, or the default node (usually the root) if no identifier is given.
+        Raises a ValueError if the node is not found.
+        """
+        if nid == None or nid == "":
+            if default == NULL:
+                return self.t.root
+            return default
+        cdef bte.Node* node = self.t.get_node(nid.encode("UTF-8"))
+        if node == NULL:
+            raise ValueError("Node " + nid + " not found in the tree.")
+        return node
+
     @property
     def root(self) -> MATNode:
         """Retrieve the root of the tree.
@@ -646,12 +1064,18 @@ cdef class MATree:
             MATNode: MATNode wrapper representing the root node of the tree.
         """        
         nc = MATNode()
-        nc.from_node(self.t.root)
+        self.lock_read()
+        try:
+            nc.from_node(self.t.root)
+        finally:
+            self.unlock_read()
         return nc
 
     cdef dfe_helper(self, bte.Node* node, cbool reverse):
         pynvec = []
-        cdef vector[bte.Node*] nvec = self.t.depth_first_expansion(node)
+        cdef vector[bte.Node*] nvec
+        with nogil:
+            nvec = self.t.depth_first_expansion(node)
         for i in range(nvec.size()):
             nodec = MATNode()
             nodec.from_node(nvec[i])
@@ -660,6 +1084,7 @@ cdef class MATree:
             pynvec.reverse()
         return pynvec
 
+    @_reads
     def depth_first_expansion(self, nid: Optional[str] = None, reverse: bool = False) -> list[MATNode]:
         """Perform a preorder (depth-first) expansion of the tree, starting from the indicated node. 
         By default, traverses the whole tree. Set reverse to true to traverse in postorder (reverse depth-first) instead.
@@ -678,6 +1103,7 @@ cdef class MATree:
         else:
             return self.dfe_helper(self.t.get_node(nid.encode("UTF-8")), reverse)
 
+    @_reads
     def get_leaves(self, nid: str = "") -> list[MATNode]:
         """Create a list of MATNode objects representing each leaf descended from the indicated node. By default, returns all leaves on the tree.
 
@@ -687,13 +1113,17 @@ cdef class MATree:
         Returns:
             list[MATNode]: List of MATNode wrappers representing all leaves.
         """        
-        cdef vector[Node*] leaves = self.t.get_leaves(nid.encode("UTF-8"))
+        cdef string target = nid.encode("UTF-8")
+        cdef vector[Node*] leaves
+        with nogil:
+            leaves = self.t.get_leaves(target)
         wrappers = []
         for i in range(leaves.size()):
             nodec = MATNode().from_node(leaves[i])
             wrappers.append(nodec)
         return wrappers
 
+    @_reads
     def get_leaves_ids(self, nid: str = "") -> list[str]:
         """Return a list of leaf name strings containing all leaves descended from the indicated node. By default, returns all leaves on the tree.
 
@@ -703,15 +1133,79 @@ cdef class MATree:
         Returns:
             list[str]: List of leaf names.
         """
-        cdef vector[string] leaves = self.t.get_leaves_ids(nid.encode("UTF-8"))
+        cdef string target = nid.encode("UTF-8")
+        cdef vector[string] leaves
+        with nogil:
+            leaves = self.t.get_leaves_ids(target)
         names = []
         for i in range(leaves.size()):
             names.append(leaves[i].decode("UTF-8"))
         return names
 
+    @_reads
+    def get_arrays(self, subroot: Optional[str] = None, mutations: bool = True, identifiers: bool = False) -> dict:
+        """Export the topology and mutations of the tree as flat arrays, without creating a Python object for each node.
+        Nodes are numbered in preorder (the order of depth_first_expansion) starting from the indicated node, so the subtree of 
+        any node is a contiguous range of indices and every parent precedes its children.
+
+        The returned dictionary contains the following array.array objects, which support the buffer protocol and can be viewed 
+        without copying with numpy.asarray or memoryview:
+
+            parent (int64): the index of the parent of each node, or -1 for the starting node.
+
+            branch_length (float32): the branch length of each node.
+
+            is_leaf (uint8): 1 if the node is a leaf, 0 otherwise.
+
+        If mutations is True, mutations are included in compressed sparse row form. The mutations of node i are entries 
+        mutation_offsets[i] up to mutation_offsets[i+1] of the remaining arrays:
+
+            mutation_offsets (int64): offsets into the mutation arrays, one more than the number of nodes.
+
+            position (int32): the position of each mutation.
+
+            par_nuc (uint8), mut_nuc (uint8): the parent and alternative nucleotide of each mutation as ASCII codes (e.g. 65 for A).
+
+            chrom (int16): the index of each mutation's chromosome in the "chromosomes" list.
+
+        If identifiers is True, "identifiers" holds a list of the node IDs in the same order.
+
+        Args:
+            subroot (Optional[str], optional): Export the subtree descended from this node. Defaults to the root.
+
+            mutations (bool, optional): Include the mutation arrays. Defaults to True.
+
+            identifiers (bool, optional): Include a list of node IDs. Defaults to False.
+
+        Returns:
+            dict: Dictionary of arrays keyed by name.
+        """
+        cdef bte.Node* target_n = self.fetch_node(subroot)
+        cdef cbool include_mutations = mutations
+        cdef bte.TreeArrays ta
+        with nogil:
+            ta = bte.get_tree_arrays(&self.t, target_n, include_mutations)
+        result = {
+            "parent": _copy_to_array('q', ta.parent.data(), ta.parent.size()),
+            "branch_length": _copy_to_array('f', ta.branch_length.data(), ta.branch_length.size()),
+            "is_leaf": _copy_to_array('B', ta.is_leaf.data(), ta.is_leaf.size()),
+        }
+        if include_mutations:
+            result["mutation_offsets"] = _copy_to_array('q', ta.mutation_offsets.data(), ta.mutation_offsets.size())
+            result["position"] = _copy_to_array('i', ta.position.data(), ta.position.size())
+            result["par_nuc"] = _copy_to_array('B', ta.par_nuc.data(), ta.par_nuc.size())
+            result["mut_nuc"] = _copy_to_array('B', ta.mut_nuc.data(), ta.mut_nuc.size())
+            result["chrom"] = _copy_to_array('h', ta.chrom.data(), ta.chrom.size())
+            result["chromosomes"] = [c.decode("UTF-8") for c in ta.chromosomes]
+        if identifiers:
+            result["identifiers"] = [ta.nodes[i].identifier.decode("UTF-8") for i in range(ta.nodes.size())]
+        return result
+
     cdef bfe_helper(self, string nid, cbool reverse):
         pynvec = []
-        cdef vector[bte.Node*] nvec = self.t.breadth_first_expansion(nid)
+        cdef vector[bte.Node*] nvec
+        with nogil:
+            nvec = self.t.breadth_first_expansion(nid)
         for i in range(nvec.size()):
             nodec = MATNode()
             nodec.from_node(nvec[i])
@@ -720,6 +1214,7 @@ cdef class MATree:
             pynvec.reverse()
         return pynvec
 
+    @_reads
     def breadth_first_expansion(self, nid: str = "", reverse: bool = False) -> list[MATNode]:
         """Perform a level order (breadth-first) expansion starting from the indicated node. Use reverse to traverse in reverse level order (all leaves, then all leaf parents, back to root) instead.
 
@@ -735,13 +1230,16 @@ cdef class MATree:
 
     cdef rsearch_helper(self, string nid, cbool include_self, cbool reverse):
         pynvec = []
-        cdef vector[bte.Node*] nvec = self.t.rsearch(nid,include_self)
+        cdef vector[bte.Node*] nvec
+        with nogil:
+            nvec = self.t.rsearch(nid,include_self)
         for i in range(nvec.size()):
             nodec = MATNode()
             nodec.from_node(nvec[i])
             pynvec.append(nodec)
         return pynvec
 
+    @_reads
     def rsearch(self, nid: str, include_self: bool = False,reverse: bool = False) -> list[MATNode]:
         """Return a list of MATNode objects representing the ancestors of the indicated node back to the root in order from the node to the root.
 
@@ -766,6 +1264,7 @@ cdef class MATree:
         return subt
 
     @_timer    
+    @_reads
     def subtree(self, samples: list[Union[str,bytes]]) -> MATree:
         """Retrieve a subtree containing all samples in the input list.
 
@@ -778,6 +1277,24 @@ cdef class MATree:
         cdef vector[string] samples_vec = self._read_samples(samples)
         return self.get_subtree(samples_vec)
 
+    cdef bte.CladeIndex* get_clade_index(self) except NULL:
+        cdef bte.CladeIndex* index
+        with nogil:
+            index = self.lock.lazy_index[bte.CladeIndex](self.clade_index, &self.t)
+        return index
+
+    @_writes
+    def build_clade_index(self) -> None:
+        """Build an index of clade annotations, so that clade membership can be looked up without scanning the tree.
+        The index is built automatically by get_clade_samples, get_clade, count_clades_inclusive and list_clades, and reused until 
+        annotations are changed with apply_node_annotations or the tree is changed by create_node, move_node, remove_node or loading a new tree.
+        Annotations changed directly through MATNode objects are not tracked; call this function again afterwards.
+        """
+        cdef bte.CladeIndex* index
+        with nogil:
+            index = new bte.CladeIndex(&self.t)
+        self.clade_index.reset(index)
+
     cpdef vector[string] get_clade_samples(self, clade_id):
         """Return samples from the selected clade.
 
@@ -787,9 +1304,19 @@ cdef class MATree:
         Returns:
             list[bytes]: List of sample IDs which are members of the indicated clade.
         """
-        cdef vector[string] samples = bte.get_clade_samples(&self.t, clade_id.encode("UTF-8"))
+        cdef string clade = clade_id.encode("UTF-8")
+        cdef vector[string] samples
+        cdef bte.CladeIndex* index
+        self.lock_read()
+        try:
+            index = self.get_clade_index()
+            with nogil:
+                samples = index.clade_samples(clade)
+        finally:
+            self.unlock_read()
         return samples
 
+    @_reads
     def get_clade(self, clade_id: str) -> MATree:
         """Return a subtree representing the selected clade.
 
@@ -818,9 +1345,17 @@ cdef class MATree:
         """        
         #the C++ allows for a preselection of samples, but we don't use that option.
         cdef vector[string] to_check = []
-        cdef vector[string] samples = bte.get_sample_match(&self.t, to_check, regexstr.encode("UTF-8"))
+        cdef string pattern = regexstr.encode("UTF-8")
+        cdef vector[string] samples
+        self.lock_read()
+        try:
+            with nogil:
+                samples = bte.get_sample_match(&self.t, to_check, pattern)
+        finally:
+            self.unlock_read()
         return samples
     
+    @_reads
     def get_regex(self, regexstr: str) -> MATree:
         """Return a subtree representing all samples matching the regular expression.
 
@@ -837,6 +1372,7 @@ cdef class MATree:
         print("Successfully found {} samples.".format(len(samples)),file=sys.stderr)
         return self.get_subtree(samples)
 
+    @_reads
     def get_random(self, size: int, current_samples: list = [], lca_limit: bool = False) -> MATree:
         """Select a random subtree of the selected size. Optionally, pass a list of samples to include.
         If the list of samples to include is larger than the target size, random samples will be removed from the list.
@@ -858,7 +1394,9 @@ cdef class MATree:
         cdef vector[string] starting_samples = current_samples
         cdef size_t target_size = size
         cdef bool lcal = lca_limit
-        cdef vector[string] final_samples = bte.fill_random_samples(&self.t, starting_samples, target_size, lcal)
+        cdef vector[string] final_samples
+        with nogil:
+            final_samples = bte.fill_random_samples(&self.t, starting_samples, target_size, lcal)
         return self.get_subtree(final_samples)
 
     cpdef vector[string] get_mutation_samples(self, mutation):
@@ -872,11 +1410,117 @@ cdef class MATree:
         """    
         #can't use the error decorator for this function since it is cpdef.
         if self._tree_only:
-            Exception("Cannot find mutations on a tree-only MATree.")
-        cdef vector[string] samples = bte.get_mutation_samples(&self.t, mutation.encode("UTF-8"))
+            raise ValueError("Cannot find mutations on a tree-only MATree.")
+        cdef bte.MutationIndex* index
+        cdef int16_t chrom = -1
+        cdef bte.Mutation target = instantiate_mutation(mutation)
+        cdef vector[bte.Node*] leaves
+        cdef vector[string] samples
+        self.lock_read()
+        try:
+            index = self.get_mutation_index()
+            if ':' in mutation:
+                chrom = index.chrom_id(mutation.split(":")[0].encode("UTF-8"))
+                if chrom < 0:
+                    return []
+            with nogil:
+                leaves = index.mutation_samples(chrom, target.position, target.par_nuc, target.mut_nuc)
+            samples.reserve(leaves.size())
+            for i in range(leaves.size()):
+                samples.push_back(leaves[i].identifier)
+        finally:
+            self.unlock_read()
         return samples
 
+    cdef bte.MutationIndex* get_mutation_index(self) except NULL:
+        cdef bte.MutationIndex* index
+        with nogil:
+            index = self.lock.lazy_index[bte.MutationIndex](self.mutation_index, &self.t)
+        return index
+
+    @_writes
+    def build_mutation_index(self) -> None:
+        """Build an inverted index from mutations to the nodes which carry them, so that mutation queries do not scan the tree.
+        The index is built automatically by get_mutation_samples, get_mutation, count_mutation_types, mutations_in_range and allele_frequencies, 
+        and reused until the tree or its mutations are changed through MATree methods (apply_mutations, create_node, move_node, remove_node, 
+        reverse_strand or loading a new tree). Mutations changed directly through MATNode objects are not tracked; call this function again afterwards.
+        """
+        cdef bte.MutationIndex* index
+        with nogil:
+            index = new bte.MutationIndex(&self.t)
+        self.mutation_index.reset(index)
+
     @_check_newick_only
+    @_reads
+    def mutations_in_range(self, start: int, end: int, chrom: Optional[str] = None) -> list[tuple[str,str,int]]:
+        """Return every mutation on the tree at positions from start to end (inclusive), sorted by position and alternative allele.
+
+        Args:
+            start (int): The first position of the range.
+
+            end (int): The last position of the range.
+
+            chrom (Optional[str], optional): Only return mutations on this chromosome. Defaults to all chromosomes.
+
+        Returns:
+            list[tuple[str,str,int]]: The ID of the node carrying each mutation, the mutation in reflocalt format (e.g. A123G) and the number
+            of leaves below the node which still carry the alternative allele (i.e. without a later mutation at the same site).
+        """
+        cdef bte.MutationIndex* index = self.get_mutation_index()
+        cdef int16_t target = -1
+        if chrom != None:
+            target = index.chrom_id(chrom.encode("UTF-8"))
+            if target < 0:
+                return []
+        cdef int32_t first = start, last = end
+        cdef pair[size_t,size_t] bounds
+        cdef vector[bte.MutationRecord] records
+        cdef size_t c, r
+        with nogil:
+            for c in range(index.chromosomes.size()):
+                if target >= 0 and c != <size_t>target:
+                    continue
+                bounds = index.range(c, first, last)
+                for r in range(bounds.first, bounds.second):
+                    records.push_back(index.records[r])
+        mutations = []
+        for r in range(records.size()):
+            mstr = chr(bte.get_nuc(records[r].par_nuc)) + str(records[r].position) + chr(bte.get_nuc(records[r].mut_nuc))
+            mutations.append((records[r].node.identifier.decode("UTF-8"), mstr, records[r].carriers))
+        return mutations
+
+    @_check_newick_only
+    @_reads
+    def allele_frequencies(self, position: int, chrom: Optional[str] = None) -> dict[str,float]:
+        """Return the frequency of each allele among all leaves of the tree at a site. 
+        Returns an empty dictionary if no mutations occur at the site, since the reference allele is then unknown.
+
+        Args:
+            position (int): The position of the site.
+
+            chrom (Optional[str], optional): The chromosome of the site. Can be omitted if the tree has mutations on a single chromosome.
+
+        Returns:
+            dict[str,float]: Dictionary mapping alleles (e.g. "A") to their frequency among leaves.
+        """
+        cdef bte.MutationIndex* index = self.get_mutation_index()
+        cdef int16_t c = 0
+        if chrom != None:
+            c = index.chrom_id(chrom.encode("UTF-8"))
+            if c < 0:
+                return {}
+        elif index.chromosomes.size() > 1:
+            raise ValueError("The tree has mutations on more than one chromosome; specify chrom.")
+        cdef vector[int64_t] counts = index.allele_counts(c, position)
+        cdef size_t total = index.leaves.size()
+        frequencies = {}
+        for nuc in range(16):
+            if counts[nuc] > 0:
+                frequencies[chr(bte.get_nuc(nuc))] = counts[nuc] / total
+        return frequencies
+
+    @_check_newick_only
+    @_reads
     def get_mutation(self, mutation: str) -> MATree:
         """Return a subtree containing samples with genotypes containing the indicated mutation.
 
@@ -890,6 +1534,7 @@ cdef class MATree:
         return self.get_subtree(samples)
 
     @_check_newick_only
+    @_reads
     def count_mutation_types(self, subroot: Optional[str] = None) -> dict[str,int]:
         """Compute the counts of individual mutation types across the tree. If a subtree root is indicated, it only counts mutations
         descended from that node. By default, this counts across the entire tree.
@@ -900,21 +1545,18 @@ cdef class MATree:
         Returns:
             dict[str,int]: Dictionary containing mutation counts.
         """
+        cdef Node* target_n = self.fetch_node(subroot)
+        cdef bte.MutationIndex* index = self.get_mutation_index()
+        cdef vector[int64_t] spectrum
+        with nogil:
+            spectrum = index.mutation_spectrum(target_n)
         mcount = {}
-        cdef Node* target_n = self.t.root
-        if subroot != None:
-            target_n = self.t.get_node(subroot.encode("UTF-8"))
-        cdef vector[Node*] nvec = self.t.depth_first_expansion(target_n)
-        for i in range(nvec.size()):
-            for m in nvec[i].mutations:
-                pym = m.get_string().decode("UTF-8")
-                pym_type = pym[0] + ">" + pym[-1]
-                if pym_type in mcount:
-                    mcount[pym_type] += 1
-                else:
-                    mcount[pym_type] = 1
+        for i in range(spectrum.size()):
+            if spectrum[i] > 0:
+                mcount[chr(bte.get_nuc(i // 16)) + ">" + chr(bte.get_nuc(i % 16))] = spectrum[i]
         return mcount
 
+    @_reads
     def count_leaves(self, subroot: Optional[str] = None) -> int:
         """Return the number of leaves descended from the indicated node. By default, counts all leaves on the tree.
 
@@ -924,42 +1566,19 @@ cdef class MATree:
         Returns:
             int: The count of leaves.
         """        
-        cdef Node* target_n = self.t.root
-        if subroot != None:
-            target_n = self.t.get_node(subroot.encode("UTF-8"))
-        return self.t.get_num_leaves(target_n)
-
-    cdef cset[bte.Mutation] accumulate_mutations(self, string sample):
-        cdef vector[bte.Node*] ancestors = self.t.rsearch(sample, True)
-        cdef cset[bte.Mutation] allm
-        cdef cset[bte.Mutation].iterator allm_iter
-        cdef size_t i, j
-        cdef bte.Node* cnode
-        cdef bte.Mutation m, om
-        cdef size_t ancs = ancestors.size()
-        for i in range(ancs):
-            #proceed in reverse order e.g. root to sample.
-            cnode = ancestors[ancs-i-1]
-            for j in range(cnode.mutations.size()):
-                m = cnode.mutations[j]
-                fresh = True
-                allm_iter = allm.begin()
-                while allm_iter != allm.end():
-                    om = dereference(allm_iter)
-                    if (m.chrom == om.chrom) and (m.position == om.position):
-                        fresh = False
-                        #instead of inserting this mutation anew, update the old one.
-                        #if they're opposite, they negate to prevent a mutation from something to itself.
-                        allm.erase(allm_iter)
-                        if m.mut_nuc != om.par_nuc:
-                            m.par_nuc = om.par_nuc
-                            allm.insert(m)
-                        break
-                    postincrement(allm_iter)
-                if fresh:
-                    allm.insert(m)
-        return allm
+        cdef Node* target_n = self.fetch_node(subroot, self.t.root)
+        cdef size_t count
+        with nogil:
+            count = self.t.get_num_leaves(target_n)
+        return count
+
+    cdef vector[bte.Mutation] accumulate_mutations(self, bte.Node* node):
+        cdef vector[bte.Mutation] haplotype
+        with nogil:
+            haplotype = bte.get_node_haplotype(node)
+        return haplotype
 
+    @_reads
     def mutation_set(self, nid: str) -> set[str]:
         """Return the complete set of mutations (haplotype) the indicated node has with respect to the reference. 
         DEPRECATED in favor of get_haplotype, which is equivalent functionally.
@@ -975,6 +1594,7 @@ cdef class MATree:
         return self.get_haplotype(nid)
 
     @_check_newick_only
+    @_reads
     def get_haplotype(self, nid: str) -> set[str]:
         """Return the complete set of mutations (haplotype) the indicated node has with respect to the reference. 
 
@@ -984,43 +1604,52 @@ cdef class MATree:
         Returns:
             set[str]: the haplotype of the node, represented as a set of mutations formatted in reflocalt (e.g. A123G) format.
         """
+        cdef bte.Node* node = self.t.get_node(nid.encode("UTF-8"))
+        if node == NULL:
+            raise ValueError("Node " + nid + " not found in the tree.")
+        cdef vector[bte.Mutation] accm = self.accumulate_mutations(node)
         pyset = set()
-        cdef cset[bte.Mutation] accm = self.accumulate_mutations(nid.encode("UTF-8"))
-        cdef cset[bte.Mutation].iterator accm_it = accm.begin()
-        while accm_it != accm.end():
-            pyset.add(dereference(accm_it).get_string().decode('UTF-8'))
-            postincrement(accm_it)
+        for i in range(accm.size()):
+            pyset.add(accm[i].get_string().decode('UTF-8'))
         return pyset
 
-    cdef count_differences(self, cset[bte.Mutation] l1, cset[bte.Mutation] l2):
-        cdef size_t total_matched = 0
-        cdef bte.Mutation e1
-        cdef cset[bte.Mutation].iterator it = l1.begin()
-        while it != l1.end():
-            e1 = dereference(it)
-            if l2.find(e1) != l2.end():
-                total_matched += 1
-            postincrement(it)
-        return l1.size() + l2.size() - (total_matched * 2)
-
-    cdef map[cset[bte.Mutation],size_t] count_haplotypes_c(self):
+    @_check_newick_only
+    @_reads
+    def get_haplotypes(self, nids: list[str]) -> dict[str,set[str]]:
+        """Return the haplotypes of many nodes at once. All haplotypes are collected in a single traversal of the tree,
+        which is much faster than calling get_haplotype on each node when many nodes are requested.
+
+        Args:
+            nids (list[str]): The target nodes to get haplotypes for.
+
+        Returns:
+            dict[str,set[str]]: Dictionary mapping each node to its haplotype, represented as a set of mutations formatted in reflocalt (e.g. A123G) format.
+        """
+        cdef vector[bte.Node*] nodes
+        cdef bte.Node* node
+        for nid in nids:
+            node = self.t.get_node(nid.encode("UTF-8"))
+            if node == NULL:
+                raise ValueError("Node " + nid + " not found in the tree.")
+            nodes.push_back(node)
+        cdef vector[vector[bte.Mutation]] haplotypes
+        with nogil:
+            haplotypes = bte.get_node_haplotypes(&self.t, nodes)
+        pyhaps = {}
+        for i in range(haplotypes.size()):
+            pyhaps[nids[i]] = set([haplotypes[i][j].get_string().decode('UTF-8') for j in range(haplotypes[i].size())])
+        return pyhaps
+
+    cdef vector[pair[vector[bte.Mutation],size_t]] count_haplotypes_c(self, bte.Node* subroot):
         '''
-        Return a dictionary of unique haplotypes and their counts. Used for nucleotide diversity estimates.
+        Return a vector of unique haplotypes and their counts among the leaves descended from subroot. Used for nucleotide diversity estimates.
         '''
-        cdef vector[string] samples = self.t.get_leaves_ids("".encode("UTF-8"))
-        cdef map[cset[bte.Mutation],size_t] divtrack
-        cdef map[cset[bte.Mutation],size_t].iterator finder
-        cdef size_t i
-        cdef cset[bte.Mutation] accum_muts
-        for i in range(samples.size()):
-            accum_muts = self.accumulate_mutations(samples[i])
-            finder = divtrack.find(accum_muts)
-            if finder == divtrack.end():
-                divtrack[accum_muts] = 1
-            else:
-                divtrack[accum_muts] = dereference(finder).second + 1
-        return divtrack
+        cdef vector[pair[vector[bte.Mutation],size_t]] haplotypes
+        with nogil:
+            haplotypes = bte.count_haplotypes_dfs(&self.t, subroot)
+        return haplotypes
 
+    @_reads
     def count_clades_inclusive(self, subroot: str = "") -> dict[str,int]:
         """Count the total number of leaves belonging to each clade on the subtree.
         Counts are inclusive (e.g. samples belonging to a clade descended from another clade will count for the ancestor clade as well)
@@ -1032,145 +1661,194 @@ cdef class MATree:
         Returns:
             dict[str,int]: Dictionary containing clade counts.
         """
-        cdef vector[string] leaves = self.t.get_leaves_ids(subroot.encode("UTF-8"))
-        cdef size_t i,j,k
-        cdef vector[bte.Node*] ancestors
-        cdef vector[string] canns
-        cdef string ann
+        cdef bte.Node* target_n = self.fetch_node(subroot)
+        cdef bte.CladeIndex* index = self.get_clade_index()
+        cdef vector[size_t] counts
+        with nogil:
+            counts = index.count_inclusive(target_n)
         clade_counts = {}
-        for i in range(leaves.size()):
-            ancestors = self.t.rsearch(leaves[i], True)
-            for j in range(ancestors.size()):
-                canns = ancestors[j].clade_annotations
-                for k in range(canns.size()):
-                    ann = canns[k]
-                    if ann.size() > 0:
-                        annstr = ann.decode("UTF-8")
-                        if annstr not in clade_counts:
-                            clade_counts[annstr] = 0
-                        clade_counts[annstr] += 1
+        for i in range(counts.size()):
+            if counts[i] > 0:
+                clade_counts[index.names[i].decode("UTF-8")] = counts[i]
         return clade_counts
 
     @_check_newick_only    
+    @_reads
     def count_haplotypes(self) -> dict[tuple,int]:
         """Count unique haplotypes from the tree.
 
         Returns:
             dict[tuple,int]: haplotype counts.
         """
-        cdef map[cset[bte.Mutation],size_t] hmap = self.count_haplotypes_c()
-        cdef map[cset[bte.Mutation],size_t].iterator it = hmap.begin()
-        cdef cset[bte.Mutation].iterator it2
+        cdef vector[pair[vector[bte.Mutation],size_t]] hvec = self.count_haplotypes_c(self.t.root)
+        cdef size_t i, j
         pymap = {}
-        while it != hmap.end():
-            mset = set()
-            it2 = dereference(it).first.begin()
-            while it2 != dereference(it).first.end():
-                mset.add(dereference(it2).get_string())
-                postincrement(it2)
-            pymap[tuple(mset)] = dereference(it).second
-            postincrement(it)
+        for i in range(hvec.size()):
+            pymap[tuple([hvec[i].first[j].get_string() for j in range(hvec[i].first.size())])] = hvec[i].second
         return pymap
 
     @_check_newick_only
-    def compute_nucleotide_diversity(self) -> float:
+    @_reads
+    def compute_nucleotide_diversity(self, subroot: Optional[str] = None, method: str = "branch") -> float:
         """Function which computes the nucleotide diversity of the tree. This is defined as the mean number of pairwise differences in nucleotides between any two leaves
-        of the tree. Computes an unbiased estimator which multiplies the final mean by the total number of sequences divided by the total number of sequences minus one.
+        of the tree, and is computed over all pairs of distinct leaves (an unbiased estimator).
+
+        By default, this is computed from the mutation count of each branch and the number of leaves on either side of it in a single pass over the tree.
+        This assumes infinite sites; on trees with homoplasy or reversions, the branch method counts every mutation event. 
+        The "haplotype" method instead compares every pair of unique haplotypes on the tree exactly, which is quadratic in the number of haplotypes and intended for validation.
+
+        Args:
+            subroot (Optional[str], optional): Compute the diversity of the leaves descended from this node. Defaults to the root.
+
+            method (str, optional): Either "branch" or "haplotype". Defaults to "branch".
 
         Raises:
-            Exception: Can't be computed on an empty tree.
+            Exception: Can't be computed on a tree with less than two leaves.
 
         Returns:
             float: The estimated nucleotide diversity.
-        """        
-        #compute the set of mutations belonging to each sample in the tree, then compute pi from the resulting frequencies
-        #since each sample is individually rsearched, this implementation is less efficient than an informed traversal, but still fast enough for most purposes.
-        cdef map[cset[bte.Mutation],size_t] divtrack = self.count_haplotypes_c()
-        cdef size_t total_seq = self.t.get_leaves_ids(self.t.root.identifier).size()
+        """
+        if method != "branch" and method != "haplotype":
+            raise ValueError("Nucleotide diversity method must be either 'branch' or 'haplotype'.")
+        cdef bte.Node* target_n = self.fetch_node(subroot)
+        cdef size_t total_seq = self.t.get_num_leaves(target_n)
         if total_seq == 0:
             raise Exception("No sequences found in tree")
+        if total_seq == 1:
+            raise Exception("Nucleotide diversity requires at least two sequences")
+        cdef vector[bte.NodeDiversity] branchdiv
+        if method == "branch":
+            with nogil:
+                branchdiv = bte.branch_nucleotide_diversity(&self.t, target_n)
+            return branchdiv[0].diversity
+        #compute the set of mutations belonging to each sample in the tree, then compute pi from the resulting frequencies
+        cdef vector[pair[vector[bte.Mutation],size_t]] divtrack = self.count_haplotypes_c(target_n)
         cdef double div = 0
-        cdef map[cset[bte.Mutation],size_t].iterator it = divtrack.begin()
-        cdef map[cset[bte.Mutation],size_t].iterator it2
+        cdef size_t i, j
         cdef double g1_freq, g2_freq
         cdef size_t pair_diff
-        while it != divtrack.end():
-            g1_freq = dereference(it).second / total_seq
+        for i in range(divtrack.size()):
+            g1_freq = <double>divtrack[i].second / total_seq
             assert g1_freq > 0
-            it2 = it
-            postincrement(it2)
-            while it2 != divtrack.end():
-                g2_freq = dereference(it2).second / total_seq
+            for j in range(i+1, divtrack.size()):
+                g2_freq = <double>divtrack[j].second / total_seq
                 assert g2_freq > 0
-                pair_diff = self.count_differences(dereference(it).first,dereference(it2).first)
-                div = div + (g1_freq * g2_freq * pair_diff)
-                postincrement(it2)
-            postincrement(it)
+                pair_diff = bte.count_haplotype_differences(divtrack[i].first, divtrack[j].first)
+                #each unordered pair of haplotypes is visited once, so it is counted for both orderings here.
+                div = div + (2 * g1_freq * g2_freq * pair_diff)
         #multiply the final result to guarantee an unbiased estimator (see wikipedia entry)
-        return div * (total_seq / (total_seq - 1))
+        return div * (<double>total_seq / (total_seq - 1))
+
+    @_check_newick_only
+    @_reads
+    def subtree_nucleotide_diversity(self, subroot: Optional[str] = None) -> dict[str,float]:
+        """Compute the nucleotide diversity of the subtree descended from every internal node in a single pass, using the branch method of compute_nucleotide_diversity.
+        Nodes with fewer than two descendent leaves are not included. Use together with get_annotations to get the diversity of each annotated clade.
 
-    def simple_parsimony(self, leaf_assignments: dict[str,str]) -> dict[str,str]:
+        Args:
+            subroot (Optional[str], optional): Only compute diversity for this node and its descendents. Defaults to the root.
+
+        Returns:
+            dict[str,float]: Dictionary mapping node IDs to the nucleotide diversity of the leaves descended from them.
+        """
+        cdef bte.Node* target_n = self.fetch_node(subroot)
+        cdef vector[bte.NodeDiversity] branchdiv
+        with nogil:
+            branchdiv = bte.branch_nucleotide_diversity(&self.t, target_n)
+        divmap = {}
+        for i in range(branchdiv.size()):
+            divmap[branchdiv[i].node.identifier.decode("UTF-8")] = branchdiv[i].diversity
+        return divmap
+
+    cdef bte.ParsimonyResult parsimony_c(self, leaf_states: dict, size_t num_characters, size_t num_states, bte.Node* subroot):
+        """
+        Encode a dictionary of leaf state indices and run the Fitch-Hartigan kernel on the subtree below subroot.
+        """
+        cdef vector[bte.Node*] leaves
+        cdef vector[int32_t] states
+        cdef bte.Node* leaf
+        cdef bte.ParsimonyResult result
+        leaves.reserve(len(leaf_states))
+        states.reserve(len(leaf_states) * num_characters)
+        for lid, lstates in leaf_states.items():
+            leaf = self.t.get_node(lid.encode("UTF-8"))
+            if leaf == NULL:
+                raise ValueError("Node " + lid + " not found in the tree.")
+            if len(lstates) != num_characters:
+                raise ValueError("Leaf " + lid + " has " + str(len(lstates)) + " states, expected " + str(num_characters) + ".")
+            leaves.push_back(leaf)
+            for s in lstates:
+                states.push_back(-1 if s is None else s)
+        with nogil:
+            result = bte.fitch_hartigan(&self.t, subroot, leaves, states, num_characters, num_states)
+        return result
+
+    @_reads
+    def parsimony(self, leaf_states: dict[str,list[int]], num_states: Optional[int] = None, subroot: Optional[str] = None) -> dict:
+        """Solve the small parsimony problem for many categorical characters at once, with the Fitch-Hartigan algorithm.
+        Polytomies are handled directly, so the tree is not resolved or copied first.
+
+        Each leaf is assigned a list with one state index per character; all lists must be the same length. 
+        States are integers from 0 up to num_states-1, and None or a negative index marks missing data. 
+        Leaves which are missing from the dictionary or have missing data may take any state. Where several states are equally 
+        parsimonious, a node keeps the state of its parent if possible and otherwise takes the lowest-numbered state.
+
+        The returned dictionary contains:
+
+            identifiers (list[str]): the IDs of the nodes of the subtree, in preorder.
+
+            states (memoryview): an int32 array with one row per node (in the same order) and one column per character.
+
+            scores (array.array): the minimum number of state changes of each character, as int64.
+
+        Args:
+            leaf_states (dict[str,list[int]]): Dictionary mapping leaf names to a list of state indices, one per character.
+
+            num_states (Optional[int], optional): The number of possible states of each character. Defaults to one more than the largest index observed.
+
+            subroot (Optional[str], optional): Only infer states for this node and its descendents. Defaults to the root.
+
+        Returns:
+            dict: Dictionary with the node IDs, the node by character state array and the parsimony score of each character.
+        """
+        cdef bte.Node* target_n = self.fetch_node(subroot)
+        if len(leaf_states) == 0:
+            raise ValueError("At least one leaf state assignment is required.")
+        cdef size_t num_characters = len(next(iter(leaf_states.values())))
+        if num_states is None:
+            num_states = 1 + max([max([s for s in lstates if s is not None], default=0) for lstates in leaf_states.values()])
+        cdef bte.ParsimonyResult result = self.parsimony_c(leaf_states, num_characters, num_states, target_n)
+        states = memoryview(_copy_to_array('i', result.states.data(), result.states.size())).cast('B').cast('i', (result.nodes.size(), num_characters))
+        return {
+            "identifiers": [result.nodes[i].identifier.decode("UTF-8") for i in range(result.nodes.size())],
+            "states": states,
+            "scores": _copy_to_array('q', result.scores.data(), result.scores.size()),
+        }
+
+    @_reads
+    def simple_parsimony(self, leaf_assignments: dict[str,Hashable]) -> dict[str,Hashable]:
         """This function is an implementation of the small parsimony problem (Fitch algorithm) for a single set of states.
         It takes as input a dictionary mapping leaf names to character states and returns a dictionary mapping both leaf and internal node names to inferred character states.
+        Polytomies are handled directly with the Fitch-Hartigan algorithm; see parsimony for inferring many characters at once.
 
         Args:
-            leaf_assignments (dict[str,str]): Dictionary mapping leaf names to character states.
+            leaf_assignments (dict[str,Hashable]): Dictionary mapping leaf names to character states. States can be any hashable object.
 
         Returns:
-            dict[str,str]: Dictionary mapping node names to inferred character states.
-        """        
-        ##TODO: refactoring this to use more c types would increase efficiency notably. It's fairly niche in application, though.
-        #this algorithm traverses the tree in postorder (reverse depth-first)
-        #it requires that the tree be fully resolved and bifurcating, so that's the first step.
-        #note on efficiency- we're using Python dicts to do most of the set logic, which are slower than using native C++ objects
-        print("Resolving polytomies...",file=sys.stderr)
-        self.resolve_all_polytomies()
-        #initialize node assignments with leaf states
-        node_assignment_set = {l:set(v) for l,v in leaf_assignments.items()}
-        print("{} initial assignments".format(len(node_assignment_set)),file=sys.stderr)
-        #first, a postorder traversal. We implement this here by generating nodes in depth-first order and proceeding 
-        #to iterate through their indeces in reverse.
-        cdef vector[Node*] nodes = self.t.depth_first_expansion(self.t.root)
-        cdef Node* cnode
-        cdef vector[Node*] children
-        cdef size_t i
-        for i in range(nodes.size()):
-            cnode = nodes[nodes.size()-i-1]
-            if not cnode.is_leaf():
-                #if it is correctly resolved, this node will have exactly two children.
-                children = cnode.children
-                assert children.size() == 2
-                left = node_assignment_set[children[0].identifier.decode("UTF-8")]
-                right = node_assignment_set[children[1].identifier.decode("UTF-8")]
-                state = left & right
-                if not state:
-                    state = left | right
-                node_assignment_set[cnode.identifier.decode("UTF-8")] = state
-        #we then traverse again through the same sets of nodes in preorder/depth-first, finalizing character states based on 
-        #the state of the parent.
-        assert len(node_assignment_set) == nodes.size()
-        final_node_assignment = leaf_assignments
-        cdef Node* parent
-        for i in range(nodes.size()):
-            cnode = nodes[i]
-            if not cnode.is_leaf():
-                current_state = node_assignment_set[cnode.identifier.decode("UTF-8")]
-                if len(current_state) == 1:
-                    final_node_assignment[cnode.identifier.decode("UTF-8")] = list(current_state)[0]
-                elif cnode.is_root():
-                    final_node_assignment[cnode.identifier.decode("UTF-8")] = '0'
-                else:
-                    parent = cnode.parent
-                    #in depth-first, this should always be accessible.
-                    parent_state = final_node_assignment[parent.identifier.decode("UTF-8")]
-                    if parent_state not in current_state:
-                        #if the parent state is not part of the multiple options for this node, just take the first one.
-                        final_node_assignment[cnode.identifier.decode("UTF-8")] = list(current_state)[0]
-                    else:
-                        final_node_assignment[cnode.identifier.decode("UTF-8")] = parent_state
-        print("{} final assignments".format(len(final_node_assignment)),file=sys.stderr)
+            dict[str,Hashable]: Dictionary mapping node names to inferred character states.
+        """
+        #sorted by their text so that ties are broken the same way on every run, even when states of different types are mixed.
+        labels = sorted(set(leaf_assignments.values()), key = str)
+        if len(labels) == 0:
+            raise ValueError("At least one leaf state assignment is required.")
+        encoding = {label:i for i,label in enumerate(labels)}
+        cdef bte.ParsimonyResult result = self.parsimony_c({l:[encoding[v]] for l,v in leaf_assignments.items()}, 1, len(labels), self.t.root)
+        final_node_assignment = {}
+        for i in range(result.nodes.size()):
+            final_node_assignment[result.nodes[i].identifier.decode("UTF-8")] = labels[result.states[i]]
         return final_node_assignment
 
+    @_writes
     def ladderize(self) -> None:
         """
         Sort the branches of the tree according to the size of each partition.
@@ -1178,6 +1856,7 @@ cdef class MATree:
         self.t.rotate_for_consistency()
 
     @_check_newick_only
+    @_writes
     def reverse_strand(self, genome_size: int = 29903) -> None:
         """
         Inverts the tree representation of mutations such that all mutations are with respect to the reverse strand of the reference.
@@ -1189,6 +1868,7 @@ cdef class MATree:
         cdef vector[Node*] nodes = self.t.depth_first_expansion(self.t.root)
         cdef vector[Mutation] nmv 
         cdef Mutation newmut
+        self.invalidate_indexes()
         for i in range(nodes.size()):
             nmv.clear()
             for mutation in nodes[i].mutations:
@@ -1201,22 +1881,17 @@ cdef class MATree:
             #since nodes[i] is a pointer to the original node object, we can simply edit it inplace.
             nodes[i].mutations = nmv
         
+    @_reads
     def list_clades(self) -> set[str]:
         """Return a set of all valid clade annotations in the tree that can be used with get_clade and other functions.
 
         Returns:
             set[str]: Set of all valid clade annotations.
         """
-        clades = set()
-        cdef vector[Node*] nodes = self.t.depth_first_expansion(self.t.root)
-        cdef vector[string] anns
-        for i in range(nodes.size()):
-            anns = nodes[i].clade_annotations
-            for j in range(anns.size()):
-                if anns[j].size() > 0:
-                    clades.add(anns[j].decode("UTF-8"))
-        return clades
+        cdef bte.CladeIndex* index = self.get_clade_index()
+        return set([index.names[i].decode("UTF-8") for i in range(index.names.size())])
 
+    @_writes
     def create_node(self, identifier: str, parent_id: str, mutations: list[str] = [], annotations: list[str] = [], branch_length: float = 0.0):
         """Create a new node and place it in the tree without generating a wrapper.
         This does not return a MATNode object, so access to the created node will require a subsequent 
@@ -1235,17 +1910,83 @@ cdef class MATree:
         """
         if len(annotations) > 2:
             raise ValueError("Cannot have more than 2 annotations per node due to internal implementation limitations.")
-        if branch_length == 0.0:
-            branch_length = float(len(mutations))
-        cdef float blen = branch_length
-        cdef Node* newnode = self.t.create_node(identifier.encode("UTF-8"),parent_id.encode("UTF-8"),blen)
-        cdef bte.Mutation newmut
-        for m in mutations:
-            newmut = instantiate_mutation(m)
-            newnode.mutations.push_back(newmut)
+        _raise_bulk_errors(self.create_nodes([identifier], [parent_id], [branch_length if branch_length != 0.0 else None], [mutations]), "created")
+        cdef Node* newnode = self.t.get_node(identifier.encode("UTF-8"))
         for a in annotations:
             newnode.clade_annotations.push_back(a)
         
+    cdef list create_node_batch(self, bte.NodeBatch& batch):
+        cdef vector[bte.BulkError] errors
+        self.invalidate_indexes(True)
+        with nogil:
+            errors = bte.create_node_batch(&self.t, batch)
+            self.translation_cache.mark_nodes(batch.identifiers)
+        return _bulk_errors(errors)
+
+    @_writes
+    def create_nodes(self, identifiers: list[str], parents: list[str], branch_lengths: Optional[list[Optional[float]]] = None, mutations: Optional[list[list[str]]] = None) -> list[tuple[str,str]]:
+        """Create many nodes at once from an edge list. Each new node is placed below its parent, which is either already in the 
+        tree or another node in the list; parents can be listed after their children. Nodes and their mutations are created in C++ 
+        without holding the GIL.
+
+        Nodes whose identifier is already taken, which have invalid mutations or whose parent cannot be found are not created, 
+        and neither are the nodes below them. They are returned with a description of the problem.
+
+        Args:
+            identifiers (list[str]): The identifiers of the new nodes.
+
+            parents (list[str]): The identifier of the parent of each new node.
+
+            branch_lengths (Optional[list[Optional[float]]]): The branch length of each new node. Missing values (None) default to the number of mutations of the node.
+
+            mutations (Optional[list[list[str]]]): The mutations of each new node, formatted as chro:reflocalt e.g. chr1:A234G. If chromosome is left off, assumes SARS-CoV-2 chromosome.
+
+        Returns:
+            list[tuple[str,str]]: The identifier and problem of each node which could not be created.
+        """
+        if len(parents) != len(identifiers) or (branch_lengths is not None and len(branch_lengths) != len(identifiers)) or (mutations is not None and len(mutations) != len(identifiers)):
+            raise ValueError("Parents, branch lengths and mutations must be given for every node.")
+        cdef vector[string] ids
+        cdef vector[uint64_t] offsets
+        cdef vector[string] strings
+        ids.reserve(len(identifiers))
+        offsets.push_back(0)
+        for i, nid in enumerate(identifiers):
+            ids.push_back(nid.encode("UTF-8"))
+            if mutations is not None:
+                for m in mutations[i]:
+                    strings.push_back(m.encode("UTF-8"))
+            offsets.push_back(strings.size())
+        cdef bte.NodeBatch batch
+        with nogil:
+            batch = bte.node_batch_from_strings(ids, offsets, strings)
+        for i in range(len(identifiers)):
+            batch.parents.push_back(parents[i].encode("UTF-8"))
+            if branch_lengths is None or branch_lengths[i] is None:
+                batch.branch_length.push_back(math.nan)
+            else:
+                batch.branch_length.push_back(branch_lengths[i])
+        return self.create_node_batch(batch)
+
+    @_writes
+    def create_nodes_file(self, file: str) -> list[tuple[str,str]]:
+        """Create many nodes at once from a tab-separated edge list file, which may be gzipped. Each line holds the identifier of a 
+        new node, the identifier of its parent, an optional branch length and an optional comma-separated list of mutations 
+        (e.g. "sample_1<tab>node_5<tab><tab>chr1:A123G"). Empty lines and lines starting with # are skipped. Nodes are placed as by create_nodes.
+
+        Args:
+            file (str): The path of the file.
+
+        Returns:
+            list[tuple[str,str]]: The identifier and problem of each node which could not be created.
+        """
+        cdef string fn = file.encode("UTF-8")
+        cdef bte.NodeBatch batch
+        with nogil:
+            batch = bte.read_node_batch(fn, True)
+        return self.create_node_batch(batch)
+
+    @_writes
     def move_node(self, to_move: str, new_parent: str) -> None:
         """Move a node from its current parent to a new parent. 
 
@@ -1254,8 +1995,14 @@ cdef class MATree:
 
             new_parent (str): The identifier of the new parent of the node.
         """
+        cdef bte.Node* source = self.fetch_node(to_move)
+        self.fetch_node(new_parent)
+        self.invalidate_indexes(True)
+        self.translation_cache.before_detach(&self.t, source, False)
         self.t.move_node(to_move.encode("UTF-8"), new_parent.encode("UTF-8"), True)
+        self.translation_cache.after_detach(&self.t)
 
+    @_writes
     def remove_node(self, to_remove: str) -> None:
         """Remove a node from the tree. This is a destructive operation. 
         WARNING: It can cause segmentation faults if children are left orphaned.
@@ -1263,8 +2010,13 @@ cdef class MATree:
         Args:
             to_remove (str): The identifier of the node to remove.
         """
+        cdef bte.Node* source = self.fetch_node(to_remove)
+        self.invalidate_indexes(True)
+        self.translation_cache.before_detach(&self.t, source, True)
         self.t.remove_node(to_remove.encode("UTF-8"), True)
+        self.translation_cache.after_detach(&self.t)
 
+    @_writes
     def apply_node_annotations(self, annotations: dict[str,list[str]]) -> None:
         """Apply annotations to the tree. Replaces any annotations on nodes affected.
 
@@ -1272,12 +2024,14 @@ cdef class MATree:
             annotations (dict[str,list[str]]): A dictionary of annotations to apply to the tree, keyed on node_id with a list of annotation strings as the value.
         """
         cdef Node* node
+        self.clade_index.reset()
         for nid, annv in annotations.items():
             node = self.t.get_node(nid.encode("UTF-8"))
             node.clear_annotations()
             for an in annv:
                 node.clade_annotations.push_back(an.encode("UTF-8"))
         
+    @_reads
     def get_annotations(self) -> dict[str,str]:
         """
         Return a dictionary keyed on all annotations with values of the internal node they are defined by. 
@@ -1295,6 +2049,7 @@ cdef class MATree:
                     claderoots[anns[j].decode("UTF-8")] = nodes[i].identifier.decode("UTF-8")
         return claderoots
 
+    @_reads
     def dump_node_annotations(self) -> dict[str,list[str]]:
         """Return a dictionary of internal node ids with corresponding annotation root labels. 
         Formatted for compatibility with apply_node_annotations().
@@ -1316,14 +2071,25 @@ cdef class MATree:
                     claderoots[nid].append(anns[j].decode("UTF-8"))
         return claderoots
 
-    def translate(self, gtf_file: str, fasta_file: str) -> dict[str,list[AAChange]]:
+    @_reads
+    def translate(self, gtf_file: str, fasta_file: str, parallel: bool = True) -> dict[str,list[AAChange]]:
         """
         Translate amino acid changes across the tree and return the results as a dictionary of node IDs and class objects representing amino acid changes as returned from matUtils translate. 
         The translation is representative of the tree at the time of this function being called only.
+        The codon table built from the GTF and FASTA is kept with the tree and reused by later calls with the same files.
+        The translation itself is also kept, and nodes changed since the last call through apply_mutations, create_node, move_node or
+        remove_node (or their bulk versions) are retranslated alone, so translating again after a few edits takes a fraction of the first call.
+        Nodes whose translation changed are moved to the end of the returned dictionary. Other edits, including changes made directly 
+        through MATNode objects, are not tracked; loading a tree, reverse_strand and saving a condensed protobuf discard the kept translation.
+        The lists in the returned dictionary are shared with the kept translation and should not be modified.
 
         Args:
             gtf_file (str): The path to the GTF file containing gene information. 
             fasta_file (str): The path to the FASTA file containing the reference genome.
+            parallel (bool): Translate independent subtrees on multiple threads. The result is identical to the serial translation. Defaults to True.
+
+        Returns:
+            dict[str,list[AAChange]]: Dictionary mapping the ID of each node with coding mutations to the amino acid changes on its branch.
         """
         if not exists(gtf_file):
             print("ERROR: GTF file {} not found!".format(gtf_file))
@@ -1331,58 +2097,169 @@ cdef class MATree:
         if not exists(fasta_file):
             print("ERROR: FASTA file {} not found!".format(fasta_file))
             sys.exit(1)
+        cdef shared_ptr[bte.TranslationContext] context
+        cdef bte.TranslationUpdate update
+        cdef cbool use_threads = parallel
+        with self.translation_lock:
+            context = self.load_translation_context(gtf_file, fasta_file)
+            with nogil:
+                update = self.translation_cache.update(&self.t, dereference(context), use_threads)
+            orf_names = [n.decode("UTF-8") for n in dereference(context).orf_names]
+            if update.full:
+                self.translation_table = self.group_translations(update.changes, orf_names)
+            else:
+                for nid in update.removed:
+                    self.translation_table.pop(nid.decode("UTF-8"), None)
+                for i in range(update.retranslated.size()):
+                    self.translation_table.pop(update.retranslated[i].identifier.decode("UTF-8"), None)
+                self.translation_table.update(self.group_translations(update.changes, orf_names))
+            return dict(self.translation_table)
+
+    cdef shared_ptr[bte.TranslationContext] load_translation_context(self, str gtf_file, str fasta_file):
+        """Build the position-indexed codon table for the indicated annotation and reference.
+        The table does not depend on the tree, so it is kept and reused as long as the same files are requested.
+        A new table discards the kept translation. Callers must hold the translation lock, and keep their own reference to the table.
+        """
+        cdef string gtf = gtf_file.encode("UTF-8")
+        cdef string fasta = fasta_file.encode("UTF-8")
+        cdef bte.TranslationContext* context
+        if self.translation_files != (gtf_file, fasta_file):
+            with nogil:
+                context = new bte.TranslationContext(gtf, fasta)
+            self.translation_context.reset(context)
+            self.translation_files = (gtf_file, fasta_file)
+            self.translation_cache.reset()
+        return self.translation_context
+
+    cdef group_translations(self, vector[bte.CodonChange]& changes, list orf_names):
+        """Convert a vector of codon change records, grouped by node, to a dictionary of node IDs and AAChange objects.
+        """
         translation_table = {}
-        cdef vector[pair[string,string]] changes = bte.do_translation(&self.t,gtf_file.encode("UTF-8"),fasta_file.encode("UTF-8"))
+        cdef bte.Node* last = NULL
+        cdef size_t i
         for i in range(changes.size()):
-            translation_table[changes[i].first.decode("UTF-8")] = _generate_translations(changes[i].second.decode("UTF-8"))
+            if changes[i].node != last:
+                last = changes[i].node
+                node_changes = []
+                translation_table[last.identifier.decode("UTF-8")] = node_changes
+            node_changes.append(_aachange_from_record(changes[i], orf_names[changes[i].orf]))
         return translation_table
 
+    cdef bte.TraitEntropy trait_entropy_c(self, traits: dict, bte.Node* subroot, list labels):
+        """
+        Encode a dictionary of leaf trait values as category indices and run the entropy kernel on the subtree below subroot.
+        The distinct values of each trait, in the order of their indices, are appended to labels.
+        """
+        cdef vector[bte.Node*] leaves
+        cdef vector[int32_t] categories
+        cdef vector[size_t] num_categories
+        cdef bte.TraitEntropy result
+        leaves.reserve(len(traits))
+        for lid in _encode_traits(traits, labels, categories, num_categories):
+            leaves.push_back(self.fetch_node(lid))
+        with nogil:
+            result = bte.trait_entropy(&self.t, subroot, leaves, categories, num_categories)
+        return result
+
+    @_reads
+    def trait_entropy(self, traits: dict[str,list], subroot: Optional[str] = None) -> dict:
+        """Calculate the absolute and relative entropy of each split in the tree for many categorical tip traits at once, in a single pass.
+        The absolute entropy of a node is the entropy of the trait values of the leaves below it. The relative entropy is the absolute 
+        entropy minus the mean absolute entropy of its children, weighted by the number of leaves below each child.
+
+        Each leaf is assigned a list with one value per trait; all lists must be the same length. Values can be any hashable object, 
+        and None marks a missing value. Leaves which are missing from the dictionary or have missing values are not counted for that trait.
+
+        The returned dictionary contains:
+
+            identifiers (list[str]): the IDs of the nodes of the subtree, in preorder.
+
+            absolute (memoryview), relative (memoryview): float64 arrays with one row per node (in the same order) and one column per trait.
+
+            counts (memoryview): an int64 array of the number of leaves with a known value below each node, for each trait.
+
+            categories (list[list]): the distinct values of each trait.
+
+        Args:
+            traits (dict[str,list]): Dictionary mapping leaf names to a list of trait values.
+
+            subroot (Optional[str], optional): Only calculate entropy for this node and its descendents. Defaults to the root.
+
+        Returns:
+            dict: Dictionary with the node IDs and the node by trait entropy arrays.
+        """
+        cdef bte.Node* target_n = self.fetch_node(subroot)
+        if len(traits) == 0:
+            raise ValueError("At least one leaf trait assignment is required.")
+        labels = []
+        cdef bte.TraitEntropy result = self.trait_entropy_c(traits, target_n, labels)
+        if len(labels) == 0:
+            raise ValueError("At least one trait is required, but every leaf's trait list is empty.")
+        shape = (result.nodes.size(), len(labels))
+        return {
+            "identifiers": [result.nodes[i].identifier.decode("UTF-8") for i in range(result.nodes.size())],
+            "absolute": memoryview(_copy_to_array('d', result.absolute.data(), result.absolute.size())).cast('B').cast('d', shape),
+            "relative": memoryview(_copy_to_array('d', result.relative.data(), result.relative.size())).cast('B').cast('d', shape),
+            "counts": memoryview(_copy_to_array('q', result.counts.data(), result.counts.size())).cast('B').cast('q', shape),
+            "categories": labels,
+        }
+
+    @_reads
     def tree_entropy(self, categorical: dict[str,str], from_node: str = "") -> dict[str,float]:
         """
         Calculate the absolute and relative entropy of each split in the tree with respect to a categorical tip trait map. 
         If a node is specified, the entropy map of the subtree rooted at that node is returned.
         If no node is specified, the entropy map of the entire tree is returned.
+        Only nodes with nonzero absolute entropy are included. See trait_entropy for scoring many traits at once.
 
         Args:
             categorical (dict[str,str]): A dictionary of categorical trait values with the sample IDs as keys.
             from_node (str): The identifier of the node to calculate the entropy from. If not specified, the entropy map of the entire tree is returned.
         """
-        ##TODO: this implementation relies on python wrapper-level code. It could be further optimized with the use of C++ typed maps and direct access to Node* pointers.
+        cdef bte.Node* target_n = self.fetch_node(from_node)
+        traits = {}
+        for lid in self.get_leaves_ids(target_n.identifier.decode("UTF-8")):
+            if lid not in categorical:
+                raise KeyError("Categorical trait value not found for sample ID: " + lid)
+            traits[lid] = [categorical[lid]]
+        labels = []
+        cdef bte.TraitEntropy result = self.trait_entropy_c(traits, target_n, labels)
         node_entropy_map = {}
-        nvcd = {}
-        sample_count_map = {}
-        total_samples = 0
-        nodes = self.depth_first_expansion(from_node)
-        for n in nodes[::-1]:
-            if n.is_leaf():
-                catval = categorical.get(n.id,None)
-                if catval == None:
-                    raise KeyError("Categorical trait value not found for sample ID: " + n.id)
-                nvcd[n.id] = {catval:1}
-                sample_count_map[n.id] = 1
-                total_samples += 1
-            else:
-                freq_map = {}
-                total = 0
-                for c in n.children:
-                    childd = nvcd[c.id]            
-                    for catval, count in childd.items():
-                        total += count
-                        if catval not in freq_map:
-                            freq_map[catval] = count
-                        else:
-                            freq_map[catval] += count
-                nvcd[n.id] = freq_map
-                ev = entropy([v/total for v in freq_map.values()])
-                if ev > 0:
-                    rel_ev = ev - sum([node_entropy_map.get(c.id,(0,0))[0]*sample_count_map[c.id]/total_samples for c in n.children])
-                    node_entropy_map[n.id] = (ev, rel_ev)
-                sample_count_map[n.id] = total
+        for i in range(result.nodes.size()):
+            if result.absolute[i] > 0:
+                node_entropy_map[result.nodes[i].identifier.decode("UTF-8")] = (result.absolute[i], result.relative[i])
         return node_entropy_map
 
+    cdef bte.LCAIndex* get_lca_index(self) except NULL:
+        cdef bte.LCAIndex* index
+        with nogil:
+            index = self.lock.lazy_index[bte.LCAIndex](self.lca_index, &self.t)
+        return index
+
+    @_writes
+    def build_lca_index(self) -> None:
+        """Build an index of the tree for constant time last common ancestor and distance queries. 
+        The index is built automatically by lca_batch, node_distances, distance_matrix and nearest_neighbors and reused until the tree is changed by create_node, move_node, 
+        remove_node, apply_mutations or loading a new tree, at which point it is discarded. Once built, it is also used by LCA.
+        Changes made directly through MATNode objects (e.g. update_mutations or set_branch_length) are not tracked; call this function again 
+        afterwards to refresh distances.
+        """
+        cdef bte.LCAIndex* index
+        with nogil:
+            index = new bte.LCAIndex(&self.t)
+        self.lca_index.reset(index)
+
+    cdef vector[bte.Node*] fetch_nodes(self, node_ids):
+        cdef vector[bte.Node*] nodes
+        nodes.reserve(len(node_ids))
+        for nid in node_ids:
+            nodes.push_back(self.fetch_node(nid))
+        return nodes
+
+    @_reads
     def LCA(self, node_ids: list) -> str:
         '''
-        Find the last common ancestor of the input node IDs.
+        Find the last common ancestor of the input node IDs. Uses the index from build_lca_index if one is available.
 
         Args:
             node_ids list[str]: A set of node_ids in string format. Must have a length of at least 2.
@@ -1391,6 +2268,22 @@ cdef class MATree:
         '''
         if len(node_ids) < 2:
             raise ValueError("LCA requires a list with at two node IDs.")
+        cdef vector[bte.Node*] group
+        cdef bte.Node* node
+        cdef bte.LCAIndex* index
+        #another thread may hold the index mutex for a whole index build, so wait for it without the GIL.
+        with nogil:
+            index = self.lock.current_index[bte.LCAIndex](self.lca_index)
+        if index != NULL:
+            for nid in node_ids:
+                node = self.t.get_node(nid.encode("UTF-8"))
+                if node == NULL:
+                    print(f"WARNING: node {nid} not found in the tree! Ignoring for LCA calculations")
+                    continue
+                group.push_back(node)
+            if group.size() == 0:
+                raise ValueError("ERROR: no valid LCA! Check that input nodes are found on the tree.")
+            return index.group_lca(group).identifier.decode("UTF-8")
         possible_lcas_order = [anc.id for anc in self.rsearch(node_ids[0])]
         possible_lcas = set(possible_lcas_order)
         for nid in node_ids[1:]:
@@ -1407,4 +2300,449 @@ cdef class MATree:
         #otherwise, return the element of possible_lcas that's earliest in the order.
         for pl in possible_lcas_order:
             if pl in possible_lcas:
-                return pl
\ No newline at end of file
+                return pl
+
+    @_reads
+    def lca_batch(self, queries: list[list[str]]) -> list[str]:
+        """Find the last common ancestor of many groups of nodes at once, using the index from build_lca_index (built if necessary).
+        Each query takes constant time after the index is built.
+
+        Args:
+            queries (list[list[str]]): A list of groups of node IDs, such as pairs. A group with a single node returns that node.
+
+        Returns:
+            list[str]: The node ID of the last common ancestor of each group, in the same order.
+        """
+        cdef bte.LCAIndex* index = self.get_lca_index()
+        cdef vector[vector[bte.Node*]] groups
+        cdef vector[bte.Node*] lcas
+        groups.reserve(len(queries))
+        for query in queries:
+            groups.push_back(self.fetch_nodes(query))
+        with nogil:
+            lcas = index.group_lcas(groups)
+        return [lcas[i].identifier.decode("UTF-8") for i in range(lcas.size())]
+
+    @_reads
+    def node_distances(self, pairs: list[tuple[str,str]]) -> dict:
+        """Compute the last common ancestor and the distance between each of many pairs of nodes, using the index from build_lca_index 
+        (built if necessary). Large batches are processed in parallel.
+
+        The returned dictionary contains:
+
+            lca (list[str]): the last common ancestor of each pair.
+
+            branch_length (array.array): the patristic distance of each pair, as the sum of branch lengths on the path between them (float64).
+
+            mutations (array.array): the number of mutations on the path between each pair (int64).
+
+        Args:
+            pairs (list[tuple[str,str]]): A list of pairs of node IDs.
+
+        Returns:
+            dict: Dictionary with the last common ancestors and distances of each pair, in the same order.
+        """
+        cdef bte.LCAIndex* index = self.get_lca_index()
+        cdef vector[bte.Node*] first
+        cdef vector[bte.Node*] second
+        cdef vector[bte.NodeDistance] distances
+        cdef vector[double] branch_length
+        cdef vector[int64_t] mutations
+        first.reserve(len(pairs))
+        second.reserve(len(pairs))
+        for a, b in pairs:
+            first.push_back(self.fetch_node(a))
+            second.push_back(self.fetch_node(b))
+        with nogil:
+            distances = index.distances(first, second)
+        branch_length.reserve(distances.size())
+        mutations.reserve(distances.size())
+        for i in range(distances.size()):
+            branch_length.push_back(distances[i].branch_length)
+            mutations.push_back(distances[i].mutations)
+        return {
+            "lca": [distances[i].lca.identifier.decode("UTF-8") for i in range(distances.size())],
+            "branch_length": _copy_to_array('d', branch_length.data(), branch_length.size()),
+            "mutations": _copy_to_array('q', mutations.data(), mutations.size()),
+        }
+
+    @_reads
+    def distance_matrix(self, samples: list[str], metric: str = "mutations", threshold: Optional[float] = None) -> Union[memoryview,dict]:
+        """Compute the distance between every pair of the indicated samples from the path between them through their last common ancestor, 
+        using the index from build_lca_index (built if necessary). Rows are computed in parallel.
+
+        By default, returns a dense square matrix whose rows and columns follow the order of the input. For large sets of samples, pass a 
+        threshold to return only the pairs at most that far apart, as a dictionary containing:
+
+            row (array.array): the index in the input of the first sample of each pair (uint32).
+
+            col (array.array): the index in the input of the second sample of each pair, always greater than row (uint32).
+
+            mutations (array.array): the number of mutations on the path between the pair (int32).
+
+            branch_length (array.array): the sum of branch lengths on the path between the pair (float64).
+
+        Pairs are sorted by row, then column.
+
+        Args:
+            samples (list[str]): The node IDs to compare, usually leaves.
+
+            metric (str, optional): "mutations" to count mutations on the path, or "branch_length" to sum branch lengths. Defaults to "mutations".
+
+            threshold (Optional[float], optional): If given, return the sparse set of pairs within this distance instead of the dense matrix. Defaults to None.
+
+        Returns:
+            Union[memoryview,dict]: A (samples x samples) matrix of int32 mutation counts or float64 branch lengths, or the pairs within the threshold.
+        """
+        if metric not in ("mutations", "branch_length"):
+            raise ValueError("Metric must be either 'mutations' or 'branch_length'.")
+        cdef bte.LCAIndex* index = self.get_lca_index()
+        cdef vector[bte.Node*] nodes = self.fetch_nodes(samples)
+        cdef cbool by_branch_length = metric == "branch_length"
+        cdef size_t n = nodes.size()
+        cdef vector[int32_t] mutation_matrix
+        cdef vector[double] branch_length_matrix
+        cdef bte.DistancePairs pairs
+        cdef double max_distance
+        if threshold is not None:
+            max_distance = threshold
+            with nogil:
+                pairs = index.pairs_within(nodes, max_distance, by_branch_length)
+            return {
+                "row": _copy_to_array('I', pairs.row.data(), pairs.row.size()),
+                "col": _copy_to_array('I', pairs.col.data(), pairs.col.size()),
+                "mutations": _copy_to_array('i', pairs.mutations.data(), pairs.mutations.size()),
+                "branch_length": _copy_to_array('d', pairs.branch_length.data(), pairs.branch_length.size()),
+            }
+        if by_branch_length:
+            with nogil:
+                branch_length_matrix = index.branch_length_matrix(nodes)
+            return memoryview(_copy_to_array('d', branch_length_matrix.data(), branch_length_matrix.size())).cast('B').cast('d', (n, n))
+        with nogil:
+            mutation_matrix = index.mutation_matrix(nodes)
+        return memoryview(_copy_to_array('i', mutation_matrix.data(), mutation_matrix.size())).cast('B').cast('i', (n, n))
+
+    @_reads
+    def nearest_neighbors(self, nids: list[str], k: int = 1, max_mutations: Optional[int] = None) -> dict[str,list[tuple[str,int]]]:
+        """Find the k leaves with the fewest mutations on the path to each of the indicated nodes, such as the nearest sequenced relatives 
+        of a set of samples. The search proceeds outward from each node and stops once k leaves have been found, so it does not scan the tree. 
+        Queries are processed in parallel.
+
+        Args:
+            nids (list[str]): The node IDs to find neighbors of. A node is not counted as its own neighbor.
+
+            k (int, optional): The number of leaves to return for each node. Defaults to 1.
+
+            max_mutations (Optional[int], optional): Only return leaves at most this many mutations away. Defaults to no limit.
+
+        Returns:
+            dict[str,list[tuple[str,int]]]: Dictionary mapping each node ID to its nearest leaves and their distance in mutations, nearest first. 
+            Leaves at the same distance are ordered as in a depth-first expansion.
+        """
+        if k < 0:
+            raise ValueError("The number of neighbors must not be negative.")
+        cdef bte.LCAIndex* index = self.get_lca_index()
+        cdef vector[bte.Node*] queries = self.fetch_nodes(nids)
+        cdef size_t num_neighbors = k
+        cdef int64_t limit = -1 if max_mutations is None else max_mutations
+        cdef bte.Neighbors neighbors
+        with nogil:
+            neighbors = index.nearest_leaves(queries, num_neighbors, limit)
+        result = {}
+        cdef size_t i, j
+        for i in range(queries.size()):
+            result[nids[i]] = [(neighbors.nodes[j].identifier.decode("UTF-8"), neighbors.mutations[j]) for j in range(neighbors.offsets[i], neighbors.offsets[i+1])]
+        return result
+
+    @_reads
+    def freeze(self) -> FrozenMATree:
+        """Build a compact, read-only copy of the tree for analyses of very large trees. Nodes are stored contiguously in preorder,
+        chromosomes and clade annotations are interned and mutations are packed, so the copy takes several times less memory than 
+        the tree and is faster to traverse. The copy does not follow later changes to the tree; call freeze again after editing it.
+
+        Returns:
+            FrozenMATree: the read-only copy of the tree.
+        """
+        cdef FrozenMATree frozen = FrozenMATree.__new__(FrozenMATree)
+        cdef bte.FrozenTree* view
+        with nogil:
+            view = new bte.FrozenTree(&self.t)
+        frozen.f.reset(view)
+        frozen._tree_only = self._tree_only
+        return frozen
+
+cdef class FrozenMATree:
+    """
+    A compact, read-only view of a MATree, created with MATree.freeze. Supports the traversal, haplotype, counting and entropy 
+    functions of MATree, with nodes referred to by their IDs. It holds its own copy of the tree and remains valid after the
+    MATree it was built from is changed or deleted.
+    """
+    cdef shared_ptr[bte.FrozenTree] f
+    cdef public cbool _tree_only
+
+    def __init__(self, tree: MATree) -> None:
+        """Instantiate a FrozenMATree from a MATree; equivalent to tree.freeze().
+
+        Args:
+            tree (MATree): the tree to copy.
+        """
+        cdef FrozenMATree frozen = tree.freeze()
+        self.f = frozen.f
+        self._tree_only = frozen._tree_only
+
+    def __len__(self):
+        return self.f.get().size()
+
+    def __repr__(self):
+        return "FrozenMATree object with " + str(self.f.get().count_leaves(0)) + " leaves."
+
+    cdef size_t fetch_index(self, nid) except? 0:
+        """Return the preorder index of the node with the indicated identifier, or of the root if no identifier is given.
+        Raises a ValueError if the node is not found.
+        """
+        if nid == None or nid == "":
+            return 0
+        cdef int64_t i = self.f.get().find(nid.encode("UTF-8"))
+        if i < 0:
+            raise ValueError("Node " + nid + " not found in the tree.")
+        return i
+
+    cdef list identifiers(self, vector[uint32_t]& nodes):
+        cdef bte.FrozenTree* view = self.f.get()
+        return [view.identifier(nodes[i]).decode("UTF-8") for i in range(nodes.size())]
+
+    cdef set haplotype_set(self, vector[bte.PackedMutation]& haplotype):
+        cdef bte.FrozenTree* view = self.f.get()
+        return set([view.unpack(haplotype[j]).get_string().decode("UTF-8") for j in range(haplotype.size())])
+
+    def memory_usage(self) -> int:
+        """Return the number of bytes allocated by the frozen tree.
+
+        Returns:
+            int: the size of the frozen tree in bytes.
+        """
+        return self.f.get().memory_usage()
+
+    def depth_first_expansion(self, nid: Optional[str] = None) -> list[str]:
+        """Return the IDs of the nodes of the tree, or of the subtree below the indicated node, in depth-first (pre)order.
+
+        Args:
+            nid (Optional[str], optional): The root of the subtree to traverse. Defaults to the root.
+
+        Returns:
+            list[str]: the node IDs in depth-first order.
+        """
+        cdef size_t subroot = self.fetch_index(nid)
+        cdef bte.FrozenTree* view = self.f.get()
+        return [view.identifier(i).decode("UTF-8") for i in range(subroot, view.subtree_end[subroot])]
+
+    def breadth_first_expansion(self, nid: Optional[str] = None) -> list[str]:
+        """Return the IDs of the nodes of the tree, or of the subtree below the indicated node, in breadth-first order.
+
+        Args:
+            nid (Optional[str], optional): The root of the subtree to traverse. Defaults to the root.
+
+        Returns:
+            list[str]: the node IDs in breadth-first order.
+        """
+        cdef size_t subroot = self.fetch_index(nid)
+        cdef vector[uint32_t] nodes
+        with nogil:
+            nodes = self.f.get().breadth_first(subroot)
+        return self.identifiers(nodes)
+
+    def get_parent(self, nid: str) -> Optional[str]:
+        """Return the ID of the parent of the indicated node, or None for the root.
+
+        Args:
+            nid (str): The node to get the parent of.
+
+        Returns:
+            Optional[str]: the ID of the parent.
+        """
+        cdef int32_t p = self.f.get().parent[self.fetch_index(nid)]
+        if p < 0:
+            return None
+        return self.f.get().identifier(p).decode("UTF-8")
+
+    def get_leaves_ids(self, nid: str = "") -> list[str]:
+        """Return the IDs of the leaves below the indicated node, in depth-first order. By default, returns all leaves on the tree.
+
+        Args:
+            nid (str, optional): The root of the subtree. Defaults to the root.
+
+        Returns:
+            list[str]: the leaf IDs.
+        """
+        cdef size_t subroot = self.fetch_index(nid)
+        cdef vector[uint32_t] nodes
+        with nogil:
+            nodes = self.f.get().leaves(subroot)
+        return self.identifiers(nodes)
+
+    def count_leaves(self, subroot: Optional[str] = None) -> int:
+        """Return the number of leaves descended from the indicated node. By default, counts all leaves on the tree.
+
+        Args:
+            subroot (Optional[str], optional): Count leaves descended from the indicated node. Defaults to the root.
+
+        Returns:
+            int: The count of leaves.
+        """
+        return self.f.get().count_leaves(self.fetch_index(subroot))
+
+    @MATree._check_newick_only
+    def get_haplotype(self, nid: str) -> set[str]:
+        """Return the complete set of mutations (haplotype) the indicated node has with respect to the reference. 
+
+        Args:
+            nid (str): The target node to get the haplotype for.
+
+        Returns:
+            set[str]: the haplotype of the node, represented as a set of mutations formatted in reflocalt (e.g. A123G) format.
+        """
+        cdef vector[bte.PackedMutation] haplotype = self.f.get().haplotype(self.fetch_index(nid))
+        return self.haplotype_set(haplotype)
+
+    @MATree._check_newick_only
+    def get_haplotypes(self, nids: list[str]) -> dict[str,set[str]]:
+        """Return the haplotypes of many nodes at once, computed in parallel.
+
+        Args:
+            nids (list[str]): The target nodes to get haplotypes for.
+
+        Returns:
+            dict[str,set[str]]: Dictionary mapping each node to its haplotype, represented as a set of mutations formatted in reflocalt (e.g. A123G) format.
+        """
+        cdef vector[uint32_t] nodes
+        cdef vector[vector[bte.PackedMutation]] haplotypes
+        nodes.reserve(len(nids))
+        for nid in nids:
+            nodes.push_back(self.fetch_index(nid))
+        with nogil:
+            haplotypes = self.f.get().haplotypes(nodes)
+        return {nids[i]:self.haplotype_set(haplotypes[i]) for i in range(haplotypes.size())}
+
+    @MATree._check_newick_only
+    def count_haplotypes(self, subroot: Optional[str] = None) -> dict[tuple,int]:
+        """Count unique haplotypes among the leaves of the tree, or of the subtree below the indicated node. 
+        The result is the same as MATree.count_haplotypes.
+
+        Args:
+            subroot (Optional[str], optional): Count haplotypes of leaves descended from the indicated node. Defaults to the root.
+
+        Returns:
+            dict[tuple,int]: haplotype counts.
+        """
+        cdef size_t target = self.fetch_index(subroot)
+        cdef bte.FrozenTree* view = self.f.get()
+        cdef vector[pair[vector[bte.PackedMutation],size_t]] hvec
+        cdef size_t i, j
+        with nogil:
+            hvec = view.count_haplotypes(target)
+        pymap = {}
+        for i in range(hvec.size()):
+            pymap[tuple([view.unpack(hvec[i].first[j]).get_string() for j in range(hvec[i].first.size())])] = hvec[i].second
+        return pymap
+
+    @MATree._check_newick_only
+    def count_mutation_types(self, subroot: Optional[str] = None) -> dict[str,int]:
+        """Compute the counts of individual mutation types across the tree, or among mutations descended from the indicated node.
+
+        Args:
+            subroot (Optional[str], optional): Count mutations descended from the indicated node. Defaults to the root.
+
+        Returns:
+            dict[str,int]: Dictionary containing mutation counts.
+        """
+        cdef size_t target = self.fetch_index(subroot)
+        cdef vector[int64_t] spectrum
+        with nogil:
+            spectrum = self.f.get().mutation_spectrum(target)
+        mcount = {}
+        for i in range(spectrum.size()):
+            if spectrum[i] > 0:
+                mcount[chr(bte.get_nuc(i // 16)) + ">" + chr(bte.get_nuc(i % 16))] = spectrum[i]
+        return mcount
+
+    def get_annotations(self) -> dict[str,str]:
+        """
+        Return a dictionary keyed on all annotations with values of the internal node they are defined by. 
+
+        Returns:
+            dict[str,str]: A dictionary of annotations with the root node they are associated with.
+        """
+        cdef bte.FrozenTree* view = self.f.get()
+        claderoots = {}
+        for i in range(view.annotations.size()):
+            claderoots[view.clades[view.annotations[i].clade].decode("UTF-8")] = view.identifier(view.annotations[i].node).decode("UTF-8")
+        return claderoots
+
+    cdef bte.TraitEntropy trait_entropy_c(self, traits: dict, size_t subroot, list labels):
+        """
+        Encode a dictionary of leaf trait values as category indices and run the entropy kernel on the subtree below subroot.
+        The distinct values of each trait, in the order of their indices, are appended to labels.
+        """
+        cdef vector[uint32_t] leaves
+        cdef vector[int32_t] categories
+        cdef vector[size_t] num_categories
+        cdef bte.TraitEntropy result
+        leaves.reserve(len(traits))
+        for lid in _encode_traits(traits, labels, categories, num_categories):
+            leaves.push_back(self.fetch_index(lid))
+        with nogil:
+            result = self.f.get().trait_entropy(subroot, leaves, categories, num_categories)
+        return result
+
+    def trait_entropy(self, traits: dict[str,list], subroot: Optional[str] = None) -> dict:
+        """Calculate the absolute and relative entropy of each split in the tree for many categorical tip traits at once.
+        Takes the same arguments and returns the same dictionary as MATree.trait_entropy.
+
+        Args:
+            traits (dict[str,list]): Dictionary mapping leaf names to a list of trait values.
+
+            subroot (Optional[str], optional): Only calculate entropy for this node and its descendents. Defaults to the root.
+
+        Returns:
+            dict: Dictionary with the node IDs and the node by trait entropy arrays.
+        """
+        cdef size_t target = self.fetch_index(subroot)
+        if len(traits) == 0:
+            raise ValueError("At least one leaf trait assignment is required.")
+        labels = []
+        cdef bte.TraitEntropy result = self.trait_entropy_c(traits, target, labels)
+        if len(labels) == 0:
+            raise ValueError("At least one trait is required, but every leaf's trait list is empty.")
+        identifiers = self.depth_first_expansion(subroot)
+        shape = (len(identifiers), len(labels))
+        return {
+            "identifiers": identifiers,
+            "absolute": memoryview(_copy_to_array('d', result.absolute.data(), result.absolute.size())).cast('B').cast('d', shape),
+            "relative": memoryview(_copy_to_array('d', result.relative.data(), result.relative.size())).cast('B').cast('d', shape),
+            "counts": memoryview(_copy_to_array('q', result.counts.data(), result.counts.size())).cast('B').cast('q', shape),
+            "categories": labels,
+        }
+
+    def tree_entropy(self, categorical: dict[str,str], from_node: str = "") -> dict[str,float]:
+        """
+        Calculate the absolute and relative entropy of each split in the tree with respect to a categorical tip trait map,
+        as MATree.tree_entropy does. Only nodes with nonzero absolute entropy are included.
+
+        Args:
+            categorical (dict[str,str]): A dictionary of categorical trait values with the sample IDs as keys.
+            from_node (str): The identifier of the node to calculate the entropy from. If not specified, the entropy map of the entire tree is returned.
+        """
+        cdef size_t target = self.fetch_index(from_node)
+        traits = {}
+        for lid in self.get_leaves_ids(from_node):
+            if lid not in categorical:
+                raise KeyError("Categorical trait value not found for sample ID: " + lid)
+            traits[lid] = [categorical[lid]]
+        labels = []
+        cdef bte.TraitEntropy result = self.trait_entropy_c(traits, target, labels)
+        cdef bte.FrozenTree* view = self.f.get()
+        node_entropy_map = {}
+        for i in range(result.absolute.size()):
+            if result.absolute[i] > 0:
+                node_entropy_map[view.identifier(target + i).decode("UTF-8")] = (result.absolute[i], result.relative[i])
+        return node_entropy_map
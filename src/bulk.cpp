@@ -0,0 +1,346 @@
+/*bulk updates of a tree: replacing the mutations of many nodes and creating many nodes at once, from arrays, strings or text files.
+Input is collected into a NodeBatch, one row per node. Rows are parsed and checked in parallel, and a row with a problem is skipped and
+reported rather than stopping the whole batch, so a large set of placements can be loaded in one call and its failures reviewed
+afterwards. Node creation itself is serial, since it changes the tree structure, but new nodes may be listed before their parents.*/
+#pragma once
+#include "usher/src/usher_graph.hpp"
+#include "pbio.cpp"
+#include <cmath>
+#include <string_view>
+#include <tbb/parallel_for.h>
+
+static const char* DEFAULT_CHROMOSOME = "NC_045512v2";
+
+struct BulkError {
+    std::string identifier;
+    std::string message;
+};
+
+struct NodeBatch {
+    std::vector<std::string> identifiers;
+    // the mutations of row i are mutations[offsets[i]] up to mutations[offsets[i+1]]
+    std::vector<uint64_t> offsets;
+    std::vector<MAT::Mutation> mutations;
+    // only used when creating nodes; a NaN branch length is replaced by the number of mutations of the node
+    std::vector<std::string> parents;
+    std::vector<float> branch_length;
+    // the problem with each row, or an empty string for rows which can be applied
+    std::vector<std::string> errors;
+};
+
+inline bool valid_nucleotide(char c) {
+    return MAT::get_nuc_id(c) != 0b1111 || c == 'N' || c == 'n' || c == '-';
+}
+
+// Parse a mutation formatted as chro:reflocalt (e.g. chr1:A234G). Without a chromosome, the SARS-CoV-2 chromosome is assumed.
+// The reference allele is taken to be the parent allele. Returns an empty string on success, or a description of the problem.
+std::string parse_mutation(std::string_view text, MAT::Mutation &m) {
+    size_t colon = text.rfind(':');
+    std::string_view info = (colon == std::string_view::npos) ? text : text.substr(colon + 1);
+    if (info.size() < 3 || !valid_nucleotide(info.front()) || !valid_nucleotide(info.back())) {
+        return "Invalid mutation " + std::string(text) + "; expected the format chro:reflocalt (e.g. chr1:A234G).";
+    }
+    int64_t position = 0;
+    for (size_t k = 1; k + 1 < info.size(); k++) {
+        if (info[k] < '0' || info[k] > '9' || position > INT32_MAX) {
+            return "Invalid position in mutation " + std::string(text) + ".";
+        }
+        position = position * 10 + (info[k] - '0');
+    }
+    if (position <= 0 || position > INT32_MAX) {
+        return "Invalid position in mutation " + std::string(text) + ".";
+    }
+    m.chrom = (colon == std::string_view::npos) ? std::string(DEFAULT_CHROMOSOME) : std::string(text.substr(0, colon));
+    m.position = position;
+    m.par_nuc = MAT::get_nuc_id(info.front());
+    m.mut_nuc = MAT::get_nuc_id(info.back());
+    m.ref_nuc = m.par_nuc;
+    m.is_missing = false;
+    return "";
+}
+
+// Parse mutation strings, listed for each row between offsets[i] and offsets[i+1], into the mutations of the batch.
+void parse_batch_mutations(NodeBatch &batch, const std::vector<std::string> &strings) {
+    size_t n = batch.identifiers.size();
+    if (batch.offsets.size() != n + 1 || batch.offsets[n] != strings.size()) {
+        throw std::invalid_argument("Mutation offsets do not match the number of nodes and mutations.");
+    }
+    batch.mutations.resize(strings.size());
+    batch.errors.resize(n);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n), [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t i = r.begin(); i < r.end(); i++) {
+            for (size_t k = batch.offsets[i]; k < batch.offsets[i + 1] && batch.errors[i].empty(); k++) {
+                batch.errors[i] = parse_mutation(strings[k], batch.mutations[k]);
+            }
+        }
+    });
+}
+
+// Rows of node identifiers and mutation strings.
+NodeBatch node_batch_from_strings(const std::vector<std::string> &identifiers, const std::vector<uint64_t> &offsets, const std::vector<std::string> &strings) {
+    NodeBatch batch;
+    batch.identifiers = identifiers;
+    batch.offsets = offsets;
+    parse_batch_mutations(batch, strings);
+    return batch;
+}
+
+// Rows of node identifiers and mutations in the layout of get_tree_arrays: nucleotides as ASCII codes, and chromosomes as indices
+// into chromosomes. Without chromosome indices, the SARS-CoV-2 chromosome is assumed.
+NodeBatch node_batch_from_arrays(const std::vector<std::string> &identifiers, const std::vector<uint64_t> &offsets, const std::vector<int32_t> &position, const std::vector<uint8_t> &par_nuc, const std::vector<uint8_t> &mut_nuc, const std::vector<int16_t> &chrom, const std::vector<std::string> &chromosomes) {
+    NodeBatch batch;
+    size_t n = identifiers.size();
+    size_t total = position.size();
+    if (offsets.size() != n + 1 || offsets[n] != total || par_nuc.size() != total || mut_nuc.size() != total || (!chrom.empty() && chrom.size() != total)) {
+        throw std::invalid_argument("Mutation arrays do not match the number of nodes and mutations.");
+    }
+    batch.identifiers = identifiers;
+    batch.offsets = offsets;
+    batch.mutations.resize(total);
+    batch.errors.resize(n);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n), [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t i = r.begin(); i < r.end(); i++) {
+            for (size_t k = offsets[i]; k < offsets[i + 1] && batch.errors[i].empty(); k++) {
+                MAT::Mutation &m = batch.mutations[k];
+                if (position[k] <= 0 || !valid_nucleotide(par_nuc[k]) || !valid_nucleotide(mut_nuc[k])) {
+                    batch.errors[i] = "Invalid position or nucleotide in mutation " + std::to_string(k - offsets[i]) + " of the node.";
+                } else if (!chrom.empty() && (chrom[k] < 0 || (size_t)chrom[k] >= chromosomes.size())) {
+                    batch.errors[i] = "Invalid chromosome index in mutation " + std::to_string(k - offsets[i]) + " of the node.";
+                } else {
+                    m.chrom = chrom.empty() ? std::string(DEFAULT_CHROMOSOME) : chromosomes[chrom[k]];
+                    m.position = position[k];
+                    m.par_nuc = MAT::get_nuc_id(par_nuc[k]);
+                    m.mut_nuc = MAT::get_nuc_id(mut_nuc[k]);
+                    m.ref_nuc = m.par_nuc;
+                    m.is_missing = false;
+                }
+            }
+        }
+    });
+    return batch;
+}
+
+// Read a tab-separated text file, optionally gzipped, into a batch. Each line holds a node identifier, then when with_parents is set
+// the parent identifier and an optional branch length, then an optional comma-separated list of mutations. Empty lines and lines
+// starting with # are skipped.
+NodeBatch read_node_batch(const std::string &filename, bool with_parents) {
+    std::string contents = pbio::read_file(filename);
+    if (pbio::is_gzip(contents)) {
+        contents = pbio::decompress(contents);
+    }
+    std::vector<std::string_view> lines;
+    std::vector<size_t> line_numbers;
+    std::string_view text(contents);
+    size_t start = 0;
+    for (size_t number = 1; start < text.size(); number++) {
+        size_t stop = text.find('\n', start);
+        if (stop == std::string_view::npos) {
+            stop = text.size();
+        }
+        std::string_view line = text.substr(start, stop - start);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (!line.empty() && line[0] != '#') {
+            lines.push_back(line);
+            line_numbers.push_back(number);
+        }
+        start = stop + 1;
+    }
+    size_t n = lines.size();
+    NodeBatch batch;
+    batch.identifiers.resize(n);
+    batch.errors.resize(n);
+    if (with_parents) {
+        batch.parents.resize(n);
+        batch.branch_length.assign(n, NAN);
+    }
+    // split each line into its fields, and its mutation list into views, before the mutations are counted and parsed
+    std::vector<std::vector<std::string_view>> mutation_text(n);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n), [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t i = r.begin(); i < r.end(); i++) {
+            std::vector<std::string_view> fields;
+            std::string_view rest = lines[i];
+            while (true) {
+                size_t tab = rest.find('\t');
+                fields.push_back(rest.substr(0, tab));
+                if (tab == std::string_view::npos) {
+                    break;
+                }
+                rest = rest.substr(tab + 1);
+            }
+            batch.identifiers[i] = std::string(fields[0]);
+            size_t mutation_field = 1;
+            std::string &error = batch.errors[i];
+            if (with_parents) {
+                mutation_field = 3;
+                if (fields.size() < 2 || fields[1].empty()) {
+                    error = "line " + std::to_string(line_numbers[i]) + ": missing parent identifier.";
+                    continue;
+                }
+                batch.parents[i] = std::string(fields[1]);
+                if (fields.size() > 2 && !fields[2].empty()) {
+                    std::string value(fields[2]);
+                    char* end = NULL;
+                    batch.branch_length[i] = std::strtof(value.c_str(), &end);
+                    if (end != value.c_str() + value.size()) {
+                        error = "line " + std::to_string(line_numbers[i]) + ": invalid branch length " + value + ".";
+                        continue;
+                    }
+                }
+            }
+            if (fields[0].empty() || fields.size() > mutation_field + 1) {
+                error = "line " + std::to_string(line_numbers[i]) + ": expected " + (with_parents ? "node, parent, branch length and mutations" : "node and mutations") + " separated by tabs.";
+                continue;
+            }
+            if (fields.size() > mutation_field && !fields[mutation_field].empty()) {
+                std::string_view list = fields[mutation_field];
+                while (true) {
+                    size_t comma = list.find(',');
+                    mutation_text[i].push_back(list.substr(0, comma));
+                    if (comma == std::string_view::npos) {
+                        break;
+                    }
+                    list = list.substr(comma + 1);
+                }
+            }
+        }
+    });
+    batch.offsets.resize(n + 1);
+    batch.offsets[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        batch.offsets[i + 1] = batch.offsets[i] + mutation_text[i].size();
+    }
+    batch.mutations.resize(batch.offsets[n]);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n), [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t i = r.begin(); i < r.end(); i++) {
+            for (size_t k = 0; k < mutation_text[i].size() && batch.errors[i].empty(); k++) {
+                std::string error = parse_mutation(mutation_text[i][k], batch.mutations[batch.offsets[i] + k]);
+                if (!error.empty()) {
+                    batch.errors[i] = "line " + std::to_string(line_numbers[i]) + ": " + error;
+                }
+            }
+        }
+    });
+    return batch;
+}
+
+// Replace the mutations of nodes from rows which passed all checks, in parallel. Returns the problem with each rejected row, in row order.
+std::vector<BulkError> assign_batch_mutations(NodeBatch &batch, const std::vector<MAT::Node*> &nodes, bool update_branch_length, bool created) {
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, nodes.size()), [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t i = r.begin(); i < r.end(); i++) {
+            MAT::Node* node = nodes[i];
+            if (node == NULL) {
+                continue;
+            }
+            size_t count = batch.offsets[i + 1] - batch.offsets[i];
+            node->mutations.assign(std::make_move_iterator(batch.mutations.begin() + batch.offsets[i]), std::make_move_iterator(batch.mutations.begin() + batch.offsets[i + 1]));
+            if (created) {
+                node->branch_length = std::isnan(batch.branch_length[i]) ? (float)count : batch.branch_length[i];
+            } else if (update_branch_length) {
+                node->branch_length = count;
+            }
+        }
+    });
+    std::vector<BulkError> errors;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!batch.errors[i].empty()) {
+            errors.push_back({batch.identifiers[i], batch.errors[i]});
+        }
+    }
+    return errors;
+}
+
+// Replace the mutations of each node in the batch. Rows naming a node which is not in the tree, or named by an earlier row, are rejected.
+std::vector<BulkError> apply_node_batch(MAT::Tree* T, NodeBatch &batch, bool update_branch_length) {
+    size_t n = batch.identifiers.size();
+    std::vector<MAT::Node*> nodes(n, NULL);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n), [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t i = r.begin(); i < r.end(); i++) {
+            if (!batch.errors[i].empty()) {
+                continue;
+            }
+            nodes[i] = T->get_node(batch.identifiers[i]);
+            if (nodes[i] == NULL) {
+                batch.errors[i] = "Node " + batch.identifiers[i] + " not found in the tree.";
+            }
+        }
+    });
+    // rows sorted by node, so that repeats of a node follow its first row
+    std::vector<std::pair<MAT::Node*, size_t>> order;
+    order.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        if (nodes[i] != NULL) {
+            order.emplace_back(nodes[i], i);
+        }
+    }
+    std::sort(order.begin(), order.end());
+    for (size_t k = 1; k < order.size(); k++) {
+        if (order[k].first == order[k - 1].first) {
+            size_t i = order[k].second;
+            nodes[i] = NULL;
+            batch.errors[i] = "Node " + batch.identifiers[i] + " is listed more than once.";
+        }
+    }
+    return assign_batch_mutations(batch, nodes, update_branch_length, false);
+}
+
+// Create a node for each row of the batch below its parent, which is either already in the tree or created by another row.
+// Rows whose identifier is already taken, or whose parent cannot be found, are rejected along with the rows below them.
+std::vector<BulkError> create_node_batch(MAT::Tree* T, NodeBatch &batch) {
+    size_t n = batch.identifiers.size();
+    if (batch.parents.size() != n || batch.branch_length.size() != n) {
+        throw std::invalid_argument("Node creation requires a parent and a branch length for every node.");
+    }
+    std::unordered_map<std::string, size_t> rows;
+    for (size_t i = 0; i < n; i++) {
+        if (!batch.errors[i].empty()) {
+            continue;
+        }
+        if (batch.identifiers[i].empty()) {
+            batch.errors[i] = "Node identifiers cannot be empty.";
+        } else if (T->get_node(batch.identifiers[i]) != NULL) {
+            batch.errors[i] = "Node " + batch.identifiers[i] + " already exists in the tree.";
+        } else if (!rows.emplace(batch.identifiers[i], i).second) {
+            batch.errors[i] = "Node " + batch.identifiers[i] + " is listed more than once.";
+        }
+    }
+    // rows waiting for a parent created by another row, so that parents can be listed after their children
+    std::unordered_map<std::string, std::vector<size_t>> waiting;
+    std::vector<size_t> ready;
+    std::vector<MAT::Node*> parent_nodes(n, NULL);
+    for (size_t i = 0; i < n; i++) {
+        if (!batch.errors[i].empty()) {
+            continue;
+        }
+        parent_nodes[i] = T->get_node(batch.parents[i]);
+        if (parent_nodes[i] != NULL) {
+            ready.push_back(i);
+        } else {
+            waiting[batch.parents[i]].push_back(i);
+        }
+    }
+    std::vector<MAT::Node*> nodes(n, NULL);
+    // first in, first out, so siblings are attached in the order they are listed
+    for (size_t next = 0; next < ready.size(); next++) {
+        size_t i = ready[next];
+        nodes[i] = T->create_node(batch.identifiers[i], parent_nodes[i], 0.0);
+        if (waiting.empty()) {
+            continue;
+        }
+        auto it = waiting.find(batch.identifiers[i]);
+        if (it != waiting.end()) {
+            for (size_t child: it->second) {
+                parent_nodes[child] = nodes[i];
+                ready.push_back(child);
+            }
+            waiting.erase(it);
+        }
+    }
+    for (auto &kv: waiting) {
+        for (size_t i: kv.second) {
+            batch.errors[i] = "Parent " + kv.first + " of node " + batch.identifiers[i] + " not found in the tree.";
+        }
+    }
+    return assign_batch_mutations(batch, nodes, false, true);
+}
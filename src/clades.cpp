@@ -0,0 +1,95 @@
+/*index of clade annotations for constant time membership queries.
+Leaves are listed in preorder, so the leaves below any node form a contiguous range of that list. Each annotated node is stored with
+the range of its leaves; the members of a clade are then a slice of the leaf list, and the number of members of a clade below some
+other node is the overlap of two ranges.*/
+#pragma once
+#include "usher/src/usher_graph.hpp"
+#include "arrays.cpp"
+
+struct CladeRecord {
+    // index of the annotation in CladeIndex::names
+    size_t clade;
+    MAT::Node* node;
+    size_t leaf_begin;
+    size_t leaf_end;
+};
+
+class CladeIndex {
+  public:
+    // every leaf of the tree, in preorder
+    std::vector<MAT::Node*> leaves;
+    // distinct annotations, in the order first found in preorder
+    std::vector<std::string> names;
+    // every annotation of every node, in preorder
+    std::vector<CladeRecord> records;
+
+    CladeIndex(MAT::Tree* T) {
+        std::vector<MAT::Node*> nodes = T->depth_first_expansion(T->root);
+        size_t n = nodes.size();
+        PreorderRanges ranges = preorder_ranges(nodes, preorder_parents(nodes));
+        leaves = std::move(ranges.leaves);
+        leaf_begin = std::move(ranges.leaf_begin);
+        leaf_count = std::move(ranges.leaf_count);
+        positions = preorder_positions(nodes);
+        for (size_t i = 0; i < n; i++) {
+            for (auto &ann: nodes[i]->clade_annotations) {
+                if (ann.size() == 0) {
+                    continue;
+                }
+                auto it = clade_ids.find(ann);
+                if (it == clade_ids.end()) {
+                    it = clade_ids.emplace(ann, names.size()).first;
+                    first_record.push_back(records.size());
+                    names.push_back(ann);
+                }
+                records.push_back({it->second, nodes[i], leaf_begin[i], leaf_begin[i] + leaf_count[i]});
+            }
+        }
+    }
+
+    // The first node in preorder carrying the annotation, with the range of its leaves, or NULL if no node carries it.
+    const CladeRecord* find(const std::string &clade) const {
+        auto it = clade_ids.find(clade);
+        return (it == clade_ids.end()) ? NULL : &records[first_record[it->second]];
+    }
+
+    std::vector<std::string> clade_samples(const std::string &clade) const {
+        std::vector<std::string> samples;
+        const CladeRecord* record = find(clade);
+        if (record != NULL) {
+            samples.reserve(record->leaf_end - record->leaf_begin);
+            for (size_t i = record->leaf_begin; i < record->leaf_end; i++) {
+                samples.push_back(leaves[i]->identifier);
+            }
+        }
+        return samples;
+    }
+
+    // The number of leaves below subroot which belong to each clade, in the order of names, counting a leaf once for every annotated
+    // ancestor (including ancestors of subroot itself).
+    std::vector<size_t> count_inclusive(const MAT::Node* subroot) const {
+        auto it = positions.find(subroot);
+        if (it == positions.end()) {
+            throw std::invalid_argument("Node is not part of the indexed tree.");
+        }
+        size_t begin = leaf_begin[it->second];
+        size_t end = begin + leaf_count[it->second];
+        std::vector<size_t> counts(names.size(), 0);
+        for (auto &record: records) {
+            size_t lo = std::max(begin, record.leaf_begin);
+            size_t hi = std::min(end, record.leaf_end);
+            if (hi > lo) {
+                counts[record.clade] += hi - lo;
+            }
+        }
+        return counts;
+    }
+
+  private:
+    std::vector<size_t> leaf_begin;
+    std::vector<size_t> leaf_count;
+    std::unordered_map<const MAT::Node*, size_t> positions;
+    std::unordered_map<std::string, size_t> clade_ids;
+    // index in records of the first node carrying each annotation
+    std::vector<size_t> first_record;
+};
@@ -0,0 +1,128 @@
+/*entropy of categorical tip traits across the splits of a tree, for many traits in a single traversal.
+Nodes are visited in reverse preorder, so every node is reached after all of its descendants. Category counts are not stored per node;
+instead there is one accumulator per depth, since the only nodes with partially counted subtrees at any time are the ancestors of the
+current node, at most one per depth. Each node adds its counts into the accumulator of the depth above, and the accumulator of its own
+depth, which holds the sum over its children, is cleared once it has been consumed.*/
+#pragma once
+#include "usher/src/usher_graph.hpp"
+#include "arrays.cpp"
+
+struct TraitEntropy {
+    std::vector<MAT::Node*> nodes;
+    // entropy of the leaves below each node (row, in preorder) for each trait (column)
+    std::vector<double> absolute;
+    // reduction in entropy from the node to its children, weighted by the number of leaves below each child
+    std::vector<double> relative;
+    // number of leaves with a known category below each node for each trait
+    std::vector<int64_t> counts;
+};
+
+// Compute the entropy of num_categories.size() traits on a subtree given by the preorder parent index of each node (-1 for its root).
+// rows holds the row in categories of each leaf, with one category index per trait in each row; a negative row or category index
+// marks missing data. Leaves with missing data do not contribute to the counts of that trait. Fills every field of result but nodes.
+void trait_entropy_preorder(const std::vector<int64_t> &parent, const std::vector<uint8_t> &is_leaf, const std::vector<int64_t> &rows, const std::vector<int32_t> &categories, const std::vector<size_t> &num_categories, TraitEntropy &result) {
+    const size_t num_traits = num_categories.size();
+    if (num_traits == 0) {
+        throw std::invalid_argument("Entropy requires at least one trait.");
+    }
+    // the counts of trait t occupy columns offsets[t] up to offsets[t+1] of an accumulator
+    std::vector<size_t> offsets(num_traits + 1, 0);
+    for (size_t t = 0; t < num_traits; t++) {
+        offsets[t + 1] = offsets[t] + num_categories[t];
+    }
+    const size_t width = offsets[num_traits];
+    const size_t n = parent.size();
+    std::vector<size_t> depth(n, 0);
+    size_t max_depth = 0;
+    for (size_t i = 1; i < n; i++) {
+        depth[i] = depth[parent[i]] + 1;
+        max_depth = std::max(max_depth, depth[i]);
+    }
+    result.absolute.assign(n * num_traits, 0.0);
+    result.relative.assign(n * num_traits, 0.0);
+    result.counts.assign(n * num_traits, 0);
+
+    // per depth: category counts, and the sum over children of entropy times number of leaves, for each trait
+    std::vector<int64_t> accumulated(max_depth * width + width, 0);
+    std::vector<double> weighted(max_depth * num_traits + num_traits, 0.0);
+    for (size_t i = n; i-- > 0;) {
+        int64_t* up = (i > 0) ? &accumulated[(depth[i] - 1) * width] : NULL;
+        double* up_weighted = (i > 0) ? &weighted[(depth[i] - 1) * num_traits] : NULL;
+        int64_t* node_counts = &result.counts[i * num_traits];
+        if (is_leaf[i]) {
+            // a single leaf has no entropy, so it only adds its own categories to its parent.
+            for (size_t t = 0; t < num_traits; t++) {
+                int32_t c = (rows[i] < 0) ? -1 : categories[rows[i] * num_traits + t];
+                if (c >= (int32_t)num_categories[t]) {
+                    throw std::invalid_argument("Category index exceeds the number of categories.");
+                }
+                if (c >= 0) {
+                    node_counts[t] = 1;
+                    if (up != NULL) {
+                        up[offsets[t] + c]++;
+                    }
+                }
+            }
+            continue;
+        }
+        int64_t* own = &accumulated[depth[i] * width];
+        double* own_weighted = &weighted[depth[i] * num_traits];
+        double* absolute = &result.absolute[i * num_traits];
+        double* relative = &result.relative[i * num_traits];
+        for (size_t t = 0; t < num_traits; t++) {
+            int64_t total = 0;
+            size_t observed = 0;
+            double sum_clogc = 0.0;
+            for (size_t k = offsets[t]; k < offsets[t + 1]; k++) {
+                if (own[k] > 0) {
+                    total += own[k];
+                    observed++;
+                    sum_clogc += own[k] * std::log((double)own[k]);
+                }
+            }
+            node_counts[t] = total;
+            // a single category has zero entropy; skip it so rounding cannot leave a tiny nonzero value.
+            if (observed > 1) {
+                // -sum(p log p) with p = c/total, rearranged so each count is only logged once
+                absolute[t] = std::log((double)total) - sum_clogc / total;
+                relative[t] = absolute[t] - own_weighted[t] / total;
+            }
+        }
+        if (up != NULL) {
+            for (size_t k = 0; k < width; k++) {
+                up[k] += own[k];
+            }
+            for (size_t t = 0; t < num_traits; t++) {
+                up_weighted[t] += absolute[t] * node_counts[t];
+            }
+        }
+        std::fill(own, own + width, 0);
+        std::fill(own_weighted, own_weighted + num_traits, 0.0);
+    }
+}
+
+// Compute the entropy of num_categories.size() traits on the subtree below subroot.
+// categories holds one category index per trait for each node in leaves, row by row; a negative index marks missing data.
+// Leaves with missing data, or not listed at all, do not contribute to the counts of that trait.
+TraitEntropy trait_entropy(MAT::Tree* T, MAT::Node* subroot, const std::vector<MAT::Node*> &leaves, const std::vector<int32_t> &categories, const std::vector<size_t> &num_categories) {
+    TraitEntropy result;
+    if (categories.size() != leaves.size() * num_categories.size()) {
+        throw std::invalid_argument("Category array does not match the number of leaves and traits.");
+    }
+    std::unordered_map<const MAT::Node*, size_t> leaf_rows;
+    for (size_t l = 0; l < leaves.size(); l++) {
+        leaf_rows[leaves[l]] = l;
+    }
+    result.nodes = T->depth_first_expansion(subroot);
+    std::vector<uint8_t> is_leaf(result.nodes.size());
+    std::vector<int64_t> rows(result.nodes.size(), -1);
+    for (size_t i = 0; i < result.nodes.size(); i++) {
+        is_leaf[i] = result.nodes[i]->is_leaf();
+        auto row = leaf_rows.find(result.nodes[i]);
+        if (is_leaf[i] && row != leaf_rows.end()) {
+            rows[i] = row->second;
+        }
+    }
+    trait_entropy_preorder(preorder_parents(result.nodes), is_leaf, rows, categories, num_categories, result);
+    return result;
+}
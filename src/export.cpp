@@ -0,0 +1,599 @@
+/*streaming export of the tree as VCF and Auspice JSON, producing the same text as matUtils' make_vcf and write_json_from_mat without
+copying the tree. Both work over the preorder traversal, where the leaves below any node are a contiguous range of the leaves, so a
+sample subset is a set of output columns and the induced subtree is found by counting the chosen leaves below each node.
+Output is produced in blocks, VCF rows for a block of sites or JSON text for a range of nodes, which are rendered on separate threads a
+window at a time and then written in order, so at most a window of blocks is held in memory. Files ending in .gz are written as block
+gzip, each block compressed on the thread that rendered it.*/
+#pragma once
+#include "usher/src/usher_graph.hpp"
+#include "arrays.cpp"
+#include "pbio.cpp"
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+#include <tbb/blocked_range.h>
+#include <cstdio>
+
+// number of blocks rendered concurrently before they are written
+static const size_t EXPORT_WINDOW = 16;
+// nodes per block of JSON output
+static const size_t JSON_BLOCK_NODES = 16384;
+
+namespace treeexport {
+
+class BlockWriter {
+  public:
+    BlockWriter(const std::string &filename) : out(filename, std::ios::binary | std::ios::trunc), name(filename) {
+        if (!out) {
+            throw std::runtime_error("Could not open " + filename + " for writing.");
+        }
+        compressed = pbio::ends_with(filename, ".gz");
+    }
+
+    // Called on the rendering threads, so compression happens in parallel.
+    std::string encode(const std::string &text) const {
+        return compressed ? pbio::compress(text) : text;
+    }
+
+    void write(const std::string &block) {
+        out.write(block.data(), block.size());
+        if (!out) {
+            throw std::runtime_error("Failed to write " + name + ".");
+        }
+    }
+
+    // Render blocks 0 up to num_blocks with render(b), a window at a time, and write them in order.
+    template <class Render> void write_blocks(size_t num_blocks, Render render) {
+        std::vector<std::string> window(EXPORT_WINDOW);
+        for (size_t first = 0; first < num_blocks; first += EXPORT_WINDOW) {
+            size_t last = std::min(num_blocks, first + EXPORT_WINDOW);
+            tbb::parallel_for(tbb::blocked_range<size_t>(first, last, 1), [&](const tbb::blocked_range<size_t> &r) {
+                for (size_t b = r.begin(); b < r.end(); b++) {
+                    window[b - first] = encode(render(b));
+                }
+            });
+            for (size_t b = first; b < last; b++) {
+                write(window[b - first]);
+                std::string().swap(window[b - first]);
+            }
+        }
+    }
+
+  private:
+    std::ofstream out;
+    std::string name;
+    bool compressed;
+};
+
+/*The chosen samples as output columns. The chosen leaves below node i are columns column_begin[i] up to column_begin[i] + column_count[i];
+an empty sample list chooses every leaf.*/
+struct SampleColumns {
+    std::vector<MAT::Node*> nodes;
+    std::vector<int64_t> parent;
+    std::vector<MAT::Node*> columns;
+    std::vector<size_t> column_begin;
+    std::vector<size_t> column_count;
+};
+
+SampleColumns sample_columns(MAT::Tree* T, const std::vector<std::string> &samples) {
+    SampleColumns sc;
+    sc.nodes = T->depth_first_expansion();
+    sc.parent = preorder_parents(sc.nodes);
+    PreorderRanges ranges = preorder_ranges(sc.nodes, sc.parent);
+    std::vector<uint8_t> chosen(ranges.leaves.size(), samples.empty());
+    if (!samples.empty()) {
+        std::unordered_map<const MAT::Node*, size_t> positions = preorder_positions(sc.nodes);
+        for (auto &s: samples) {
+            MAT::Node* node = T->get_node(s);
+            if (node != NULL && node->is_leaf()) {
+                auto it = positions.find(node);
+                if (it != positions.end()) {
+                    chosen[ranges.leaf_begin[it->second]] = 1;
+                }
+            }
+        }
+    }
+    // columns before each leaf
+    std::vector<size_t> before(ranges.leaves.size() + 1, 0);
+    for (size_t l = 0; l < ranges.leaves.size(); l++) {
+        before[l + 1] = before[l] + chosen[l];
+        if (chosen[l]) {
+            sc.columns.push_back(ranges.leaves[l]);
+        }
+    }
+    size_t n = sc.nodes.size();
+    sc.column_begin.resize(n);
+    sc.column_count.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        sc.column_begin[i] = before[ranges.leaf_begin[i]];
+        sc.column_count[i] = before[ranges.leaf_begin[i] + ranges.leaf_count[i]] - sc.column_begin[i];
+    }
+    return sc;
+}
+
+// A mutation at one site, on the branch above node, in the order sites are written.
+struct SiteMutation {
+    uint32_t chrom;
+    int32_t position;
+    uint32_t node;
+    uint32_t order;
+    int8_t ref_nuc;
+    int8_t mut_nuc;
+    bool operator<(const SiteMutation &other) const {
+        if (chrom != other.chrom) {
+            return chrom < other.chrom;
+        }
+        if (position != other.position) {
+            return position < other.position;
+        }
+        if (node != other.node) {
+            return node < other.node;
+        }
+        return order < other.order;
+    }
+};
+
+/*One VCF row. Each leaf takes the allele of the last mutation at the site on its path from the root, found by applying the mutations in
+preorder to the range of columns below them. Alternate alleles are listed by decreasing count, and sites where no chosen sample differs
+from the reference are not written.*/
+void vcf_row(std::string &out, const std::string &chrom, const SiteMutation* begin, const SiteMutation* end, const SampleColumns &sc,
+             bool no_genotypes, std::vector<int8_t> &genotypes) {
+    const int8_t missing = 0b1111;
+    int8_t ref = begin->ref_nuc;
+    genotypes.assign(sc.columns.size(), ref);
+    for (const SiteMutation* m = begin; m < end; m++) {
+        std::fill_n(genotypes.begin() + sc.column_begin[m->node], sc.column_count[m->node], m->mut_nuc);
+    }
+    size_t counts[16] = {0};
+    for (int8_t g: genotypes) {
+        counts[g & 0xf]++;
+    }
+    std::vector<int8_t> alts;
+    for (int8_t nuc = 1; nuc < 16; nuc++) {
+        if (nuc != ref && nuc != missing && counts[nuc] > 0) {
+            alts.push_back(nuc);
+        }
+    }
+    if (alts.empty()) {
+        return;
+    }
+    std::stable_sort(alts.begin(), alts.end(), [&](int8_t a, int8_t b) {
+        return counts[a] > counts[b];
+    });
+    std::string position = std::to_string(begin->position);
+    out += chrom;
+    out += '\t';
+    out += position;
+    out += '\t';
+    for (size_t a = 0; a < alts.size(); a++) {
+        if (a > 0) {
+            out += ',';
+        }
+        out += MAT::get_nuc(ref);
+        out += position;
+        out += MAT::get_nuc(alts[a]);
+    }
+    out += '\t';
+    out += MAT::get_nuc(ref);
+    out += '\t';
+    for (size_t a = 0; a < alts.size(); a++) {
+        if (a > 0) {
+            out += ',';
+        }
+        out += MAT::get_nuc(alts[a]);
+    }
+    out += "\t.\t.\tAC=";
+    for (size_t a = 0; a < alts.size(); a++) {
+        if (a > 0) {
+            out += ',';
+        }
+        out += std::to_string(counts[alts[a]]);
+    }
+    out += ";AN=";
+    out += std::to_string(genotypes.size() - counts[missing]);
+    if (!no_genotypes) {
+        std::vector<std::string> labels(16, ".");
+        labels[ref & 0xf] = "0";
+        for (size_t a = 0; a < alts.size(); a++) {
+            labels[alts[a]] = std::to_string(a + 1);
+        }
+        out += "\tGT";
+        for (int8_t g: genotypes) {
+            out += '\t';
+            out += labels[g & 0xf];
+        }
+    }
+    out += '\n';
+}
+
+}
+
+// Write the chosen samples, or all samples if none are given, as a VCF, equivalent to make_vcf.
+void write_vcf_parallel(MAT::Tree* T, const std::string &filename, bool no_genotypes, const std::vector<std::string> &samples) {
+    using namespace treeexport;
+    SampleColumns sc = sample_columns(T, samples);
+    // number the chromosomes in name order, which is the order their rows are written
+    std::map<std::string, uint32_t> chrom_ids;
+    for (size_t i = 0; i < sc.nodes.size(); i++) {
+        if (sc.column_count[i] > 0) {
+            for (auto &m: sc.nodes[i]->mutations) {
+                chrom_ids.emplace(m.chrom, 0);
+            }
+        }
+    }
+    std::vector<std::string> chromosomes;
+    for (auto &kv: chrom_ids) {
+        kv.second = chromosomes.size();
+        chromosomes.push_back(kv.first);
+    }
+    std::vector<SiteMutation> sites;
+    for (size_t i = 0; i < sc.nodes.size(); i++) {
+        if (sc.column_count[i] == 0) {
+            continue;
+        }
+        uint32_t order = 0;
+        for (auto &m: sc.nodes[i]->mutations) {
+            if (!m.is_masked()) {
+                sites.push_back({chrom_ids[m.chrom], m.position, (uint32_t)i, order++, m.ref_nuc, m.mut_nuc});
+            }
+        }
+    }
+    tbb::parallel_sort(sites.begin(), sites.end());
+    std::vector<size_t> site_begin;
+    for (size_t k = 0; k < sites.size(); k++) {
+        if (k == 0 || sites[k].chrom != sites[k - 1].chrom || sites[k].position != sites[k - 1].position) {
+            site_begin.push_back(k);
+        }
+    }
+    site_begin.push_back(sites.size());
+    size_t num_sites = site_begin.size() - 1;
+
+    BlockWriter out(filename);
+    std::string header = "##fileformat=VCFv4.2\n#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO";
+    if (!no_genotypes) {
+        header += "\tFORMAT";
+        for (auto leaf: sc.columns) {
+            header += '\t';
+            header += leaf->identifier;
+        }
+    }
+    header += '\n';
+    out.write(out.encode(header));
+    // about one compressed block of text per block of sites
+    size_t row_size = 64 + (no_genotypes ? 0 : 2 * sc.columns.size());
+    size_t sites_per_block = std::max((size_t)1, PB_BLOCK_SIZE / row_size);
+    size_t num_blocks = (num_sites + sites_per_block - 1) / sites_per_block;
+    out.write_blocks(num_blocks, [&](size_t b) {
+        std::string text;
+        std::vector<int8_t> genotypes;
+        size_t last = std::min(num_sites, (b + 1) * sites_per_block);
+        for (size_t s = b * sites_per_block; s < last; s++) {
+            const SiteMutation* begin = sites.data() + site_begin[s];
+            vcf_row(text, chromosomes[begin->chrom], begin, sites.data() + site_begin[s + 1], sc, no_genotypes, genotypes);
+        }
+        return text;
+    });
+}
+
+namespace treeexport {
+
+void json_string(std::string &out, const std::string &s) {
+    out += '"';
+    for (char c: s) {
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\b':
+            out += "\\b";
+            break;
+        case '\f':
+            out += "\\f";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                char escaped[7];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+                out += escaped;
+            } else {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+}
+
+/*The subtree spanned by the chosen samples, as filter_master extracts it, with its children in the order rotate_for_display(true) gives
+them. A node is kept if it is a chosen leaf or has chosen leaves under two or more of its children; the mutations of the nodes passed
+over on the way up to the nearest kept ancestor are merged into the kept node below them.*/
+struct JsonTree {
+    SampleColumns sc;
+    size_t root;
+    // nearest kept ancestor of each kept node, in preorder numbering
+    std::vector<int64_t> up;
+    // the kept children of node i, in display order, are children[child_offsets[i]] up to children[child_offsets[i+1]]
+    std::vector<size_t> child_offsets;
+    std::vector<uint32_t> children;
+    // kept nodes in display preorder
+    std::vector<uint32_t> order;
+    std::vector<uint8_t> last_child;
+    std::vector<size_t> div;
+    bool clade_zero;
+    bool clade_one;
+};
+
+// The mutations of a kept node, merged down the passed over nodes above it as Node::add_mutation would.
+std::vector<MAT::Mutation> merged_mutations(const JsonTree &jt, size_t i) {
+    std::vector<size_t> path(1, i);
+    if (i != jt.root) {
+        for (int64_t j = jt.sc.parent[i]; j != jt.up[i]; j = jt.sc.parent[j]) {
+            path.push_back(j);
+        }
+    }
+    std::vector<MAT::Mutation> mutations;
+    for (size_t p = path.size(); p-- > 0;) {
+        for (auto &m: jt.sc.nodes[path[p]]->mutations) {
+            auto it = std::lower_bound(mutations.begin(), mutations.end(), m);
+            if (it != mutations.end() && it->position == m.position) {
+                it->mut_nuc = m.mut_nuc;
+                if (it->mut_nuc == it->par_nuc) {
+                    mutations.erase(it);
+                }
+            } else {
+                mutations.insert(it, m);
+            }
+        }
+    }
+    return mutations;
+}
+
+JsonTree json_tree(MAT::Tree* T, const std::vector<std::string> &samples) {
+    JsonTree jt;
+    jt.sc = sample_columns(T, samples);
+    const SampleColumns &sc = jt.sc;
+    size_t n = sc.nodes.size();
+    size_t total = sc.columns.size();
+    if (total == 0) {
+        throw std::invalid_argument("Unable to find samples to extract json! Check sample input");
+    }
+    std::vector<uint32_t> chosen_children(n, 0);
+    for (size_t i = 1; i < n; i++) {
+        if (sc.column_count[i] > 0) {
+            chosen_children[sc.parent[i]]++;
+        }
+    }
+    std::vector<uint8_t> kept(n, 0);
+    jt.root = n;
+    for (size_t i = 0; i < n; i++) {
+        kept[i] = sc.column_count[i] > 0 && (sc.nodes[i]->is_leaf() || chosen_children[i] >= 2);
+        // the deepest node holding every chosen sample is the only kept one that does
+        if (kept[i] && sc.column_count[i] == total && jt.root == n) {
+            jt.root = i;
+        }
+    }
+    jt.up.assign(n, -1);
+    std::vector<int64_t> nearest(n, -1);
+    std::vector<size_t> num_children(n + 1, 0);
+    for (size_t i = jt.root + 1; i < n; i++) {
+        int64_t p = sc.parent[i];
+        nearest[i] = kept[p] ? p : nearest[p];
+        if (kept[i] && nearest[i] >= 0) {
+            jt.up[i] = nearest[i];
+            num_children[nearest[i] + 1]++;
+        }
+    }
+    jt.child_offsets.assign(n + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+        jt.child_offsets[i + 1] = jt.child_offsets[i] + num_children[i + 1];
+    }
+    jt.children.resize(jt.child_offsets[n]);
+    std::vector<size_t> next(jt.child_offsets.begin(), jt.child_offsets.end() - 1);
+    std::vector<int> descendants(n, 1);
+    for (size_t i = jt.root + 1; i < n; i++) {
+        if (jt.up[i] >= 0) {
+            jt.children[next[jt.up[i]]++] = i;
+        }
+    }
+    for (size_t i = n; i-- > jt.root + 1;) {
+        if (jt.up[i] >= 0) {
+            descendants[jt.up[i]] += descendants[i];
+        }
+    }
+    // the same sort rotate_for_display applies, so ties are broken identically
+    tbb::parallel_for(tbb::blocked_range<size_t>(jt.root, n), [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t i = r.begin(); i < r.end(); i++) {
+            auto begin = jt.children.begin() + jt.child_offsets[i];
+            auto end = jt.children.begin() + jt.child_offsets[i + 1];
+            tbb::parallel_sort(begin, end, [&](uint32_t a, uint32_t b) {
+                return descendants[a] > descendants[b];
+            });
+            std::reverse(begin, end);
+        }
+    });
+    std::vector<size_t> mutation_count(n, 0);
+    tbb::parallel_for(tbb::blocked_range<size_t>(jt.root, n), [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t i = r.begin(); i < r.end(); i++) {
+            if (i == jt.root || jt.up[i] >= 0) {
+                mutation_count[i] = merged_mutations(jt, i).size();
+            }
+        }
+    });
+    jt.last_child.assign(n, 0);
+    jt.div.assign(n, 0);
+    std::vector<uint32_t> stack(1, jt.root);
+    while (!stack.empty()) {
+        uint32_t i = stack.back();
+        stack.pop_back();
+        jt.order.push_back(i);
+        jt.div[i] = ((i == jt.root) ? 0 : jt.div[jt.up[i]]) + mutation_count[i];
+        size_t begin = jt.child_offsets[i];
+        size_t end = jt.child_offsets[i + 1];
+        if (begin < end) {
+            jt.last_child[jt.children[end - 1]] = 1;
+        }
+        for (size_t c = end; c-- > begin;) {
+            stack.push_back(jt.children[c]);
+        }
+    }
+    jt.clade_zero = false;
+    jt.clade_one = false;
+    for (auto i: jt.order) {
+        const std::vector<std::string> &annotations = sc.nodes[i]->clade_annotations;
+        jt.clade_zero |= annotations.size() >= 1 && annotations[0] != "";
+        jt.clade_one |= annotations.size() >= 2 && annotations[1] != "";
+    }
+    return jt;
+}
+
+typedef std::vector<std::unordered_map<std::string, std::unordered_map<std::string, std::string>>> CategoryMetadata;
+
+// The fields of a node's JSON object written before its children.
+void json_node_open(std::string &out, const JsonTree &jt, size_t i) {
+    std::vector<MAT::Mutation> mutations = merged_mutations(jt, i);
+    out += "{\"branch_attrs\":{\"labels\":{\"nuc mutations\":\"";
+    for (size_t k = 0; k < mutations.size(); k++) {
+        if (k > 0) {
+            out += ',';
+        }
+        out += mutations[k].get_string();
+    }
+    out += "\"},\"mutations\":{\"nuc\":[";
+    for (size_t k = 0; k < mutations.size(); k++) {
+        if (k > 0) {
+            out += ',';
+        }
+        json_string(out, mutations[k].get_string());
+    }
+    out += "]}}";
+    if (jt.child_offsets[i] < jt.child_offsets[i + 1]) {
+        out += ",\"children\":[";
+    }
+}
+
+// The fields of a node's JSON object written after its children, in key order.
+void json_node_close(std::string &out, const JsonTree &jt, size_t i, const CategoryMetadata &catmeta) {
+    MAT::Node* node = jt.sc.nodes[i];
+    if (jt.child_offsets[i] < jt.child_offsets[i + 1]) {
+        out += ']';
+    }
+    std::map<std::string, std::string> attrs;
+    attrs["div"] = std::to_string(jt.div[i]);
+    std::string value;
+    if (jt.clade_zero) {
+        value = "{\"value\":";
+        json_string(value, node->clade_annotations.size() >= 1 ? node->clade_annotations[0] : "");
+        attrs["MAT_Clade_0"] = value + "}";
+    }
+    if (jt.clade_one) {
+        value = "{\"value\":";
+        json_string(value, node->clade_annotations.size() >= 2 ? node->clade_annotations[1] : "");
+        attrs["MAT_Clade_1"] = value + "}";
+    }
+    for (auto &categories: catmeta) {
+        for (auto &category: categories) {
+            auto it = category.second.find(node->identifier);
+            if (it != category.second.end()) {
+                value = "{\"value\":";
+                json_string(value, it->second);
+                attrs[category.first] = value + "}";
+            }
+        }
+    }
+    out += ",\"name\":";
+    json_string(out, node->identifier);
+    out += ",\"node_attrs\":{";
+    bool first = true;
+    for (auto &kv: attrs) {
+        if (!first) {
+            out += ',';
+        }
+        first = false;
+        json_string(out, kv.first);
+        out += ':';
+        out += kv.second;
+    }
+    out += "}}";
+}
+
+std::string json_meta(const JsonTree &jt, const CategoryMetadata &catmeta, const std::string &title) {
+    std::set<std::string> keys;
+    if (jt.clade_zero) {
+        keys.insert("MAT_Clade_0");
+    }
+    if (jt.clade_one) {
+        keys.insert("MAT_Clade_1");
+    }
+    for (auto &categories: catmeta) {
+        for (auto &category: categories) {
+            keys.insert(category.first);
+        }
+    }
+    std::string out = "{\"colorings\":[";
+    bool first = true;
+    for (auto &key: keys) {
+        out += first ? "" : ",";
+        first = false;
+        out += "{\"key\":";
+        json_string(out, key);
+        out += ",\"title\":";
+        json_string(out, key);
+        out += ",\"type\":\"categorical\"}";
+    }
+    out += "],\"display_defaults\":{\"branch_label\":\"nuc mutations\"},\"filters\":[";
+    first = true;
+    for (auto &key: keys) {
+        out += first ? "" : ",";
+        first = false;
+        json_string(out, key);
+    }
+    out += "],\"panels\":[\"tree\"],\"title\":";
+    json_string(out, title);
+    out += '}';
+    return out;
+}
+
+}
+
+/*Write the subtree of the chosen samples, or the whole tree if none are given, as an Auspice JSON, equivalent to filter_master followed
+by write_json_from_mat. Each block is a range of nodes in display preorder; a node opens its object, and a node ending a subtree closes the
+objects of the ancestors it is the last descendant of, so blocks can be rendered independently.*/
+void write_json_parallel(MAT::Tree* T, const std::string &filename, const std::vector<std::string> &samples,
+                         const treeexport::CategoryMetadata* catmeta, const std::string &title) {
+    using namespace treeexport;
+    JsonTree jt = json_tree(T, samples);
+    BlockWriter out(filename);
+    out.write(out.encode("{\"meta\":" + json_meta(jt, *catmeta, title) + ",\"tree\":"));
+    size_t num_blocks = (jt.order.size() + JSON_BLOCK_NODES - 1) / JSON_BLOCK_NODES;
+    out.write_blocks(num_blocks, [&](size_t b) {
+        std::string text;
+        size_t last = std::min(jt.order.size(), (b + 1) * JSON_BLOCK_NODES);
+        for (size_t k = b * JSON_BLOCK_NODES; k < last; k++) {
+            size_t i = jt.order[k];
+            json_node_open(text, jt, i);
+            if (jt.child_offsets[i] < jt.child_offsets[i + 1]) {
+                continue;
+            }
+            json_node_close(text, jt, i, *catmeta);
+            while (i != jt.root && jt.last_child[i]) {
+                i = jt.up[i];
+                json_node_close(text, jt, i, *catmeta);
+            }
+            if (i != jt.root) {
+                text += ',';
+            }
+        }
+        return text;
+    });
+    out.write(out.encode(",\"version\":\"v2\"}\n"));
+}
@@ -0,0 +1,335 @@
+/*compact read-only view of a tree, for analyses of large trees that do not change it.
+Nodes are stored contiguously in preorder as a struct of arrays, so a subtree is the range of nodes from its root up to subtree_end, and
+traversals read memory sequentially instead of following child pointers. Chromosomes and clade annotations are interned to small
+integer ids, mutations are packed into 8 bytes each, and identifiers share a single character buffer. The view is a copy; it does
+not change when the tree it was built from is edited, and has to be built again to reflect any edits.*/
+#pragma once
+#include "usher/src/usher_graph.hpp"
+#include "arrays.cpp"
+#include "entropy.cpp"
+#include "haplotype.cpp"
+#include <string_view>
+#include <tbb/parallel_for.h>
+
+struct PackedMutation {
+    int32_t position;
+    uint16_t chrom;
+    // ref_nuc in the low four bits, and the fifth bit set for missing data
+    uint8_t ref;
+    // par_nuc in the high four bits, mut_nuc in the low four bits
+    uint8_t alleles;
+
+    inline int8_t ref_nuc() const { return ref & 15; }
+    inline bool is_missing() const { return (ref & 16) != 0; }
+    inline int8_t par_nuc() const { return alleles >> 4; }
+    inline int8_t mut_nuc() const { return alleles & 15; }
+};
+static_assert(sizeof(PackedMutation) == 8, "PackedMutation must stay 8 bytes.");
+
+template <> struct MutationTraits<PackedMutation> {
+    static inline int8_t par_nuc(const PackedMutation &m) { return m.par_nuc(); }
+    static inline int8_t mut_nuc(const PackedMutation &m) { return m.mut_nuc(); }
+
+    static inline PackedMutation stack(const PackedMutation &earlier, const PackedMutation &later) {
+        PackedMutation m = later;
+        m.alleles = (earlier.alleles & 0xf0) | later.mut_nuc();
+        return m;
+    }
+
+    // chromosome ids are assigned in sorted order, so this matches the order of tree haplotypes.
+    static inline bool site_before(const PackedMutation &a, const PackedMutation &b) {
+        return (a.chrom < b.chrom) || (a.chrom == b.chrom && a.position < b.position);
+    }
+};
+
+struct FrozenAnnotation {
+    uint32_t node;
+    uint32_t level;
+    uint32_t clade;
+};
+
+class FrozenTree {
+  public:
+    // preorder index of the parent of each node, -1 for the root
+    std::vector<int32_t> parent;
+    // one past the preorder index of the last descendent of each node
+    std::vector<uint32_t> subtree_end;
+    std::vector<float> branch_length;
+    // the mutations of node i are mutations[mutation_offsets[i]] up to mutations[mutation_offsets[i+1]]
+    std::vector<uint64_t> mutation_offsets;
+    std::vector<PackedMutation> mutations;
+    std::vector<uint64_t> identifier_offsets;
+    std::vector<char> identifier_data;
+    // sorted, so chromosome ids order mutations the same way as their names
+    std::vector<std::string> chromosomes;
+    std::vector<std::string> clades;
+    // non-empty clade annotations, ordered by node
+    std::vector<FrozenAnnotation> annotations;
+
+    FrozenTree(MAT::Tree* T) {
+        auto nodes = T->depth_first_expansion(T->root);
+        size_t n = nodes.size();
+        if (n > (size_t)INT32_MAX) {
+            throw std::invalid_argument("Tree is too large to freeze.");
+        }
+        std::set<std::string> chrom_names;
+        size_t total_mutations = 0;
+        size_t total_identifiers = 0;
+        for (auto node: nodes) {
+            for (auto &m: node->mutations) {
+                chrom_names.insert(m.chrom);
+            }
+            total_mutations += node->mutations.size();
+            total_identifiers += node->identifier.size();
+        }
+        if (chrom_names.size() > UINT16_MAX) {
+            throw std::invalid_argument("Too many chromosomes to freeze the tree.");
+        }
+        chromosomes.assign(chrom_names.begin(), chrom_names.end());
+        std::unordered_map<std::string, uint16_t> chrom_ids;
+        for (size_t c = 0; c < chromosomes.size(); c++) {
+            chrom_ids.emplace(chromosomes[c], (uint16_t)c);
+        }
+        std::unordered_map<std::string, uint32_t> clade_ids;
+
+        auto parents = preorder_parents(nodes);
+        parent.assign(parents.begin(), parents.end());
+        std::vector<size_t> subtree_size = preorder_ranges(nodes, parents).subtree_size;
+        subtree_end.resize(n);
+        branch_length.resize(n);
+        mutation_offsets.resize(n + 1);
+        mutations.reserve(total_mutations);
+        identifier_offsets.resize(n + 1);
+        identifier_data.reserve(total_identifiers);
+        mutation_offsets[0] = 0;
+        identifier_offsets[0] = 0;
+        for (size_t i = 0; i < n; i++) {
+            MAT::Node* node = nodes[i];
+            subtree_end[i] = i + subtree_size[i];
+            branch_length[i] = node->branch_length;
+            for (auto &m: node->mutations) {
+                PackedMutation packed;
+                packed.position = m.position;
+                packed.chrom = chrom_ids[m.chrom];
+                packed.ref = (m.ref_nuc & 15) | (m.is_missing ? 16 : 0);
+                packed.alleles = ((m.par_nuc & 15) << 4) | (m.mut_nuc & 15);
+                mutations.push_back(packed);
+            }
+            mutation_offsets[i + 1] = mutations.size();
+            identifier_data.insert(identifier_data.end(), node->identifier.begin(), node->identifier.end());
+            identifier_offsets[i + 1] = identifier_data.size();
+            for (size_t level = 0; level < node->clade_annotations.size(); level++) {
+                const std::string &clade = node->clade_annotations[level];
+                if (clade.empty()) {
+                    continue;
+                }
+                auto id = clade_ids.emplace(clade, (uint32_t)clades.size());
+                if (id.second) {
+                    clades.push_back(clade);
+                }
+                annotations.push_back({(uint32_t)i, (uint32_t)level, id.first->second});
+            }
+        }
+        by_name.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            by_name[i] = i;
+        }
+        std::sort(by_name.begin(), by_name.end(), [this](uint32_t a, uint32_t b) {
+            return identifier_view(a) < identifier_view(b);
+        });
+    }
+
+    inline size_t size() const {
+        return parent.size();
+    }
+
+    inline bool is_leaf(size_t i) const {
+        return subtree_end[i] == i + 1;
+    }
+
+    inline std::string identifier(size_t i) const {
+        return std::string(identifier_view(i));
+    }
+
+    // The preorder index of the node with the indicated identifier, or -1 if there is none.
+    int64_t find(const std::string &identifier) const {
+        std::string_view target(identifier);
+        auto it = std::lower_bound(by_name.begin(), by_name.end(), target, [this](uint32_t a, const std::string_view &b) {
+            return identifier_view(a) < b;
+        });
+        if (it == by_name.end() || identifier_view(*it) != target) {
+            return -1;
+        }
+        return *it;
+    }
+
+    size_t count_leaves(size_t subroot) const {
+        size_t count = 0;
+        for (size_t i = subroot; i < subtree_end[subroot]; i++) {
+            count += is_leaf(i);
+        }
+        return count;
+    }
+
+    std::vector<uint32_t> leaves(size_t subroot) const {
+        std::vector<uint32_t> result;
+        for (size_t i = subroot; i < subtree_end[subroot]; i++) {
+            if (is_leaf(i)) {
+                result.push_back(i);
+            }
+        }
+        return result;
+    }
+
+    // The nodes of the subtree in breadth-first order. The children of a node are found by skipping over the subtree of each child.
+    std::vector<uint32_t> breadth_first(size_t subroot) const {
+        std::vector<uint32_t> result;
+        result.reserve(subtree_end[subroot] - subroot);
+        result.push_back(subroot);
+        for (size_t k = 0; k < result.size(); k++) {
+            uint32_t node = result[k];
+            for (uint32_t child = node + 1; child < subtree_end[node]; child = subtree_end[child]) {
+                result.push_back(child);
+            }
+        }
+        return result;
+    }
+
+    // The mutations of the node relative to the reference, sorted by chromosome and position.
+    // Matches get_node_haplotype on the tree the view was built from.
+    std::vector<PackedMutation> haplotype(size_t node) const {
+        std::vector<uint32_t> ancestry;
+        for (int64_t a = node; a >= 0; a = parent[a]) {
+            ancestry.push_back(a);
+        }
+        SiteState state;
+        for (auto it = ancestry.rbegin(); it != ancestry.rend(); it++) {
+            apply(state, *it);
+        }
+        return state.haplotype();
+    }
+
+    std::vector<std::vector<PackedMutation>> haplotypes(const std::vector<uint32_t> &nodes) const {
+        std::vector<std::vector<PackedMutation>> result(nodes.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, nodes.size()), [&](const tbb::blocked_range<size_t> &r) {
+            for (size_t k = r.begin(); k < r.end(); k++) {
+                result[k] = haplotype(nodes[k]);
+            }
+        });
+        return result;
+    }
+
+    // The unique haplotypes of the leaves below subroot and the number of leaves carrying each, in order of first appearance.
+    // Matches count_haplotypes_dfs on the tree the view was built from.
+    std::vector<std::pair<std::vector<PackedMutation>,size_t>> count_haplotypes(size_t subroot) const {
+        std::vector<std::pair<std::vector<PackedMutation>,size_t>> result;
+        std::unordered_map<std::pair<uint64_t,uint64_t>, size_t, PairHash> index;
+        SiteState state;
+        std::vector<uint32_t> ancestry;
+        for (int64_t a = parent[subroot]; a >= 0; a = parent[a]) {
+            ancestry.push_back(a);
+        }
+        for (auto it = ancestry.rbegin(); it != ancestry.rend(); it++) {
+            apply(state, *it);
+        }
+        size_t base = state.depth();
+        for (size_t i = subroot; i < subtree_end[subroot]; i++) {
+            while (state.depth() > base && state.top() != (uint32_t)parent[i]) {
+                state.undo();
+            }
+            apply(state, i);
+            if (!is_leaf(i)) {
+                continue;
+            }
+            auto it = index.find(state.hash());
+            if (it == index.end()) {
+                index.emplace(state.hash(), result.size());
+                result.emplace_back(state.haplotype(), 1);
+            } else {
+                result[it->second].second++;
+            }
+        }
+        return result;
+    }
+
+    // Counts of mutations below and including subroot, indexed by par_nuc * 16 + mut_nuc.
+    std::vector<int64_t> mutation_spectrum(size_t subroot) const {
+        std::vector<int64_t> spectrum(256, 0);
+        for (size_t k = mutation_offsets[subroot]; k < mutation_offsets[subtree_end[subroot]]; k++) {
+            spectrum[mutations[k].alleles]++;
+        }
+        return spectrum;
+    }
+
+    // Compute the entropy of num_categories.size() traits on the subtree below subroot, as trait_entropy does on a tree.
+    // The rows of the result follow the preorder of the view from subroot; nodes is left empty.
+    TraitEntropy trait_entropy(size_t subroot, const std::vector<uint32_t> &leaf_nodes, const std::vector<int32_t> &categories, const std::vector<size_t> &num_categories) const {
+        TraitEntropy result;
+        if (categories.size() != leaf_nodes.size() * num_categories.size()) {
+            throw std::invalid_argument("Category array does not match the number of leaves and traits.");
+        }
+        size_t n = subtree_end[subroot] - subroot;
+        std::vector<int64_t> parents(n, -1);
+        std::vector<uint8_t> leaf(n);
+        std::vector<int64_t> rows(n, -1);
+        for (size_t i = 0; i < n; i++) {
+            if (i > 0) {
+                parents[i] = parent[subroot + i] - subroot;
+            }
+            leaf[i] = is_leaf(subroot + i);
+        }
+        for (size_t l = 0; l < leaf_nodes.size(); l++) {
+            if (leaf_nodes[l] >= subroot && leaf_nodes[l] < subroot + n) {
+                rows[leaf_nodes[l] - subroot] = l;
+            }
+        }
+        trait_entropy_preorder(parents, leaf, rows, categories, num_categories, result);
+        return result;
+    }
+
+    // Expand a packed mutation, for formatting.
+    MAT::Mutation unpack(const PackedMutation &packed) const {
+        MAT::Mutation m;
+        m.chrom = chromosomes.empty() ? "" : chromosomes[packed.chrom];
+        m.position = packed.position;
+        m.ref_nuc = packed.ref_nuc();
+        m.par_nuc = packed.par_nuc();
+        m.mut_nuc = packed.mut_nuc();
+        m.is_missing = packed.is_missing();
+        return m;
+    }
+
+    // Bytes allocated by the view.
+    size_t memory_usage() const {
+        size_t bytes = sizeof(FrozenTree);
+        bytes += parent.capacity() * sizeof(int32_t) + subtree_end.capacity() * sizeof(uint32_t) + branch_length.capacity() * sizeof(float);
+        bytes += mutation_offsets.capacity() * sizeof(uint64_t) + mutations.capacity() * sizeof(PackedMutation);
+        bytes += identifier_offsets.capacity() * sizeof(uint64_t) + identifier_data.capacity() + by_name.capacity() * sizeof(uint32_t);
+        bytes += annotations.capacity() * sizeof(FrozenAnnotation);
+        for (auto &s: chromosomes) {
+            bytes += sizeof(std::string) + s.capacity();
+        }
+        for (auto &s: clades) {
+            bytes += sizeof(std::string) + s.capacity();
+        }
+        return bytes;
+    }
+
+  private:
+    // node indices sorted by identifier
+    std::vector<uint32_t> by_name;
+
+    inline std::string_view identifier_view(size_t i) const {
+        return std::string_view(identifier_data.data() + identifier_offsets[i], identifier_offsets[i + 1] - identifier_offsets[i]);
+    }
+
+    typedef HaplotypeState<uint32_t, PackedMutation> SiteState;
+
+    void apply(SiteState &state, uint32_t node) const {
+        state.push(node);
+        for (size_t k = mutation_offsets[node]; k < mutation_offsets[node + 1]; k++) {
+            const PackedMutation &m = mutations[k];
+            state.apply(((uint64_t)m.chrom << 32) | (uint32_t)m.position, m);
+        }
+    }
+};
@@ -0,0 +1,343 @@
+/*single-pass haplotype engine used by get_haplotype, count_haplotypes and compute_nucleotide_diversity, and by the frozen view (frozen.cpp).
+Instead of running an rsearch to the root for every leaf and folding each ancestor's mutations into a set,
+the tree is walked once in depth-first order and the haplotype of the current node is kept up to date
+by applying each node's mutations on the way down and undoing them on the way back up.
+Identical haplotypes are recognized through a pair of order-independent rolling hashes, so they never have to be compared directly.*/
+#pragma once
+#include "usher/src/usher_graph.hpp"
+
+// How HaplotypeState reads a mutation. Specialized here for tree mutations and in frozen.cpp for the packed mutations of a FrozenTree.
+template <class Mutation> struct MutationTraits;
+
+template <> struct MutationTraits<MAT::Mutation> {
+    static inline int8_t par_nuc(const MAT::Mutation &m) { return m.par_nuc; }
+    static inline int8_t mut_nuc(const MAT::Mutation &m) { return m.mut_nuc; }
+
+    // A later mutation at a site, keeping the parent allele of the earlier one.
+    static inline MAT::Mutation stack(const MAT::Mutation &earlier, const MAT::Mutation &later) {
+        MAT::Mutation m = later;
+        m.par_nuc = earlier.par_nuc;
+        return m;
+    }
+
+    static inline bool site_before(const MAT::Mutation &a, const MAT::Mutation &b) {
+        return (a.chrom < b.chrom) || (a.chrom == b.chrom && a.position < b.position);
+    }
+};
+
+/*The haplotype at the end of a path from the root, as the mutation at each site relative to the reference. Nodes are pushed
+and their mutations applied on the way down, and undone on the way back up. Sites are identified by a key combining the
+chromosome and position, and the pair of rolling hashes of the haplotype is kept up to date as sites change.*/
+template <class NodeRef, class Mutation, class Traits = MutationTraits<Mutation>>
+class HaplotypeState {
+  public:
+    void clear() {
+        state.clear();
+        undo_log.clear();
+        path.clear();
+        hash_a = 0;
+        hash_b = 0;
+    }
+
+    // Start a node below the current one; the mutations applied until the next push belong to it.
+    void push(NodeRef node) {
+        path.emplace_back(node, undo_log.size());
+    }
+
+    void apply(uint64_t key, const Mutation &m) {
+        auto it = state.find(key);
+        if (it == state.end()) {
+            undo_log.push_back({key, false, Mutation()});
+            state.emplace(key, m);
+            add_hash(key, m, 1);
+        } else {
+            undo_log.push_back({key, true, it->second});
+            add_hash(key, it->second, -1);
+            if (Traits::mut_nuc(m) == Traits::par_nuc(it->second)) {
+                // a reversion to the state of the reference; the site drops out of the haplotype.
+                state.erase(it);
+            } else {
+                it->second = Traits::stack(it->second, m);
+                add_hash(key, it->second, 1);
+            }
+        }
+    }
+
+    // Revert the most recently pushed node.
+    void undo() {
+        size_t stop = path.back().second;
+        path.pop_back();
+        while (undo_log.size() > stop) {
+            Undo &u = undo_log.back();
+            auto it = state.find(u.key);
+            if (it != state.end()) {
+                add_hash(u.key, it->second, -1);
+                state.erase(it);
+            }
+            if (u.existed) {
+                state.emplace(u.key, u.previous);
+                add_hash(u.key, u.previous, 1);
+            }
+            undo_log.pop_back();
+        }
+    }
+
+    inline size_t depth() const {
+        return path.size();
+    }
+
+    inline NodeRef top() const {
+        return path.back().first;
+    }
+
+    inline std::pair<uint64_t,uint64_t> hash() const {
+        return std::make_pair(hash_a, hash_b);
+    }
+
+    // The current haplotype, sorted by chromosome and position.
+    std::vector<Mutation> haplotype() const {
+        std::vector<Mutation> result;
+        result.reserve(state.size());
+        for (auto &kv: state) {
+            result.push_back(kv.second);
+        }
+        std::sort(result.begin(), result.end(), Traits::site_before);
+        return result;
+    }
+
+  private:
+    struct Undo {
+        uint64_t key;
+        bool existed;
+        Mutation previous;
+    };
+    std::unordered_map<uint64_t, Mutation> state;
+    std::vector<Undo> undo_log;
+    std::vector<std::pair<NodeRef, size_t>> path;
+    uint64_t hash_a = 0;
+    uint64_t hash_b = 0;
+
+    static inline uint64_t mix(uint64_t x) {
+        // splitmix64 finalizer
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    // The hash of a haplotype is the sum of the hashes of its sites, so sites can be added and removed in any order.
+    inline void add_hash(uint64_t key, const Mutation &m, int sign) {
+        uint64_t alleles = ((uint64_t)(uint8_t)Traits::par_nuc(m) << 8) | (uint8_t)Traits::mut_nuc(m);
+        uint64_t ha = mix(key ^ mix(alleles));
+        uint64_t hb = mix(ha ^ 0x2545f4914f6cdd1dULL ^ (alleles << 40));
+        if (sign > 0) {
+            hash_a += ha;
+            hash_b += hb;
+        } else {
+            hash_a -= ha;
+            hash_b -= hb;
+        }
+    }
+};
+
+struct PairHash {
+    inline size_t operator()(const std::pair<uint64_t,uint64_t> &p) const {
+        return p.first ^ (p.second * 0x9e3779b97f4a7c15ULL);
+    }
+};
+
+// HaplotypeState over the nodes of a tree, with chromosome names numbered as they are first seen.
+class HaplotypeTracker {
+  public:
+    // Discard the current state and apply every mutation from the root down to and including the indicated node.
+    // Passing a null pointer resets to the reference.
+    void seed(const MAT::Node* node) {
+        state.clear();
+        std::vector<const MAT::Node*> ancestry;
+        while (node != NULL) {
+            ancestry.push_back(node);
+            node = node->parent;
+        }
+        for (auto it = ancestry.rbegin(); it != ancestry.rend(); it++) {
+            apply(*it);
+        }
+    }
+
+    // Move to a node which is next in a depth-first (preorder) traversal.
+    // Everything applied since the node's parent is undone before the node's own mutations are applied.
+    void advance_to(const MAT::Node* node) {
+        while (state.depth() > 0 && state.top() != node->parent) {
+            state.undo();
+        }
+        apply(node);
+    }
+
+    void apply(const MAT::Node* node) {
+        state.push(node);
+        for (auto &m: node->mutations) {
+            state.apply(site_key(m), m);
+        }
+    }
+
+    // Revert the most recently applied node.
+    void undo() {
+        state.undo();
+    }
+
+    inline std::pair<uint64_t,uint64_t> hash() const {
+        return state.hash();
+    }
+
+    // The current haplotype, sorted by chromosome and position.
+    std::vector<MAT::Mutation> haplotype() const {
+        return state.haplotype();
+    }
+
+  private:
+    HaplotypeState<const MAT::Node*, MAT::Mutation> state;
+    std::unordered_map<std::string, uint32_t> chrom_ids;
+
+    inline uint64_t site_key(const MAT::Mutation &m) {
+        auto it = chrom_ids.find(m.chrom);
+        if (it == chrom_ids.end()) {
+            it = chrom_ids.emplace(m.chrom, (uint32_t)chrom_ids.size()).first;
+        }
+        return ((uint64_t)it->second << 32) | (uint32_t)m.position;
+    }
+};
+
+// Return the haplotype of a single node with respect to the reference, sorted by position.
+std::vector<MAT::Mutation> get_node_haplotype(MAT::Node* node) {
+    HaplotypeTracker tracker;
+    tracker.seed(node);
+    return tracker.haplotype();
+}
+
+// Return the haplotypes of many nodes at once, in the order requested, with a single traversal of the tree.
+std::vector<std::vector<MAT::Mutation>> get_node_haplotypes(MAT::Tree* T, std::vector<MAT::Node*> nodes) {
+    std::vector<std::vector<MAT::Mutation>> result(nodes.size());
+    std::unordered_map<const MAT::Node*, std::vector<size_t>> requested;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        requested[nodes[i]].push_back(i);
+    }
+    HaplotypeTracker tracker;
+    for (auto node: T->depth_first_expansion(T->root)) {
+        tracker.advance_to(node);
+        auto it = requested.find(node);
+        if (it != requested.end()) {
+            std::vector<MAT::Mutation> haplotype = tracker.haplotype();
+            for (auto i: it->second) {
+                result[i] = haplotype;
+            }
+        }
+    }
+    return result;
+}
+
+// Count the unique haplotypes among the leaves descended from the indicated node.
+// Each haplotype is returned once, sorted by position, with the number of leaves that carry it.
+std::vector<std::pair<std::vector<MAT::Mutation>,size_t>> count_haplotypes_dfs(MAT::Tree* T, MAT::Node* subroot) {
+    std::vector<std::pair<std::vector<MAT::Mutation>,size_t>> haplotypes;
+    if (subroot == NULL) {
+        return haplotypes;
+    }
+    std::unordered_map<std::pair<uint64_t,uint64_t>, size_t, PairHash> index;
+    HaplotypeTracker tracker;
+    tracker.seed(subroot->parent);
+    for (auto node: T->depth_first_expansion(subroot)) {
+        tracker.advance_to(node);
+        if (!node->is_leaf()) {
+            continue;
+        }
+        auto it = index.find(tracker.hash());
+        if (it == index.end()) {
+            index.emplace(tracker.hash(), haplotypes.size());
+            haplotypes.emplace_back(tracker.haplotype(), 1);
+        } else {
+            haplotypes[it->second].second++;
+        }
+    }
+    return haplotypes;
+}
+
+// Count the number of sites at which two position-sorted haplotypes differ.
+// A site carried by only one haplotype, or by both with different alleles, counts once.
+size_t count_haplotype_differences(const std::vector<MAT::Mutation> &h1, const std::vector<MAT::Mutation> &h2) {
+    size_t differences = 0;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < h1.size() && j < h2.size()) {
+        int order = h1[i].chrom.compare(h2[j].chrom);
+        if (order == 0) {
+            order = (h1[i].position > h2[j].position) - (h1[i].position < h2[j].position);
+        }
+        if (order < 0) {
+            differences++;
+            i++;
+        } else if (order > 0) {
+            differences++;
+            j++;
+        } else {
+            if (h1[i].mut_nuc != h2[j].mut_nuc) {
+                differences++;
+            }
+            i++;
+            j++;
+        }
+    }
+    return differences + (h1.size() - i) + (h2.size() - j);
+}
+
+// Nucleotide diversity of the subtree below each node, computed from branch mutation counts in a single postorder pass.
+// Under the infinite sites assumption, each mutation on a branch separates the n leaves below the branch from the N-n other leaves,
+// so the sum of pairwise differences in a subtree with N leaves is the sum of m*n*(N-n) over its branches.
+// The sums of m*n and m*n*n below each node are accumulated so that the diversity of every subtree is available from the same pass.
+// Returns each node with at least two leaves below it, in preorder, along with the mean pairwise differences among those leaves.
+struct NodeDiversity {
+    MAT::Node* node;
+    double diversity;
+};
+
+std::vector<NodeDiversity> branch_nucleotide_diversity(MAT::Tree* T, MAT::Node* subroot) {
+    std::vector<NodeDiversity> diversity;
+    if (subroot == NULL) {
+        return diversity;
+    }
+    std::vector<MAT::Node*> dfs = T->depth_first_expansion(subroot);
+    std::unordered_map<const MAT::Node*, size_t> index;
+    index.reserve(dfs.size());
+    for (size_t i = 0; i < dfs.size(); i++) {
+        index.emplace(dfs[i], i);
+    }
+    std::vector<double> leaves(dfs.size(), 0.0);
+    std::vector<double> sum_mn(dfs.size(), 0.0);
+    std::vector<double> sum_mnn(dfs.size(), 0.0);
+    for (size_t i = dfs.size(); i-- > 0;) {
+        MAT::Node* node = dfs[i];
+        if (node->is_leaf()) {
+            leaves[i] = 1.0;
+        }
+        if (i == 0) {
+            continue;
+        }
+        size_t p = index[node->parent];
+        double m = 0.0;
+        for (auto &mut: node->mutations) {
+            if (!mut.is_masked()) {
+                m += 1.0;
+            }
+        }
+        leaves[p] += leaves[i];
+        sum_mn[p] += sum_mn[i] + m * leaves[i];
+        sum_mnn[p] += sum_mnn[i] + m * leaves[i] * leaves[i];
+    }
+    for (size_t i = 0; i < dfs.size(); i++) {
+        double n = leaves[i];
+        if (n < 2) {
+            continue;
+        }
+        double pairwise = n * sum_mn[i] - sum_mnn[i];
+        diversity.push_back({dfs[i], pairwise / (n * (n - 1) / 2)});
+    }
+    return diversity;
+}
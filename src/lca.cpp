@@ -0,0 +1,335 @@
+/*constant time last common ancestor queries.
+Nodes are numbered in preorder, so for two distinct nodes u and v with u before v, their last common ancestor is the parent of the
+shallowest node among positions u+1 up to v. That range minimum is answered from a sparse table of the shallowest node in every range
+of power of two length, which takes O(n log n) to build and two lookups per query.
+The distance from the root along branch lengths and in number of mutations is stored for each node, so the distance between two nodes
+follows from their last common ancestor. Pairwise distance matrices over sets of samples are filled from these in parallel, and nearest
+neighbours are found by a best-first search outward from each query node, which stops once the next node to visit is further than the
+k-th leaf found.*/
+#pragma once
+#include "usher/src/usher_graph.hpp"
+#include "arrays.cpp"
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <algorithm>
+#include <queue>
+
+struct NodeDistance {
+    MAT::Node* lca;
+    double branch_length;
+    int64_t mutations;
+};
+
+// Pairs of samples within a distance threshold, as indices into the input list with row < col, sorted by row then column.
+struct DistancePairs {
+    std::vector<uint32_t> row;
+    std::vector<uint32_t> col;
+    std::vector<int32_t> mutations;
+    std::vector<double> branch_length;
+};
+
+// The nearest leaves to each query, stored contiguously; those of query i are entries offsets[i] up to offsets[i+1].
+struct Neighbors {
+    std::vector<uint64_t> offsets;
+    std::vector<MAT::Node*> nodes;
+    std::vector<int64_t> mutations;
+};
+
+class LCAIndex {
+  public:
+    LCAIndex(MAT::Tree* T) {
+        nodes = T->depth_first_expansion(T->root);
+        size_t n = nodes.size();
+        parent = preorder_parents(nodes);
+        index = preorder_positions(nodes);
+        depth.assign(n, 0);
+        root_distance.assign(n, 0.0);
+        root_mutations.assign(n, 0);
+        for (size_t i = 1; i < n; i++) {
+            depth[i] = depth[parent[i]] + 1;
+            root_distance[i] = root_distance[parent[i]] + std::max(nodes[i]->branch_length, 0.0f);
+            root_mutations[i] = root_mutations[parent[i]] + nodes[i]->mutations.size();
+        }
+        // level k holds the shallowest node among positions i up to i+2^k-1
+        table.emplace_back(n);
+        for (size_t i = 0; i < n; i++) {
+            table[0][i] = (uint32_t)i;
+        }
+        for (size_t k = 1; ((size_t)1 << k) <= n; k++) {
+            size_t half = (size_t)1 << (k - 1);
+            const std::vector<uint32_t> &previous = table[k - 1];
+            std::vector<uint32_t> level(n - (half << 1) + 1);
+            for (size_t i = 0; i < level.size(); i++) {
+                level[i] = shallowest(previous[i], previous[i + half]);
+            }
+            table.push_back(std::move(level));
+        }
+    }
+
+    // The preorder position of a node, or -1 if it was not in the tree when the index was built.
+    int64_t position(const MAT::Node* node) const {
+        auto it = index.find(node);
+        return (it == index.end()) ? -1 : (int64_t)it->second;
+    }
+
+    size_t lca_position(size_t u, size_t v) const {
+        if (u == v) {
+            return u;
+        }
+        if (u > v) {
+            std::swap(u, v);
+        }
+        size_t k = 63 - __builtin_clzll(v - u);
+        return parent[shallowest(table[k][u + 1], table[k][v + 1 - ((size_t)1 << k)])];
+    }
+
+    MAT::Node* lca(const MAT::Node* a, const MAT::Node* b) const {
+        return nodes[lca_position(checked_position(a), checked_position(b))];
+    }
+
+    // The last common ancestor of a group is that of its first and last members in preorder.
+    MAT::Node* group_lca(const std::vector<MAT::Node*> &group) const {
+        if (group.empty()) {
+            throw std::invalid_argument("Cannot find the last common ancestor of an empty group.");
+        }
+        size_t first = checked_position(group[0]);
+        size_t last = first;
+        for (auto node: group) {
+            size_t p = checked_position(node);
+            first = std::min(first, p);
+            last = std::max(last, p);
+        }
+        return nodes[lca_position(first, last)];
+    }
+
+    NodeDistance distance(const MAT::Node* a, const MAT::Node* b) const {
+        size_t u = checked_position(a);
+        size_t v = checked_position(b);
+        size_t w = lca_position(u, v);
+        return {nodes[w], root_distance[u] + root_distance[v] - 2 * root_distance[w], root_mutations[u] + root_mutations[v] - 2 * root_mutations[w]};
+    }
+
+    // Answer many pairwise queries at once; large batches are split across threads, as the index is read only.
+    std::vector<NodeDistance> distances(const std::vector<MAT::Node*> &a, const std::vector<MAT::Node*> &b) const {
+        if (a.size() != b.size()) {
+            throw std::invalid_argument("Node lists for pairwise queries must be the same length.");
+        }
+        for (size_t i = 0; i < a.size(); i++) {
+            checked_position(a[i]);
+            checked_position(b[i]);
+        }
+        std::vector<NodeDistance> result(a.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, a.size(), 4096), [&](const tbb::blocked_range<size_t> &r) {
+            for (size_t i = r.begin(); i < r.end(); i++) {
+                result[i] = distance(a[i], b[i]);
+            }
+        });
+        return result;
+    }
+
+    std::vector<MAT::Node*> group_lcas(const std::vector<std::vector<MAT::Node*>> &groups) const {
+        std::vector<MAT::Node*> result(groups.size());
+        for (size_t i = 0; i < groups.size(); i++) {
+            result[i] = group_lca(groups[i]);
+        }
+        return result;
+    }
+
+    // Row-major matrix of the number of mutations on the path between each pair of the input nodes.
+    std::vector<int32_t> mutation_matrix(const std::vector<MAT::Node*> &samples) const {
+        return pairwise_matrix<int32_t>(samples, root_mutations);
+    }
+
+    // Row-major matrix of the sum of branch lengths on the path between each pair of the input nodes.
+    std::vector<double> branch_length_matrix(const std::vector<MAT::Node*> &samples) const {
+        return pairwise_matrix<double>(samples, root_distance);
+    }
+
+    /*Find all pairs of the input nodes at most max_distance apart, in mutations or along branch lengths. A path between two nodes is
+    at least as long as the difference in their distances from the root, so only pairs whose root distances are that close are
+    checked.*/
+    DistancePairs pairs_within(const std::vector<MAT::Node*> &samples, double max_distance, bool by_branch_length) const {
+        std::vector<size_t> positions = checked_positions(samples);
+        std::vector<double> key(samples.size());
+        for (size_t i = 0; i < samples.size(); i++) {
+            key[i] = by_branch_length ? root_distance[positions[i]] : (double)root_mutations[positions[i]];
+        }
+        std::vector<uint32_t> order(samples.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = (uint32_t)i;
+        }
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return key[a] < key[b];
+        });
+        // each pair is stored with its distances as it is found, so only the merge below is serial.
+        struct Pair {
+            uint32_t row;
+            uint32_t col;
+            int32_t mutations;
+            double branch_length;
+        };
+        std::vector<std::vector<Pair>> found(order.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, order.size(), 64), [&](const tbb::blocked_range<size_t> &r) {
+            for (size_t a = r.begin(); a < r.end(); a++) {
+                size_t u = positions[order[a]];
+                for (size_t b = a + 1; b < order.size() && key[order[b]] - key[order[a]] <= max_distance; b++) {
+                    size_t v = positions[order[b]];
+                    size_t w = lca_position(u, v);
+                    int64_t mutations = root_mutations[u] + root_mutations[v] - 2 * root_mutations[w];
+                    double branch_length = root_distance[u] + root_distance[v] - 2 * root_distance[w];
+                    if ((by_branch_length ? branch_length : (double)mutations) <= max_distance) {
+                        found[a].push_back({std::min(order[a], order[b]), std::max(order[a], order[b]), (int32_t)mutations, branch_length});
+                    }
+                }
+            }
+        });
+        // bucket the pairs by row, then sort each row by column.
+        std::vector<size_t> row_offsets(samples.size() + 1, 0);
+        for (auto &f: found) {
+            for (auto &p: f) {
+                row_offsets[p.row + 1]++;
+            }
+        }
+        for (size_t r = 0; r < samples.size(); r++) {
+            row_offsets[r + 1] += row_offsets[r];
+        }
+        std::vector<Pair> pairs(row_offsets.back());
+        std::vector<size_t> next(row_offsets.begin(), row_offsets.end() - 1);
+        for (auto &f: found) {
+            for (auto &p: f) {
+                pairs[next[p.row]++] = p;
+            }
+            std::vector<Pair>().swap(f);
+        }
+        DistancePairs result;
+        result.row.resize(pairs.size());
+        result.col.resize(pairs.size());
+        result.mutations.resize(pairs.size());
+        result.branch_length.resize(pairs.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, samples.size(), 64), [&](const tbb::blocked_range<size_t> &r) {
+            for (size_t row = r.begin(); row < r.end(); row++) {
+                std::sort(pairs.begin() + row_offsets[row], pairs.begin() + row_offsets[row + 1], [](const Pair &a, const Pair &b) {
+                    return a.col < b.col;
+                });
+                for (size_t k = row_offsets[row]; k < row_offsets[row + 1]; k++) {
+                    result.row[k] = pairs[k].row;
+                    result.col[k] = pairs[k].col;
+                    result.mutations[k] = pairs[k].mutations;
+                    result.branch_length[k] = pairs[k].branch_length;
+                }
+            }
+        });
+        return result;
+    }
+
+    /*Find the k leaves closest to each query node in number of mutations, excluding the query itself. Nodes are visited in order of
+    their distance from the query, moving both up and down the tree, so leaves are found nearest first and the search ends as soon
+    as k have been found. Ties are broken by preorder position. A negative max_mutations means no limit on distance.*/
+    Neighbors nearest_leaves(const std::vector<MAT::Node*> &queries, size_t k, int64_t max_mutations) const {
+        checked_positions(queries);
+        std::vector<std::vector<std::pair<MAT::Node*, int64_t>>> found(queries.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, queries.size(), 16), [&](const tbb::blocked_range<size_t> &r) {
+            for (size_t i = r.begin(); i < r.end(); i++) {
+                found[i] = search_leaves(queries[i], k, max_mutations);
+            }
+        });
+        Neighbors result;
+        result.offsets.reserve(queries.size() + 1);
+        result.offsets.push_back(0);
+        for (auto &f: found) {
+            for (auto &n: f) {
+                result.nodes.push_back(n.first);
+                result.mutations.push_back(n.second);
+            }
+            result.offsets.push_back(result.nodes.size());
+        }
+        return result;
+    }
+
+  private:
+    std::vector<MAT::Node*> nodes;
+    std::vector<int64_t> parent;
+    std::vector<uint32_t> depth;
+    std::vector<double> root_distance;
+    std::vector<int64_t> root_mutations;
+    std::unordered_map<const MAT::Node*, size_t> index;
+    std::vector<std::vector<uint32_t>> table;
+
+    inline uint32_t shallowest(uint32_t a, uint32_t b) const {
+        return (depth[b] < depth[a]) ? b : a;
+    }
+
+    size_t checked_position(const MAT::Node* node) const {
+        int64_t p = position(node);
+        if (p < 0) {
+            throw std::invalid_argument("Node is not part of the indexed tree.");
+        }
+        return (size_t)p;
+    }
+
+    std::vector<size_t> checked_positions(const std::vector<MAT::Node*> &samples) const {
+        std::vector<size_t> positions(samples.size());
+        for (size_t i = 0; i < samples.size(); i++) {
+            positions[i] = checked_position(samples[i]);
+        }
+        return positions;
+    }
+
+    // The matrix is symmetric, so each row fills its entries right of the diagonal and mirrors them below it.
+    template <class Value, class Root> std::vector<Value> pairwise_matrix(const std::vector<MAT::Node*> &samples, const std::vector<Root> &from_root) const {
+        std::vector<size_t> positions = checked_positions(samples);
+        size_t n = samples.size();
+        std::vector<Value> matrix(n * n, 0);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, n, 16), [&](const tbb::blocked_range<size_t> &r) {
+            for (size_t i = r.begin(); i < r.end(); i++) {
+                size_t u = positions[i];
+                for (size_t j = i + 1; j < n; j++) {
+                    size_t v = positions[j];
+                    size_t w = lca_position(u, v);
+                    Value d = (Value)(from_root[u] + from_root[v] - 2 * from_root[w]);
+                    matrix[i * n + j] = d;
+                    matrix[j * n + i] = d;
+                }
+            }
+        });
+        return matrix;
+    }
+
+    struct SearchEntry {
+        int64_t mutations;
+        size_t position;
+        MAT::Node* node;
+        MAT::Node* from;
+        bool operator>(const SearchEntry &other) const {
+            return (mutations != other.mutations) ? mutations > other.mutations : position > other.position;
+        }
+    };
+
+    std::vector<std::pair<MAT::Node*, int64_t>> search_leaves(MAT::Node* query, size_t k, int64_t max_mutations) const {
+        std::vector<std::pair<MAT::Node*, int64_t>> leaves;
+        std::priority_queue<SearchEntry, std::vector<SearchEntry>, std::greater<SearchEntry>> frontier;
+        frontier.push({0, checked_position(query), query, NULL});
+        while (!frontier.empty() && leaves.size() < k) {
+            SearchEntry current = frontier.top();
+            frontier.pop();
+            if (current.node->is_leaf() && current.node != query) {
+                leaves.emplace_back(current.node, current.mutations);
+                continue;
+            }
+            // the tree has no cycles, so skipping the node we arrived from is enough to never visit a node twice.
+            auto visit = [&](MAT::Node* next, size_t branch_mutations) {
+                int64_t d = current.mutations + (int64_t)branch_mutations;
+                if (next != current.from && (max_mutations < 0 || d <= max_mutations)) {
+                    frontier.push({d, checked_position(next), next, current.node});
+                }
+            };
+            if (current.node->parent != NULL) {
+                visit(current.node->parent, current.node->mutations.size());
+            }
+            for (auto child: current.node->children) {
+                visit(child, child->mutations.size());
+            }
+        }
+        return leaves;
+    }
+};
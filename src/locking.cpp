@@ -0,0 +1,113 @@
+/*reader/writer lock for a tree shared between threads. Methods which only read the tree hold the lock in shared mode, so any
+number of them run at once, while methods which change the tree hold it exclusively. The lock is reentrant per thread: a method
+may call other methods of the same tree while holding it, and reads nested inside a write are allowed, but a thread holding the
+lock for reading cannot start a write, since it would wait on itself. Indexes built over the tree on first use by a reader are
+created under a separate mutex, so concurrent readers build each index once and then share it until a writer discards it.
+The lock must always be acquired without holding the Python GIL, since a thread holding it may need the GIL to finish.*/
+#pragma once
+#include "usher/src/usher_graph.hpp"
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <vector>
+
+class TreeLock {
+  public:
+    void lock_shared() {
+        Held* h = held_by_thread();
+        if (h != NULL) {
+            h->shared++;
+            return;
+        }
+        mutex.lock_shared();
+        held().push_back({this, 1, 0, false});
+    }
+
+    void unlock_shared() {
+        Held* h = held_by_thread();
+        if (h == NULL || h->shared == 0) {
+            return;
+        }
+        h->shared--;
+        release(h);
+    }
+
+    void lock() {
+        Held* h = held_by_thread();
+        if (h != NULL && !h->writing) {
+            throw std::logic_error("The tree cannot be changed while this thread is reading it.");
+        }
+        if (h != NULL) {
+            h->exclusive++;
+            return;
+        }
+        mutex.lock();
+        held().push_back({this, 0, 1, true});
+    }
+
+    void unlock() {
+        Held* h = held_by_thread();
+        if (h == NULL || h->exclusive == 0) {
+            return;
+        }
+        h->exclusive--;
+        release(h);
+    }
+
+    // Return the index over the tree, building it first if no thread has yet. Callers must hold the lock in either mode.
+    template <class Index> Index* lazy_index(std::shared_ptr<Index> &index, MAT::Tree* T) {
+        std::lock_guard<std::mutex> guard(lazy_mutex);
+        if (!index) {
+            index = std::make_shared<Index>(T);
+        }
+        return index.get();
+    }
+
+    // Return the index over the tree if one has been built, or a null pointer.
+    template <class Index> Index* current_index(std::shared_ptr<Index> &index) {
+        std::lock_guard<std::mutex> guard(lazy_mutex);
+        return index.get();
+    }
+
+  private:
+    struct Held {
+        const TreeLock* lock;
+        size_t shared;
+        size_t exclusive;
+        // whether the underlying mutex is held exclusively
+        bool writing;
+    };
+    std::shared_mutex mutex;
+    std::mutex lazy_mutex;
+
+    // the locks held by the current thread, with the number of nested sections in each mode
+    static std::vector<Held>& held() {
+        static thread_local std::vector<Held> locks;
+        return locks;
+    }
+
+    Held* held_by_thread() {
+        for (auto &h: held()) {
+            if (h.lock == this) {
+                return &h;
+            }
+        }
+        return NULL;
+    }
+
+    // Unlock once the outermost section has ended, in the mode the lock was first taken in.
+    void release(Held* h) {
+        if (h->shared > 0 || h->exclusive > 0) {
+            return;
+        }
+        bool writing = h->writing;
+        auto &locks = held();
+        locks.erase(locks.begin() + (h - locks.data()));
+        if (writing) {
+            mutex.unlock();
+        } else {
+            mutex.unlock_shared();
+        }
+    }
+};
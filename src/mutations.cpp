@@ -0,0 +1,203 @@
+/*inverted index from mutations to the nodes which carry them.
+Every mutation on the tree is recorded once, sorted by chromosome, position and alternative allele, along with the preorder range of
+the carrying node's subtree and the range of its leaves in the preorder leaf list (see clades.cpp). Because a later mutation at the
+same site overrides an earlier one for the leaves below it, each record also stores how many leaves below its node still carry its
+allele. Queries by site, allele or genomic range are binary searches over the records, and none of them traverse the tree.*/
+#pragma once
+#include "usher/src/usher_graph.hpp"
+#include "arrays.cpp"
+
+struct MutationRecord {
+    int16_t chrom;
+    int8_t par_nuc;
+    int8_t mut_nuc;
+    int8_t ref_nuc;
+    int32_t position;
+    MAT::Node* node;
+    // preorder position of the carrying node; its subtree occupies node_begin up to node_end
+    size_t node_begin;
+    size_t node_end;
+    // range of the leaves below the carrying node in MutationIndex::leaves
+    size_t leaf_begin;
+    size_t leaf_end;
+    // number of leaves below the carrying node with no later mutation at the same site
+    size_t carriers;
+};
+
+class MutationIndex {
+  public:
+    std::vector<MAT::Node*> leaves;
+    std::vector<std::string> chromosomes;
+    // sorted by chromosome, position, alternative allele and preorder position of the node
+    std::vector<MutationRecord> records;
+
+    MutationIndex(MAT::Tree* T) {
+        std::vector<MAT::Node*> nodes = T->depth_first_expansion(T->root);
+        size_t n = nodes.size();
+        PreorderRanges ranges = preorder_ranges(nodes, preorder_parents(nodes));
+        leaves = std::move(ranges.leaves);
+        subtree_size = std::move(ranges.subtree_size);
+        positions = preorder_positions(nodes);
+        std::unordered_map<std::string, int16_t> chrom_ids;
+        for (size_t i = 0; i < n; i++) {
+            for (auto &m: nodes[i]->mutations) {
+                if (m.is_masked()) {
+                    continue;
+                }
+                auto it = chrom_ids.find(m.chrom);
+                if (it == chrom_ids.end()) {
+                    it = chrom_ids.emplace(m.chrom, (int16_t)chromosomes.size()).first;
+                    chromosomes.push_back(m.chrom);
+                }
+                size_t leaf_begin = ranges.leaf_begin[i];
+                size_t leaf_count = ranges.leaf_count[i];
+                records.push_back({it->second, m.par_nuc, m.mut_nuc, m.ref_nuc, m.position, nodes[i], i, i + subtree_size[i], leaf_begin, leaf_begin + leaf_count, leaf_count});
+            }
+        }
+        std::stable_sort(records.begin(), records.end(), [](const MutationRecord &a, const MutationRecord &b) {
+            return site_order(a.chrom, a.position, b.chrom, b.position);
+        });
+        // within each site, records are in preorder; subtract the leaves of each record from its closest ancestor record at the same site.
+        std::vector<size_t> open;
+        for (size_t s = 0; s < records.size();) {
+            size_t e = s;
+            while (e < records.size() && records[e].chrom == records[s].chrom && records[e].position == records[s].position) {
+                e++;
+            }
+            open.clear();
+            for (size_t r = s; r < e; r++) {
+                while (!open.empty() && records[open.back()].node_end <= records[r].node_begin) {
+                    open.pop_back();
+                }
+                if (!open.empty()) {
+                    records[open.back()].carriers -= records[r].leaf_end - records[r].leaf_begin;
+                }
+                open.push_back(r);
+            }
+            std::stable_sort(records.begin() + s, records.begin() + e, [](const MutationRecord &a, const MutationRecord &b) {
+                return a.mut_nuc < b.mut_nuc;
+            });
+            s = e;
+        }
+    }
+
+    int16_t chrom_id(const std::string &chrom) const {
+        for (size_t c = 0; c < chromosomes.size(); c++) {
+            if (chromosomes[c] == chrom) {
+                return (int16_t)c;
+            }
+        }
+        return -1;
+    }
+
+    // Indices of the records at positions start up to and including end on a chromosome, as a half-open range [first, second).
+    std::pair<size_t,size_t> range(int16_t chrom, int32_t start, int32_t end) const {
+        auto lower = std::lower_bound(records.begin(), records.end(), std::make_pair(chrom, start), [](const MutationRecord &r, const std::pair<int16_t,int32_t> &key) {
+            return site_order(r.chrom, r.position, key.first, key.second);
+        });
+        auto upper = std::upper_bound(records.begin(), records.end(), std::make_pair(chrom, end), [](const std::pair<int16_t,int32_t> &key, const MutationRecord &r) {
+            return site_order(key.first, key.second, r.chrom, r.position);
+        });
+        if (upper < lower) {
+            upper = lower;
+        }
+        return std::make_pair((size_t)(lower - records.begin()), (size_t)(upper - records.begin()));
+    }
+
+    // Leaves carrying the alternative allele at a site, in preorder. A negative chrom matches every chromosome and a par_nuc of 0 matches
+    // any parent allele. A leaf is included if its nearest ancestor (or itself) with a mutation at the site has a matching mutation.
+    std::vector<MAT::Node*> mutation_samples(int16_t chrom, int32_t position, int8_t par_nuc, int8_t mut_nuc) const {
+        std::vector<MAT::Node*> samples;
+        for (int16_t c = 0; c < (int16_t)chromosomes.size(); c++) {
+            if (chrom >= 0 && c != chrom) {
+                continue;
+            }
+            auto site = range(c, position, position);
+            // every record at the site, back in preorder, so that the leaves of later mutations can be skipped
+            std::vector<const MutationRecord*> ordered;
+            for (size_t r = site.first; r < site.second; r++) {
+                ordered.push_back(&records[r]);
+            }
+            std::sort(ordered.begin(), ordered.end(), [](const MutationRecord* a, const MutationRecord* b) {
+                return a->node_begin < b->node_begin;
+            });
+            for (size_t r = 0; r < ordered.size(); r++) {
+                const MutationRecord* record = ordered[r];
+                if (record->mut_nuc != mut_nuc || (par_nuc != 0 && record->par_nuc != par_nuc)) {
+                    continue;
+                }
+                size_t next = record->leaf_begin;
+                for (size_t d = r + 1; d < ordered.size() && ordered[d]->node_begin < record->node_end; d++) {
+                    if (ordered[d]->leaf_begin < next) {
+                        // nested inside a descendant record which was already skipped
+                        continue;
+                    }
+                    for (size_t l = next; l < ordered[d]->leaf_begin; l++) {
+                        samples.push_back(leaves[l]);
+                    }
+                    next = ordered[d]->leaf_end;
+                }
+                for (size_t l = next; l < record->leaf_end; l++) {
+                    samples.push_back(leaves[l]);
+                }
+            }
+        }
+        return samples;
+    }
+
+    // Number of leaves carrying each allele at a site, indexed by nucleotide id. Leaves below no mutation at the site carry the root allele.
+    std::vector<int64_t> allele_counts(int16_t chrom, int32_t position) const {
+        std::vector<int64_t> counts(16, 0);
+        auto site = range(chrom, position, position);
+        if (site.first == site.second) {
+            return counts;
+        }
+        for (size_t r = site.first; r < site.second; r++) {
+            counts[records[r].mut_nuc & 15] += records[r].carriers;
+        }
+        // leaves not below any mutation at the site, i.e. not below an outermost record
+        int64_t covered = 0;
+        size_t end = 0;
+        std::vector<const MutationRecord*> ordered;
+        for (size_t r = site.first; r < site.second; r++) {
+            ordered.push_back(&records[r]);
+        }
+        std::sort(ordered.begin(), ordered.end(), [](const MutationRecord* a, const MutationRecord* b) {
+            return a->node_begin < b->node_begin;
+        });
+        for (auto record: ordered) {
+            if (record->node_begin >= end) {
+                covered += record->leaf_end - record->leaf_begin;
+                end = record->node_end;
+            }
+        }
+        // the parent allele of the first mutation in preorder is the state at the root; ref_nuc is not always set on edited trees.
+        counts[ordered[0]->par_nuc & 15] += (int64_t)leaves.size() - covered;
+        return counts;
+    }
+
+    // Counts of each parent to alternative allele change among the mutations of the subtree below subroot, indexed by par_nuc * 16 + mut_nuc.
+    std::vector<int64_t> mutation_spectrum(const MAT::Node* subroot) const {
+        auto it = positions.find(subroot);
+        if (it == positions.end()) {
+            throw std::invalid_argument("Node is not part of the indexed tree.");
+        }
+        size_t begin = it->second;
+        size_t end = begin + subtree_size[begin];
+        std::vector<int64_t> spectrum(256, 0);
+        for (auto &record: records) {
+            if (record.node_begin >= begin && record.node_begin < end) {
+                spectrum[(record.par_nuc & 15) * 16 + (record.mut_nuc & 15)]++;
+            }
+        }
+        return spectrum;
+    }
+
+  private:
+    std::vector<size_t> subtree_size;
+    std::unordered_map<const MAT::Node*, size_t> positions;
+
+    static inline bool site_order(int16_t chrom_a, int32_t position_a, int16_t chrom_b, int32_t position_b) {
+        return (chrom_a < chrom_b) || (chrom_a == chrom_b && position_a < position_b);
+    }
+};
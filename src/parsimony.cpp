@@ -0,0 +1,187 @@
+/*small parsimony (Fitch-Hartigan) for many categorical characters at once.
+Each node holds, for every character, a bitmask over that character's states. Characters with more than 64 states
+take several 64-bit words, and the masks of a node are stored contiguously so the passes below are simple loops of
+AND/OR/XOR over arrays of words, which the compiler vectorizes.
+
+Polytomies are handled natively with Hartigan's generalization of Fitch: the state set of a node is the set of states
+found in the largest number of its children. The number of children carrying each state is accumulated in a bit-sliced
+counter (one bitmask per binary digit of the count), so counting also proceeds a whole word of states at a time.*/
+#include "usher/src/usher_graph.hpp"
+#include "arrays.cpp"
+
+struct ParsimonyResult {
+    std::vector<MAT::Node*> nodes;
+    // state index of each node (row, in preorder) for each character (column)
+    std::vector<int32_t> states;
+    // minimum number of state changes required on the tree for each character
+    std::vector<int64_t> scores;
+};
+
+inline int32_t lowest_state(const uint64_t* mask, size_t words) {
+    for (size_t w = 0; w < words; w++) {
+        if (mask[w] != 0) {
+            return (int32_t)(w * 64 + __builtin_ctzll(mask[w]));
+        }
+    }
+    return -1;
+}
+
+// Infer ancestral states for num_characters characters of num_states states each on the subtree below subroot.
+// leaf_states holds num_characters state indices for each node in leaves, row by row; a negative index marks missing data.
+// Leaves with missing data or not listed at all may take any state.
+ParsimonyResult fitch_hartigan(MAT::Tree* T, MAT::Node* subroot, const std::vector<MAT::Node*> &leaves, const std::vector<int32_t> &leaf_states, size_t num_characters, size_t num_states) {
+    ParsimonyResult result;
+    if (num_states == 0 || num_characters == 0) {
+        throw std::invalid_argument("Parsimony requires at least one character with at least one state.");
+    }
+    if (leaf_states.size() != leaves.size() * num_characters) {
+        throw std::invalid_argument("Leaf state array does not match the number of leaves and characters.");
+    }
+    result.nodes = T->depth_first_expansion(subroot);
+    const size_t n = result.nodes.size();
+    const size_t words = (num_states + 63) / 64;
+    const size_t lanes = num_characters * words;
+    std::vector<int64_t> parent = preorder_parents(result.nodes);
+
+    // children of each node as a CSR list of preorder indices
+    std::vector<size_t> child_offsets(n + 1, 0);
+    for (size_t i = 1; i < n; i++) {
+        child_offsets[parent[i] + 1]++;
+    }
+    for (size_t i = 0; i < n; i++) {
+        child_offsets[i + 1] += child_offsets[i];
+    }
+    std::vector<size_t> children(n > 0 ? n - 1 : 0);
+    std::vector<size_t> fill(child_offsets.begin(), child_offsets.end() - 1);
+    for (size_t i = 1; i < n; i++) {
+        children[fill[parent[i]]++] = i;
+    }
+
+    // bits of the last word of each character which do not correspond to a state are never set
+    std::vector<uint64_t> valid(lanes, ~0ULL);
+    if (num_states % 64 != 0) {
+        for (size_t c = 0; c < num_characters; c++) {
+            valid[c * words + words - 1] = (1ULL << (num_states % 64)) - 1;
+        }
+    }
+
+    // upper[i] holds the states found in the most children of node i; lower[i] those found in exactly one child less.
+    // A node can take its parent's state at no extra cost if that state is in either set.
+    std::vector<uint64_t> upper(n * lanes, 0);
+    std::vector<uint64_t> lower(n * lanes, 0);
+    std::unordered_map<const MAT::Node*, size_t> leaf_rows;
+    for (size_t l = 0; l < leaves.size(); l++) {
+        leaf_rows[leaves[l]] = l;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!result.nodes[i]->is_leaf()) {
+            continue;
+        }
+        uint64_t* u = &upper[i * lanes];
+        auto row = leaf_rows.find(result.nodes[i]);
+        for (size_t c = 0; c < num_characters; c++) {
+            int32_t state = (row == leaf_rows.end()) ? -1 : leaf_states[row->second * num_characters + c];
+            if (state >= (int32_t)num_states) {
+                throw std::invalid_argument("Leaf state index exceeds the number of states.");
+            }
+            if (state < 0) {
+                std::copy(&valid[c * words], &valid[c * words] + words, u + c * words);
+            } else {
+                u[c * words + state / 64] = 1ULL << (state % 64);
+            }
+        }
+    }
+
+    // up pass, in postorder
+    result.scores.assign(num_characters, 0);
+    std::vector<uint64_t> planes;
+    std::vector<uint64_t> carry(lanes);
+    std::vector<uint64_t> present(lanes);
+    for (size_t i = n; i-- > 0;) {
+        size_t k = child_offsets[i + 1] - child_offsets[i];
+        if (k == 0) {
+            continue;
+        }
+        size_t num_planes = 0;
+        while ((k >> num_planes) != 0) {
+            num_planes++;
+        }
+        planes.assign(num_planes * lanes, 0);
+        for (size_t ci = child_offsets[i]; ci < child_offsets[i + 1]; ci++) {
+            const uint64_t* cu = &upper[children[ci] * lanes];
+            std::copy(cu, cu + lanes, carry.begin());
+            for (size_t b = 0; b < num_planes; b++) {
+                uint64_t* plane = &planes[b * lanes];
+                for (size_t l = 0; l < lanes; l++) {
+                    uint64_t overflow = plane[l] & carry[l];
+                    plane[l] ^= carry[l];
+                    carry[l] = overflow;
+                }
+            }
+        }
+        std::fill(present.begin(), present.end(), 0);
+        for (size_t b = 0; b < num_planes; b++) {
+            const uint64_t* plane = &planes[b * lanes];
+            for (size_t l = 0; l < lanes; l++) {
+                present[l] |= plane[l];
+            }
+        }
+        // narrow down to the states with the largest count, reading the count one binary digit at a time from the top.
+        uint64_t* u = &upper[i * lanes];
+        uint64_t* lo = &lower[i * lanes];
+        for (size_t c = 0; c < num_characters; c++) {
+            uint64_t* mask = u + c * words;
+            std::copy(&present[c * words], &present[c * words] + words, mask);
+            size_t max_count = 0;
+            for (size_t b = num_planes; b-- > 0;) {
+                const uint64_t* plane = &planes[b * lanes + c * words];
+                bool any = false;
+                for (size_t w = 0; w < words; w++) {
+                    any |= (mask[w] & plane[w]) != 0;
+                }
+                if (any) {
+                    for (size_t w = 0; w < words; w++) {
+                        mask[w] &= plane[w];
+                    }
+                    max_count |= (size_t)1 << b;
+                }
+            }
+            result.scores[c] += k - max_count;
+            // states whose count equals max_count - 1, compared one binary digit at a time.
+            size_t target = max_count - 1;
+            for (size_t w = 0; w < words; w++) {
+                lo[c * words + w] = valid[c * words + w];
+            }
+            for (size_t b = 0; b < num_planes; b++) {
+                const uint64_t* plane = &planes[b * lanes + c * words];
+                uint64_t select = ((target >> b) & 1) ? ~0ULL : 0ULL;
+                for (size_t w = 0; w < words; w++) {
+                    lo[c * words + w] &= ~(plane[w] ^ select);
+                }
+            }
+        }
+    }
+
+    // down pass, in preorder. The root takes its lowest-numbered optimal state; every other node keeps the state of its parent
+    // when that costs nothing extra, and otherwise takes its lowest-numbered optimal state.
+    result.states.assign(n * num_characters, -1);
+    for (size_t i = 0; i < n; i++) {
+        const uint64_t* u = &upper[i * lanes];
+        const uint64_t* lo = &lower[i * lanes];
+        for (size_t c = 0; c < num_characters; c++) {
+            int32_t state = -1;
+            if (i > 0) {
+                int32_t ps = result.states[parent[i] * num_characters + c];
+                size_t w = c * words + ps / 64;
+                if (((u[w] | lo[w]) >> (ps % 64)) & 1) {
+                    state = ps;
+                }
+            }
+            if (state < 0) {
+                state = lowest_state(u + c * words, words);
+            }
+            result.states[i * num_characters + c] = state;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,392 @@
+/*parallel reading and writing of mutation annotated tree protobufs.
+Compressed trees are written as block gzip: a series of independent gzip members, each holding a fixed size block of the
+serialized protobuf. Every member carries its own compressed size in an extra header field (subfield "BT"), as in BGZF, so a
+reader can find all member boundaries without decompressing and inflate the blocks on separate threads. The result is still
+a standard gzip file which any gzip reader decompresses as a whole, and plain single member .pb.gz files are read sequentially.
+The top level protobuf message is walked by hand, so the per-node mutation and annotation lists are parsed concurrently and
+serialized concurrently rather than as one message on one thread.*/
+#pragma once
+#include "usher/src/usher_graph.hpp"
+#include "parsimony.pb.h"
+#include <zlib.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+// uncompressed bytes per gzip member when writing
+static const size_t PB_BLOCK_SIZE = (size_t)1 << 22;
+// fixed header of a block gzip member: the gzip header with FEXTRA set, followed by a single "BT" subfield holding the member size
+static const size_t PB_BLOCK_HEADER = 20;
+static const size_t PB_BLOCK_TRAILER = 8;
+
+namespace pbio {
+
+inline uint32_t read_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline void write_le32(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+inline uint64_t read_varint(const uint8_t* &p, const uint8_t* end) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (p >= end) {
+            throw std::runtime_error("Truncated protobuf message.");
+        }
+        uint8_t byte = *p++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw std::runtime_error("Malformed varint in protobuf message.");
+}
+
+inline void write_varint(std::string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((char)((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+// Append a length delimited field to a serialized message.
+inline void write_field(std::string &out, uint32_t field, const std::string &value) {
+    write_varint(out, (field << 3) | 2);
+    write_varint(out, value.size());
+    out.append(value);
+}
+
+std::string read_file(const std::string &filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Could not open protobuf file " + filename + ".");
+    }
+    in.seekg(0, std::ios::end);
+    std::string contents(in.tellg(), '\0');
+    in.seekg(0, std::ios::beg);
+    in.read(&contents[0], contents.size());
+    return contents;
+}
+
+// The size of the block gzip member starting at p, or 0 if it is any other kind of gzip member.
+inline size_t block_member_size(const uint8_t* p, size_t available) {
+    if (available < PB_BLOCK_HEADER + PB_BLOCK_TRAILER || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || p[3] != 4) {
+        return 0;
+    }
+    if (p[10] != 8 || p[11] != 0 || p[12] != 'B' || p[13] != 'T' || p[14] != 4 || p[15] != 0) {
+        return 0;
+    }
+    size_t size = read_le32(p + 16);
+    return (size >= PB_BLOCK_HEADER + PB_BLOCK_TRAILER && size <= available) ? size : 0;
+}
+
+void inflate_raw(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size) {
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+        throw std::runtime_error("Could not initialize zlib.");
+    }
+    stream.next_in = const_cast<uint8_t*>(in);
+    stream.avail_in = in_size;
+    stream.next_out = out;
+    stream.avail_out = out_size;
+    int status = inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+    if (status != Z_STREAM_END || stream.avail_out != 0) {
+        throw std::runtime_error("Corrupt block in compressed protobuf.");
+    }
+}
+
+// Decompress any gzip stream, including several concatenated members, on the calling thread.
+std::string inflate_sequential(const std::string &compressed) {
+    std::string out;
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+        throw std::runtime_error("Could not initialize zlib.");
+    }
+    stream.next_in = (Bytef*)compressed.data();
+    stream.avail_in = compressed.size();
+    std::vector<char> buffer(1 << 20);
+    while (true) {
+        stream.next_out = (Bytef*)buffer.data();
+        stream.avail_out = buffer.size();
+        int status = inflate(&stream, Z_NO_FLUSH);
+        out.append(buffer.data(), buffer.size() - stream.avail_out);
+        if (status == Z_STREAM_END) {
+            if (stream.avail_in == 0) {
+                break;
+            }
+            inflateReset(&stream);
+        } else if (status != Z_OK) {
+            inflateEnd(&stream);
+            throw std::runtime_error("Corrupt compressed protobuf.");
+        }
+    }
+    inflateEnd(&stream);
+    return out;
+}
+
+// Decompress a gzip file, inflating block gzip members in parallel when every member is one.
+std::string decompress(const std::string &compressed) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(compressed.data());
+    std::vector<size_t> member_offsets(1, 0);
+    std::vector<size_t> output_offsets(1, 0);
+    while (member_offsets.back() < compressed.size()) {
+        size_t offset = member_offsets.back();
+        size_t size = block_member_size(data + offset, compressed.size() - offset);
+        if (size == 0) {
+            return inflate_sequential(compressed);
+        }
+        member_offsets.push_back(offset + size);
+        output_offsets.push_back(output_offsets.back() + read_le32(data + offset + size - 4));
+    }
+    std::string out(output_offsets.back(), '\0');
+    uint8_t* output = reinterpret_cast<uint8_t*>(&out[0]);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, member_offsets.size() - 1, 1), [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t b = r.begin(); b < r.end(); b++) {
+            const uint8_t* member = data + member_offsets[b];
+            size_t size = member_offsets[b + 1] - member_offsets[b];
+            size_t length = output_offsets[b + 1] - output_offsets[b];
+            inflate_raw(member + PB_BLOCK_HEADER, size - PB_BLOCK_HEADER - PB_BLOCK_TRAILER, output + output_offsets[b], length);
+            if (crc32(crc32(0L, Z_NULL, 0), output + output_offsets[b], length) != read_le32(member + size - 8)) {
+                throw std::runtime_error("Checksum mismatch in compressed protobuf.");
+            }
+        }
+    });
+    return out;
+}
+
+// Compress into independent block gzip members, one per block, on separate threads.
+std::string compress(const std::string &raw) {
+    size_t num_blocks = std::max((size_t)1, (raw.size() + PB_BLOCK_SIZE - 1) / PB_BLOCK_SIZE);
+    std::vector<std::string> members(num_blocks);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, num_blocks, 1), [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t b = r.begin(); b < r.end(); b++) {
+            const uint8_t* block = reinterpret_cast<const uint8_t*>(raw.data()) + b * PB_BLOCK_SIZE;
+            size_t length = std::min(PB_BLOCK_SIZE, raw.size() - b * PB_BLOCK_SIZE);
+            z_stream stream;
+            std::memset(&stream, 0, sizeof(stream));
+            if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                throw std::runtime_error("Could not initialize zlib.");
+            }
+            std::string &member = members[b];
+            member.resize(PB_BLOCK_HEADER + deflateBound(&stream, length) + PB_BLOCK_TRAILER);
+            uint8_t* out = reinterpret_cast<uint8_t*>(&member[0]);
+            stream.next_in = const_cast<uint8_t*>(block);
+            stream.avail_in = length;
+            stream.next_out = out + PB_BLOCK_HEADER;
+            stream.avail_out = member.size() - PB_BLOCK_HEADER - PB_BLOCK_TRAILER;
+            int status = deflate(&stream, Z_FINISH);
+            size_t deflated = stream.total_out;
+            deflateEnd(&stream);
+            if (status != Z_STREAM_END) {
+                throw std::runtime_error("Failed to compress protobuf.");
+            }
+            size_t size = PB_BLOCK_HEADER + deflated + PB_BLOCK_TRAILER;
+            const uint8_t header[16] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 8, 0, 'B', 'T', 4, 0};
+            std::memcpy(out, header, sizeof(header));
+            write_le32(out + 16, size);
+            write_le32(out + PB_BLOCK_HEADER + deflated, crc32(crc32(0L, Z_NULL, 0), block, length));
+            write_le32(out + PB_BLOCK_HEADER + deflated + 4, length);
+            member.resize(size);
+        }
+    });
+    std::string out;
+    size_t total = 0;
+    for (auto &m: members) {
+        total += m.size();
+    }
+    out.reserve(total);
+    for (auto &m: members) {
+        out.append(m);
+    }
+    return out;
+}
+
+inline bool is_gzip(const std::string &data) {
+    return data.size() >= 2 && (uint8_t)data[0] == 0x1f && (uint8_t)data[1] == 0x8b;
+}
+
+inline bool ends_with(const std::string &s, const std::string &suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+}
+
+// Load a .pb or .pb.gz file into a tree, equivalent to load_mutation_annotated_tree.
+MAT::Tree load_mutation_annotated_tree_parallel(const std::string &filename) {
+    std::string contents = pbio::read_file(filename);
+    if (pbio::is_gzip(contents)) {
+        contents = pbio::decompress(contents);
+    }
+    // locate the fields of the top level message without parsing the per-node messages
+    typedef std::pair<const uint8_t*, size_t> Field;
+    std::string newick;
+    std::vector<Field> node_mutations, condensed_nodes, metadata;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(contents.data());
+    const uint8_t* end = p + contents.size();
+    while (p < end) {
+        uint64_t tag = pbio::read_varint(p, end);
+        uint32_t field = tag >> 3;
+        switch (tag & 7) {
+        case 0:
+            pbio::read_varint(p, end);
+            break;
+        case 1:
+            p += 8;
+            break;
+        case 5:
+            p += 4;
+            break;
+        case 2: {
+            uint64_t length = pbio::read_varint(p, end);
+            if (length > (uint64_t)(end - p)) {
+                throw std::runtime_error("Truncated protobuf message.");
+            }
+            if (field == 1) {
+                newick.assign(reinterpret_cast<const char*>(p), length);
+            } else if (field == 2) {
+                node_mutations.emplace_back(p, length);
+            } else if (field == 3) {
+                condensed_nodes.emplace_back(p, length);
+            } else if (field == 4) {
+                metadata.emplace_back(p, length);
+            }
+            p += length;
+            break;
+        }
+        default:
+            throw std::runtime_error("Unsupported wire type in protobuf message.");
+        }
+    }
+    if (p != end) {
+        throw std::runtime_error("Truncated protobuf message.");
+    }
+
+    MAT::Tree T = MAT::create_tree_from_newick_string(newick);
+    std::vector<MAT::Node*> nodes = T.depth_first_expansion();
+    if (node_mutations.size() != nodes.size() || (metadata.size() > 0 && metadata.size() != nodes.size())) {
+        throw std::runtime_error("Protobuf mutation lists do not match the tree.");
+    }
+    size_t num_annotations = 0;
+    if (metadata.size() > 0) {
+        Parsimony::node_metadata first;
+        first.ParseFromArray(metadata[0].first, metadata[0].second);
+        num_annotations = first.clade_annotations_size();
+    }
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, nodes.size()), [&](const tbb::blocked_range<size_t> &r) {
+        Parsimony::mutation_list mutation_list;
+        Parsimony::node_metadata node_metadata;
+        for (size_t i = r.begin(); i < r.end(); i++) {
+            MAT::Node* node = nodes[i];
+            if (num_annotations > 0) {
+                if (!node_metadata.ParseFromArray(metadata[i].first, metadata[i].second)) {
+                    throw std::runtime_error("Malformed node metadata in protobuf.");
+                }
+                node->clade_annotations.resize(num_annotations);
+                for (int k = 0; k < node_metadata.clade_annotations_size() && k < (int)num_annotations; k++) {
+                    node->clade_annotations[k] = node_metadata.clade_annotations(k);
+                }
+            }
+            if (!mutation_list.ParseFromArray(node_mutations[i].first, node_mutations[i].second)) {
+                throw std::runtime_error("Malformed mutation list in protobuf.");
+            }
+            node->mutations.reserve(mutation_list.mutation_size());
+            for (int k = 0; k < mutation_list.mutation_size(); k++) {
+                const Parsimony::mut &mut = mutation_list.mutation(k);
+                MAT::Mutation m;
+                m.chrom = mut.chromosome();
+                m.position = mut.position();
+                m.ref_nuc = (mut.ref_nuc() >= 0) ? (1 << mut.ref_nuc()) : 0;
+                m.par_nuc = (mut.par_nuc() >= 0) ? (1 << mut.par_nuc()) : 0;
+                m.is_missing = false;
+                m.mut_nuc = 0;
+                for (int n = 0; n < mut.mut_nuc_size(); n++) {
+                    m.mut_nuc |= (1 << mut.mut_nuc(n));
+                }
+                node->add_mutation(m);
+            }
+        }
+    });
+    Parsimony::condensed_node condensed;
+    for (auto &field: condensed_nodes) {
+        if (!condensed.ParseFromArray(field.first, field.second)) {
+            throw std::runtime_error("Malformed condensed node in protobuf.");
+        }
+        std::vector<std::string> leaves(condensed.condensed_leaves().begin(), condensed.condensed_leaves().end());
+        for (auto &leaf: leaves) {
+            T.condensed_leaves.insert(leaf);
+        }
+        T.condensed_nodes.emplace(condensed.node_name(), std::move(leaves));
+    }
+    return T;
+}
+
+// Save a tree as a .pb, or as a block gzip .pb.gz if the filename ends in .gz, equivalent to save_mutation_annotated_tree.
+void save_mutation_annotated_tree_parallel(MAT::Tree* T, const std::string &filename) {
+    std::vector<MAT::Node*> nodes = T->depth_first_expansion();
+    // serialize the per-node messages concurrently, then frame them in field order as the protobuf library would
+    std::vector<std::string> node_mutations(nodes.size());
+    std::vector<std::string> metadata(nodes.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, nodes.size()), [&](const tbb::blocked_range<size_t> &r) {
+        Parsimony::mutation_list mutation_list;
+        Parsimony::node_metadata node_metadata;
+        for (size_t i = r.begin(); i < r.end(); i++) {
+            mutation_list.Clear();
+            node_metadata.Clear();
+            for (auto &ann: nodes[i]->clade_annotations) {
+                node_metadata.add_clade_annotations(ann);
+            }
+            for (auto &m: nodes[i]->mutations) {
+                Parsimony::mut* mut = mutation_list.add_mutation();
+                mut->set_chromosome(m.chrom);
+                mut->set_position(m.position);
+                mut->set_ref_nuc(m.ref_nuc > 0 ? __builtin_ctz(m.ref_nuc) : -1);
+                mut->set_par_nuc(m.par_nuc > 0 ? __builtin_ctz(m.par_nuc) : -1);
+                for (int n = 0; n < 4; n++) {
+                    if (m.mut_nuc & (1 << n)) {
+                        mut->add_mut_nuc(n);
+                    }
+                }
+            }
+            node_mutations[i] = mutation_list.SerializeAsString();
+            metadata[i] = node_metadata.SerializeAsString();
+        }
+    });
+    std::string raw;
+    pbio::write_field(raw, 1, MAT::get_newick_string(*T, false, true, true));
+    for (auto &s: node_mutations) {
+        pbio::write_field(raw, 2, s);
+    }
+    node_mutations.clear();
+    Parsimony::condensed_node condensed;
+    for (auto &kv: T->condensed_nodes) {
+        condensed.Clear();
+        condensed.set_node_name(kv.first);
+        for (auto &leaf: kv.second) {
+            condensed.add_condensed_leaves(leaf);
+        }
+        pbio::write_field(raw, 3, condensed.SerializeAsString());
+    }
+    for (auto &s: metadata) {
+        pbio::write_field(raw, 4, s);
+    }
+    metadata.clear();
+    if (pbio::ends_with(filename, ".gz")) {
+        raw = pbio::compress(raw);
+    }
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Could not open " + filename + " for writing.");
+    }
+    out.write(raw.data(), raw.size());
+    if (!out) {
+        throw std::runtime_error("Failed to write " + filename + ".");
+    }
+}
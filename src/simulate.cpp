@@ -0,0 +1,99 @@
+/*seeded generator of synthetic mutation annotated trees, used for testing and benchmarking at scale.
+Samples are added one at a time next to an earlier sample, chosen with a bias towards recent samples set by recency (1 is uniform).
+With probability polytomy the new sample joins the parent of that sample, so large polytomies grow fastest as in densely sampled
+outbreaks; otherwise it is placed below a new internal node carrying at least one mutation, which deepens the tree. Higher recency
+gives deeper trees with smaller polytomies. Mutation sites are drawn from a skewed site rate distribution, so a small fraction of
+the genome accounts for most recurrent mutations, and every mutation starts from the allele inherited from its ancestors, so the
+tree is consistent with the reference at the root.*/
+#pragma once
+#include "usher/src/usher_graph.hpp"
+#include <random>
+
+MAT::Tree simulate_tree(size_t num_leaves, uint64_t seed, std::string reference, const std::string &chrom, double polytomy, double mutation_rate, double recency) {
+    if (polytomy < 0.0 || polytomy > 1.0 || mutation_rate < 0.0 || recency < 1.0) {
+        throw std::invalid_argument("Polytomy must be between 0 and 1, the mutation rate must not be negative and recency must be at least 1.");
+    }
+    std::mt19937_64 rng(seed);
+    const char nucs[4] = {'A', 'C', 'G', 'T'};
+    if (reference.empty()) {
+        reference.resize(29903);
+        for (auto &c: reference) {
+            c = nucs[rng() & 3];
+        }
+    }
+    int32_t genome_length = reference.size();
+    // site rates: a power of a uniform variate, sampled through the cumulative rate of each site
+    std::vector<double> cumulative_rate(genome_length);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    double total = 0.0;
+    for (int32_t i = 0; i < genome_length; i++) {
+        total += std::pow(unit(rng), 4.0);
+        cumulative_rate[i] = total;
+    }
+    std::poisson_distribution<int> leaf_mutations(mutation_rate);
+    std::poisson_distribution<int> internal_mutations(std::max(mutation_rate - 1.0, 0.0) + 0.5);
+
+    auto add_mutations = [&](MAT::Node* node, int count) {
+        for (int k = 0; k < count; k++) {
+            int32_t position = std::lower_bound(cumulative_rate.begin(), cumulative_rate.end(), unit(rng) * total) - cumulative_rate.begin() + 1;
+            if (position > genome_length) {
+                position = genome_length;
+            }
+            bool duplicate = false;
+            for (auto &m: node->mutations) {
+                duplicate = duplicate || (m.position == position);
+            }
+            if (duplicate) {
+                continue;
+            }
+            int8_t ref_nuc = MAT::get_nuc_id(reference[position - 1]);
+            int8_t par_nuc = ref_nuc;
+            bool found = false;
+            for (MAT::Node* anc = node->parent; anc != NULL && !found; anc = anc->parent) {
+                for (auto &m: anc->mutations) {
+                    if (m.position == position) {
+                        par_nuc = m.mut_nuc;
+                        found = true;
+                    }
+                }
+            }
+            MAT::Mutation mut;
+            mut.chrom = chrom;
+            mut.position = position;
+            mut.ref_nuc = ref_nuc;
+            mut.par_nuc = par_nuc;
+            mut.is_missing = false;
+            do {
+                mut.mut_nuc = MAT::get_nuc_id(nucs[rng() & 3]);
+            } while (mut.mut_nuc == par_nuc);
+            node->mutations.push_back(mut);
+        }
+        std::sort(node->mutations.begin(), node->mutations.end(), [](const MAT::Mutation &a, const MAT::Mutation &b) {
+            return a.position < b.position;
+        });
+        node->branch_length = node->mutations.size();
+    };
+
+    MAT::Tree T;
+    MAT::Node* root = T.create_node("node_1", 0.0, 2);
+    T.curr_internal_node = 1;
+    std::vector<MAT::Node*> leaves;
+    std::bernoulli_distribution attach_directly(polytomy);
+    for (size_t i = 0; i < num_leaves; i++) {
+        // the parent of an existing sample, favouring recent ones; sampling by sample makes large polytomies grow fastest
+        MAT::Node* parent = root;
+        if (!leaves.empty()) {
+            size_t recent = (size_t)(leaves.size() * std::pow(unit(rng), recency));
+            parent = leaves[leaves.size() - 1 - std::min(recent, leaves.size() - 1)]->parent;
+        }
+        if (parent->children.empty() || !attach_directly(rng)) {
+            MAT::Node* split = T.create_node("node_" + std::to_string(++T.curr_internal_node), parent, 0.0);
+            add_mutations(split, 1 + internal_mutations(rng));
+            parent = split;
+        }
+        MAT::Node* leaf = T.create_node("sample_" + std::to_string(i + 1), parent, 0.0);
+        add_mutations(leaf, leaf_mutations(rng));
+        leaves.push_back(leaf);
+    }
+    return T;
+}
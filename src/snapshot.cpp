@@ -0,0 +1,343 @@
+/*BTE snapshot format: a flat, columnar copy of a tree which can be memory-mapped read-only.
+The file starts with a header and a table of named sections, followed by the sections themselves, each aligned to 8 bytes.
+Every section is a plain array of a single type, stored in native byte order, so it can be used in place from the mapping
+(and shared between processes through the page cache) without any parsing:
+
+    meta (uint64): format version, curr_internal_node and the number of annotation levels per node.
+    parent (int64), branch_length (float32): one entry per node, in preorder. The parent of the root is -1.
+    mutation_offsets (int64): the mutations of node i are entries mutation_offsets[i] up to mutation_offsets[i+1] of
+        position (int32), ref_nuc, par_nuc, mut_nuc (int8, nucleotide ids), is_missing (uint8) and chrom (int16, an index into chromosomes).
+    identifiers, chromosomes, annotations, condensed: string tables, each stored as <name>_offsets (int64) and <name>_data (uint8),
+        where string i is bytes offsets[i] up to offsets[i+1] of the data. annotations holds one entry per node and annotation level.
+    condensed_groups (int64): condensed node g is string condensed_groups[g] of the condensed table, followed by its samples up to condensed_groups[g+1].*/
+#pragma once
+#include "usher/src/usher_graph.hpp"
+#include "arrays.cpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char SNAPSHOT_MAGIC[8] = {'B', 'T', 'E', 'S', 'N', 'A', 'P', '\0'};
+static const uint64_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotSection {
+    char name[24];
+    char typecode[8];
+    uint64_t offset;
+    uint64_t length;
+};
+
+class SnapshotWriter {
+  public:
+    template <typename T>
+    void add(const std::string &name, const char* typecode, const std::vector<T> &values) {
+        SnapshotSection section;
+        std::memset(&section, 0, sizeof(section));
+        std::strncpy(section.name, name.c_str(), sizeof(section.name) - 1);
+        std::strncpy(section.typecode, typecode, sizeof(section.typecode) - 1);
+        section.length = values.size();
+        sections.push_back(section);
+        const char* bytes = reinterpret_cast<const char*>(values.data());
+        payloads.emplace_back(bytes, bytes + values.size() * sizeof(T));
+    }
+
+    void add_strings(const std::string &name, const std::vector<std::string> &strings) {
+        std::vector<int64_t> offsets(1, 0);
+        std::vector<uint8_t> data;
+        for (auto &s: strings) {
+            data.insert(data.end(), s.begin(), s.end());
+            offsets.push_back(data.size());
+        }
+        add(name + "_offsets", "q", offsets);
+        add(name + "_data", "B", data);
+    }
+
+    void write(const std::string &filename) {
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Could not open snapshot file " + filename + " for writing.");
+        }
+        uint64_t num_sections = sections.size();
+        uint64_t offset = align(sizeof(SNAPSHOT_MAGIC) + sizeof(uint64_t) + num_sections * sizeof(SnapshotSection));
+        for (size_t i = 0; i < sections.size(); i++) {
+            sections[i].offset = offset;
+            offset = align(offset + payloads[i].size());
+        }
+        out.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        out.write(reinterpret_cast<const char*>(&num_sections), sizeof(num_sections));
+        out.write(reinterpret_cast<const char*>(sections.data()), num_sections * sizeof(SnapshotSection));
+        uint64_t position = sizeof(SNAPSHOT_MAGIC) + sizeof(uint64_t) + num_sections * sizeof(SnapshotSection);
+        const char padding[8] = {0};
+        for (size_t i = 0; i < sections.size(); i++) {
+            out.write(padding, sections[i].offset - position);
+            out.write(payloads[i].data(), payloads[i].size());
+            position = sections[i].offset + payloads[i].size();
+        }
+        out.write(padding, align(position) - position);
+        if (!out) {
+            throw std::runtime_error("Failed to write snapshot file " + filename + ".");
+        }
+    }
+
+  private:
+    std::vector<SnapshotSection> sections;
+    std::vector<std::vector<char>> payloads;
+
+    static inline uint64_t align(uint64_t offset) {
+        return (offset + 7) & ~(uint64_t)7;
+    }
+};
+
+// A read-only memory mapping of a snapshot file. Sections point directly into the mapping.
+class TreeSnapshot {
+  public:
+    TreeSnapshot(const std::string &filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open snapshot file " + filename + ".");
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SNAPSHOT_MAGIC) + sizeof(uint64_t)) {
+            close(fd);
+            throw std::runtime_error("Snapshot file " + filename + " is truncated.");
+        }
+        size = info.st_size;
+        data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("Could not map snapshot file " + filename + ".");
+        }
+        const char* bytes = static_cast<const char*>(data);
+        uint64_t num_sections;
+        std::memcpy(&num_sections, bytes + sizeof(SNAPSHOT_MAGIC), sizeof(num_sections));
+        if (std::memcmp(bytes, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || sizeof(SNAPSHOT_MAGIC) + sizeof(uint64_t) + num_sections * sizeof(SnapshotSection) > size) {
+            munmap(data, size);
+            throw std::runtime_error(filename + " is not a BTE snapshot file.");
+        }
+        const SnapshotSection* table = reinterpret_cast<const SnapshotSection*>(bytes + sizeof(SNAPSHOT_MAGIC) + sizeof(uint64_t));
+        sections.assign(table, table + num_sections);
+    }
+
+    ~TreeSnapshot() {
+        munmap(data, size);
+    }
+
+    TreeSnapshot(const TreeSnapshot&) = delete;
+    TreeSnapshot& operator=(const TreeSnapshot&) = delete;
+
+    template <typename T>
+    const T* section(const std::string &name, size_t &length) const {
+        for (auto &s: sections) {
+            if (name == s.name) {
+                if (s.offset > size || s.length > (size - s.offset) / sizeof(T)) {
+                    throw std::runtime_error("Snapshot section " + name + " is truncated.");
+                }
+                if (s.offset % alignof(T) != 0) {
+                    throw std::runtime_error("Snapshot section " + name + " is misaligned.");
+                }
+                length = s.length;
+                return reinterpret_cast<const T*>(static_cast<const char*>(data) + s.offset);
+            }
+        }
+        throw std::runtime_error("Snapshot is missing section " + name + ".");
+    }
+
+    // String i of a string table, without copying.
+    std::pair<const char*, size_t> string_at(const int64_t* offsets, const uint8_t* strings, size_t i) const {
+        return std::make_pair(reinterpret_cast<const char*>(strings) + offsets[i], (size_t)(offsets[i + 1] - offsets[i]));
+    }
+
+  private:
+    void* data;
+    size_t size;
+    std::vector<SnapshotSection> sections;
+};
+
+void save_tree_snapshot(MAT::Tree* T, const std::string &filename) {
+    std::vector<MAT::Node*> nodes = T->depth_first_expansion(T->root);
+    size_t n = nodes.size();
+    uint64_t levels = (n > 0) ? nodes[0]->clade_annotations.size() : 0;
+    std::vector<uint64_t> meta = {SNAPSHOT_VERSION, T->curr_internal_node, levels};
+    std::vector<float> branch_length(n);
+    std::vector<int64_t> mutation_offsets(n + 1, 0);
+    std::vector<std::string> identifiers(n);
+    std::vector<std::string> annotations(n * levels);
+    for (size_t i = 0; i < n; i++) {
+        branch_length[i] = nodes[i]->branch_length;
+        identifiers[i] = nodes[i]->identifier;
+        mutation_offsets[i + 1] = mutation_offsets[i] + nodes[i]->mutations.size();
+        for (size_t l = 0; l < levels && l < nodes[i]->clade_annotations.size(); l++) {
+            annotations[i * levels + l] = nodes[i]->clade_annotations[l];
+        }
+    }
+    size_t m = mutation_offsets[n];
+    std::vector<int32_t> position(m);
+    std::vector<int8_t> ref_nuc(m), par_nuc(m), mut_nuc(m);
+    std::vector<uint8_t> is_missing(m);
+    std::vector<int16_t> chrom(m);
+    std::vector<std::string> chromosomes;
+    std::unordered_map<std::string, int16_t> chrom_ids;
+    size_t k = 0;
+    for (auto node: nodes) {
+        for (auto &mut: node->mutations) {
+            auto it = chrom_ids.find(mut.chrom);
+            if (it == chrom_ids.end()) {
+                it = chrom_ids.emplace(mut.chrom, (int16_t)chromosomes.size()).first;
+                chromosomes.push_back(mut.chrom);
+            }
+            position[k] = mut.position;
+            ref_nuc[k] = mut.ref_nuc;
+            par_nuc[k] = mut.par_nuc;
+            mut_nuc[k] = mut.mut_nuc;
+            is_missing[k] = mut.is_missing;
+            chrom[k] = it->second;
+            k++;
+        }
+    }
+    std::vector<std::string> condensed;
+    std::vector<int64_t> condensed_groups(1, 0);
+    for (auto &kv: T->condensed_nodes) {
+        condensed.push_back(kv.first);
+        condensed.insert(condensed.end(), kv.second.begin(), kv.second.end());
+        condensed_groups.push_back(condensed.size());
+    }
+
+    SnapshotWriter writer;
+    writer.add("meta", "Q", meta);
+    writer.add("parent", "q", preorder_parents(nodes));
+    writer.add("branch_length", "f", branch_length);
+    writer.add("mutation_offsets", "q", mutation_offsets);
+    writer.add("position", "i", position);
+    writer.add("ref_nuc", "b", ref_nuc);
+    writer.add("par_nuc", "b", par_nuc);
+    writer.add("mut_nuc", "b", mut_nuc);
+    writer.add("is_missing", "B", is_missing);
+    writer.add("chrom", "h", chrom);
+    writer.add_strings("identifiers", identifiers);
+    writer.add_strings("chromosomes", chromosomes);
+    writer.add_strings("annotations", annotations);
+    writer.add_strings("condensed", condensed);
+    writer.add("condensed_groups", "q", condensed_groups);
+    writer.write(filename);
+}
+
+// Rebuild a full tree from a snapshot in a single pass over the mapped arrays.
+MAT::Tree load_tree_snapshot(const std::string &filename) {
+    TreeSnapshot snapshot(filename);
+    size_t length, n, m, num_identifiers, num_chromosomes, num_annotations, num_groups;
+    const uint64_t* meta = snapshot.section<uint64_t>("meta", length);
+    if (length < 3 || meta[0] != SNAPSHOT_VERSION) {
+        throw std::runtime_error("Unsupported snapshot version.");
+    }
+    size_t levels = meta[2];
+    // every length and index is checked before use, so a truncated or corrupt file cannot cause reads outside the mapping.
+    auto check = [](bool valid, const std::string &what) {
+        if (!valid) {
+            throw std::runtime_error("Snapshot " + what + " is inconsistent.");
+        }
+    };
+    auto check_length = [&](size_t actual, size_t expected, const std::string &name) {
+        check(actual == expected, "section " + name);
+    };
+    // a string table needs count strings with offsets increasing from zero and ending within its data.
+    auto check_strings = [&](const int64_t* offsets, size_t num_offsets, size_t data_length, const std::string &name) {
+        check(num_offsets > 0 && offsets[0] == 0, "string table " + name);
+        for (size_t i = 0; i + 1 < num_offsets; i++) {
+            check(offsets[i] <= offsets[i + 1], "string table " + name);
+        }
+        check((uint64_t)offsets[num_offsets - 1] <= data_length, "string table " + name);
+    };
+    const int64_t* parent = snapshot.section<int64_t>("parent", n);
+    const float* branch_length = snapshot.section<float>("branch_length", length);
+    check_length(length, n, "branch_length");
+    const int64_t* mutation_offsets = snapshot.section<int64_t>("mutation_offsets", length);
+    check_length(length, n + 1, "mutation_offsets");
+    const int32_t* position = snapshot.section<int32_t>("position", m);
+    const int8_t* ref_nuc = snapshot.section<int8_t>("ref_nuc", length);
+    check_length(length, m, "ref_nuc");
+    const int8_t* par_nuc = snapshot.section<int8_t>("par_nuc", length);
+    check_length(length, m, "par_nuc");
+    const int8_t* mut_nuc = snapshot.section<int8_t>("mut_nuc", length);
+    check_length(length, m, "mut_nuc");
+    const uint8_t* is_missing = snapshot.section<uint8_t>("is_missing", length);
+    check_length(length, m, "is_missing");
+    const int16_t* chrom = snapshot.section<int16_t>("chrom", length);
+    check_length(length, m, "chrom");
+    const int64_t* identifier_offsets = snapshot.section<int64_t>("identifiers_offsets", num_identifiers);
+    const uint8_t* identifier_data = snapshot.section<uint8_t>("identifiers_data", length);
+    check_length(num_identifiers, n + 1, "identifiers_offsets");
+    check_strings(identifier_offsets, num_identifiers, length, "identifiers");
+    const int64_t* chromosome_offsets = snapshot.section<int64_t>("chromosomes_offsets", num_chromosomes);
+    const uint8_t* chromosome_data = snapshot.section<uint8_t>("chromosomes_data", length);
+    check_strings(chromosome_offsets, num_chromosomes, length, "chromosomes");
+    const int64_t* annotation_offsets = snapshot.section<int64_t>("annotations_offsets", num_annotations);
+    const uint8_t* annotation_data = snapshot.section<uint8_t>("annotations_data", length);
+    check(num_annotations > 0 && ((n == 0) ? num_annotations == 1 : ((num_annotations - 1) % n == 0 && (num_annotations - 1) / n == levels)), "section annotations_offsets");
+    check_strings(annotation_offsets, num_annotations, length, "annotations");
+    size_t num_condensed;
+    const int64_t* condensed_offsets = snapshot.section<int64_t>("condensed_offsets", num_condensed);
+    const uint8_t* condensed_data = snapshot.section<uint8_t>("condensed_data", length);
+    check_strings(condensed_offsets, num_condensed, length, "condensed");
+    const int64_t* condensed_groups = snapshot.section<int64_t>("condensed_groups", num_groups);
+    // each condensed group is a name followed by its samples, so groups are non-empty ranges covering the condensed table in order.
+    check(num_groups > 0 && condensed_groups[0] == 0 && (uint64_t)condensed_groups[num_groups - 1] <= num_condensed - 1, "section condensed_groups");
+    for (size_t g = 0; g + 1 < num_groups; g++) {
+        check(condensed_groups[g] < condensed_groups[g + 1], "section condensed_groups");
+    }
+    // nodes are in preorder, so the root comes first and every other node follows its parent.
+    for (size_t i = 0; i < n; i++) {
+        check((i == 0) ? parent[i] == -1 : (parent[i] >= 0 && (size_t)parent[i] < i), "section parent");
+    }
+    check(mutation_offsets[0] == 0 && (uint64_t)mutation_offsets[n] == m, "section mutation_offsets");
+    for (size_t i = 0; i < n; i++) {
+        check(mutation_offsets[i] <= mutation_offsets[i + 1], "section mutation_offsets");
+    }
+    for (size_t k = 0; k < m; k++) {
+        check(chrom[k] >= 0 && (size_t)chrom[k] + 1 < num_chromosomes, "section chrom");
+    }
+
+    std::vector<std::string> chromosomes;
+    for (size_t c = 0; c + 1 < num_chromosomes; c++) {
+        auto s = snapshot.string_at(chromosome_offsets, chromosome_data, c);
+        chromosomes.emplace_back(s.first, s.second);
+    }
+    MAT::Tree T;
+    std::vector<MAT::Node*> nodes(n);
+    for (size_t i = 0; i < n; i++) {
+        auto id = snapshot.string_at(identifier_offsets, identifier_data, i);
+        if (parent[i] < 0) {
+            nodes[i] = T.create_node(std::string(id.first, id.second), branch_length[i], levels);
+        } else {
+            nodes[i] = T.create_node(std::string(id.first, id.second), nodes[parent[i]], branch_length[i]);
+        }
+        MAT::Node* node = nodes[i];
+        node->clade_annotations.resize(levels);
+        for (size_t l = 0; l < levels; l++) {
+            auto ann = snapshot.string_at(annotation_offsets, annotation_data, i * levels + l);
+            node->clade_annotations[l].assign(ann.first, ann.second);
+        }
+        node->mutations.resize(mutation_offsets[i + 1] - mutation_offsets[i]);
+        for (int64_t k = mutation_offsets[i]; k < mutation_offsets[i + 1]; k++) {
+            MAT::Mutation &mut = node->mutations[k - mutation_offsets[i]];
+            mut.chrom = chromosomes[chrom[k]];
+            mut.position = position[k];
+            mut.ref_nuc = ref_nuc[k];
+            mut.par_nuc = par_nuc[k];
+            mut.mut_nuc = mut_nuc[k];
+            mut.is_missing = is_missing[k];
+        }
+    }
+    T.curr_internal_node = meta[1];
+    for (size_t g = 0; g + 1 < num_groups; g++) {
+        auto name = snapshot.string_at(condensed_offsets, condensed_data, condensed_groups[g]);
+        std::vector<std::string> samples;
+        for (int64_t s = condensed_groups[g] + 1; s < condensed_groups[g + 1]; s++) {
+            auto sample = snapshot.string_at(condensed_offsets, condensed_data, s);
+            samples.emplace_back(sample.first, sample.second);
+            T.condensed_leaves.insert(samples.back());
+        }
+        T.condensed_nodes.emplace(std::string(name.first, name.second), samples);
+    }
+    return T;
+}
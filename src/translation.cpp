@@ -0,0 +1,195 @@
+/*incremental translation of a tree which is edited between translations.
+The codon changes on a branch depend only on the mutations of that node and the haplotype of its parent. Changing the mutations of a node
+or moving it therefore changes the translation of its subtree only, and adding a node or merging a node into its parent changes that node
+only. The cache records these nodes by identifier as the tree is edited, and on the next translation retranslates just those subtrees
+and nodes, each starting from the codon states at its parent, so the result can be merged into the previous translation by identifier.
+Nodes are tracked by identifier rather than by pointer because removed nodes are deleted by the tree.*/
+#pragma once
+#include "usher/src/usher_graph.hpp"
+#include "additional.cpp"
+#include <unordered_set>
+
+// Codon changes for the retranslated part of the tree. Every node in retranslated is replaced in the previous translation by its changes
+// (which may be none), and every identifier in removed is no longer in the tree. If full is true, changes is the whole translation instead.
+struct TranslationUpdate {
+    bool full;
+    std::vector<CodonChange> changes;
+    std::vector<MAT::Node*> retranslated;
+    std::vector<std::string> removed;
+};
+
+class TranslationCache {
+  public:
+    // Discard the previous translation, so the next update translates the whole tree.
+    void reset() {
+        complete = false;
+        dirty_subtrees.clear();
+        dirty_nodes.clear();
+        removed.clear();
+        detached.clear();
+    }
+
+    // The mutations above or on this node have changed.
+    void mark_subtree(const std::string &identifier) {
+        if (complete) {
+            dirty_subtrees.insert(identifier);
+        }
+    }
+
+    // This node was added or its mutations were merged with those of its parent, without changing the haplotypes below it.
+    void mark_node(const std::string &identifier) {
+        if (complete) {
+            dirty_nodes.insert(identifier);
+        }
+    }
+
+    void mark_subtrees(const std::vector<std::string> &identifiers) {
+        for (auto &identifier: identifiers) {
+            mark_subtree(identifier);
+        }
+    }
+
+    void mark_nodes(const std::vector<std::string> &identifiers) {
+        for (auto &identifier: identifiers) {
+            mark_node(identifier);
+        }
+    }
+
+    /*Call before a node is moved or removed. Moving or removing a node can delete its former ancestors which are left without children,
+    and merge an ancestor left with a single child into that child; the nodes which could be affected are recorded here and checked by
+    after_detach.*/
+    void before_detach(MAT::Tree* T, MAT::Node* node, bool removing) {
+        if (!complete) {
+            return;
+        }
+        detached.clear();
+        if (removing) {
+            for (auto n: T->depth_first_expansion(node)) {
+                removed.push_back(n->identifier);
+            }
+        } else {
+            dirty_subtrees.insert(node->identifier);
+        }
+        // an ancestor left without children is deleted in turn, one left with a single child is merged into it, and otherwise nothing above changes.
+        MAT::Node* from = node;
+        for (MAT::Node* anc = node->parent; anc != NULL; anc = anc->parent) {
+            detached.push_back({anc->identifier, ""});
+            if (anc->children.size() == 2) {
+                for (auto child: anc->children) {
+                    if (child != from) {
+                        detached.push_back({child->identifier, anc->identifier});
+                    }
+                }
+            }
+            if (anc->children.size() != 1) {
+                break;
+            }
+            from = anc;
+        }
+    }
+
+    void after_detach(MAT::Tree* T) {
+        for (auto &d: detached) {
+            MAT::Node* n = T->get_node(d.first);
+            if (n == NULL) {
+                removed.push_back(d.first);
+            } else if (!d.second.empty() && (n->parent == NULL || n->parent->identifier != d.second)) {
+                // a node merged into this one may itself have had changes below it still to be retranslated.
+                if (dirty_subtrees.count(d.second)) {
+                    dirty_subtrees.insert(d.first);
+                } else {
+                    dirty_nodes.insert(d.first);
+                }
+            }
+        }
+        detached.clear();
+    }
+
+    /*Bring the translation up to date with the tree. The first call, and any call after reset or after edits touching a large part of
+    the tree, translates the whole tree. Otherwise only the recorded subtrees and nodes are translated, in parallel if requested.*/
+    TranslationUpdate update(MAT::Tree* T, const TranslationContext &ctx, bool parallel) {
+        TranslationUpdate result;
+        result.full = !complete || (dirty_subtrees.size() + dirty_nodes.size()) * 64 > tree_size;
+        if (result.full) {
+            result.changes = parallel ? translate_tree_parallel(T, ctx, 0) : translate_tree(T, ctx);
+            reset();
+            complete = true;
+            tree_size = T->depth_first_expansion(T->root).size();
+            return result;
+        }
+        std::unordered_set<MAT::Node*> roots;
+        for (auto &identifier: dirty_subtrees) {
+            MAT::Node* n = T->get_node(identifier);
+            if (n != NULL) {
+                roots.insert(n);
+            }
+        }
+        // retranslate each node once: skip subtrees and nodes below another recorded subtree.
+        struct Segment {
+            std::vector<MAT::Node*> nodes;
+            std::vector<CodonChange> changes;
+        };
+        std::vector<Segment> segments;
+        for (auto root: roots) {
+            if (!below(root->parent, roots)) {
+                segments.push_back({T->depth_first_expansion(root), {}});
+            }
+        }
+        for (auto &identifier: dirty_nodes) {
+            MAT::Node* n = T->get_node(identifier);
+            if (n != NULL && !below(n, roots)) {
+                segments.push_back({{n}, {}});
+            }
+        }
+        auto translate_segment = [&](Segment &segment) {
+            std::vector<FlatCodon> codons = ctx.codons;
+            std::vector<MAT::Node*> ancestry;
+            for (MAT::Node* anc = segment.nodes[0]->parent; anc != NULL; anc = anc->parent) {
+                ancestry.push_back(anc);
+            }
+            for (auto it = ancestry.rbegin(); it != ancestry.rend(); it++) {
+                apply_mutations(ctx, codons, *it);
+            }
+            translate_nodes(ctx, codons, segment.nodes, 0, segment.nodes.size(), segment.changes);
+        };
+        if (parallel) {
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, segments.size(), 1), [&](const tbb::blocked_range<size_t> &r) {
+                for (size_t s = r.begin(); s < r.end(); s++) {
+                    translate_segment(segments[s]);
+                }
+            });
+        } else {
+            for (auto &segment: segments) {
+                translate_segment(segment);
+            }
+        }
+        for (auto &segment: segments) {
+            result.retranslated.insert(result.retranslated.end(), segment.nodes.begin(), segment.nodes.end());
+            result.changes.insert(result.changes.end(), segment.changes.begin(), segment.changes.end());
+        }
+        result.removed = std::move(removed);
+        removed.clear();
+        dirty_subtrees.clear();
+        dirty_nodes.clear();
+        return result;
+    }
+
+  private:
+    bool complete = false;
+    // the number of nodes at the last full translation; beyond a small fraction of it, edits are retranslated with the whole tree
+    size_t tree_size = 0;
+    std::unordered_set<std::string> dirty_subtrees;
+    std::unordered_set<std::string> dirty_nodes;
+    std::vector<std::string> removed;
+    // nodes near a node being moved or removed, with the identifier of their parent beforehand (empty for its former ancestors)
+    std::vector<std::pair<std::string, std::string>> detached;
+
+    static bool below(MAT::Node* node, const std::unordered_set<MAT::Node*> &roots) {
+        for (; node != NULL; node = node->parent) {
+            if (roots.count(node)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};